@@ -0,0 +1,397 @@
+#include "Tree.h"
+#include "TreeImage.h"
+#include "TreeSnapshot.h"
+#include "WriteAheadLog.h"
+#include "fs_utils.h"
+#include "path_utils.h"
+#include "safe_allocations.h"
+#include "sync_utils.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * A checkpoint directory holds a base image ("base.img", see TreeImage.h) and the deltas written
+ * since ("delta-000001", "delta-000002", ...). A delta is a write-ahead log whose records, all
+ * stamped with its version, turn the tree at the version of the previous checkpoint into the tree at
+ * its own version. They hold at most DELTA_OPS_PER_RECORD operations each, so that neither a record
+ * nor the transaction replaying it grows with the length of the interval. A delta is published whole,
+ * so recovery sees all of its records or none of them. Recovery thus loads the base and replays the
+ * deltas in order (see `tree_wal_replay`), skipping any stale delta older than the base.
+ *
+ * The dirty directories are found through the snapshots: a checkpoint takes a snapshot and compares
+ * it with the snapshot of the previous checkpoint. Every directory modified in between has had its
+ * image discarded and rebuilt, while untouched subtrees are still shared, so the comparison skips
+ * them by pointer equality and its cost is proportional to the changes. The tree itself is locked
+ * only while the snapshot is taken, which rebuilds just the modified paths as well; see Tree.h for
+ * what that holds up.
+ *
+ * Once there are enough deltas, the checkpoint writes its snapshot as a new base, and the deltas
+ * are deleted. They are not merged: the snapshot already holds everything they would add up to.
+ */
+
+/** Name of the base image in a checkpoint directory **/
+#define BASE_NAME "base.img"
+
+/** Prefix of the names of delta files **/
+#define DELTA_PREFIX "delta-"
+
+/** Suffix of files being written, renamed into place once complete **/
+#define TEMP_SUFFIX ".tmp"
+
+/** Largest number of operations in a single record of a delta **/
+#define DELTA_OPS_PER_RECORD 4096
+
+struct TreeCheckpointer {
+    Tree* tree;
+    char* directory;
+    unsigned interval_ms;          /** Time between checkpoints **/
+    size_t deltas_per_image;       /** Number of deltas written before a new base replaces them **/
+    TreeSnapshot* previous;        /** Snapshot saved by the last checkpoint **/
+    size_t deltas;                 /** Number of deltas since the base **/
+    int error;                     /** First error of a checkpoint **/
+    pthread_t thread;
+    pthread_mutex_t mutex;         /** Protects `stopping` **/
+    pthread_cond_t stop_cond;      /** Signalled when the checkpointer is to stop **/
+    bool stopping;
+};
+
+/** Operations turning one snapshot into another **/
+typedef struct SnapDiff {
+    WalOp* ops;
+    size_t count, capacity;
+} SnapDiff;
+
+/**
+ * Builds the path of a file in the checkpoint directory.
+ * @return : malloc'd path
+ */
+static char* file_path(const char* directory, const char* name, const char* suffix) {
+    size_t size = strlen(directory) + strlen(name) + strlen(suffix) + 2;
+    char* path = safe_malloc(size);
+    snprintf(path, size, "%s/%s%s", directory, name, suffix);
+    return path;
+}
+
+static char* delta_path(const char* directory, size_t number, const char* suffix) {
+    char name[32];
+    snprintf(name, sizeof(name), DELTA_PREFIX "%06zu", number);
+    return file_path(directory, name, suffix);
+}
+
+static void diff_push(SnapDiff* diff, WalOpType type, const char* path) {
+    if (diff->count == diff->capacity) {
+        diff->capacity = diff->capacity ? 2 * diff->capacity : 64;
+        diff->ops = safe_realloc(diff->ops, diff->capacity * sizeof(WalOp));
+    }
+    char* copy = strdup(path);
+    CHECK_POINTER(copy);
+    diff->ops[diff->count++] = (WalOp) { .type = type, .path = copy };
+}
+
+/**
+ * Appends a name to the path in the buffer, growing it if needed.
+ * @return : length of the new path
+ */
+static size_t append_name(char** path, size_t* capacity, size_t len, const char* name) {
+    size_t name_len = strlen(name);
+    if (len + name_len + 2 > *capacity) {
+        *capacity = 2 * (len + name_len + 2);
+        *path = safe_realloc(*path, *capacity);
+    }
+    memcpy(*path + len, name, name_len);
+    (*path)[len + name_len] = '/';
+    (*path)[len + name_len + 1] = '\0';
+    return len + name_len + 1;
+}
+
+/** Removes the subtree in post-order, so that every directory is empty when it is removed **/
+static void diff_removed(SnapDiff* diff, SnapNode* node, char** path, size_t* capacity, size_t len) {
+    for (size_t i = 0; i < node->n_children; i++) {
+        size_t child_len = append_name(path, capacity, len, node->names[i]);
+        diff_removed(diff, node->children[i], path, capacity, child_len);
+    }
+    (*path)[len] = '\0';
+    diff_push(diff, WAL_REMOVE, *path);
+}
+
+/** Creates the subtree in pre-order, so that every directory has its parent when it is created **/
+static void diff_created(SnapDiff* diff, SnapNode* node, char** path, size_t* capacity, size_t len) {
+    diff_push(diff, WAL_CREATE, *path);
+    for (size_t i = 0; i < node->n_children; i++) {
+        size_t child_len = append_name(path, capacity, len, node->names[i]);
+        diff_created(diff, node->children[i], path, capacity, child_len);
+    }
+}
+
+/**
+ * Appends the operations turning the `old` image of a directory into the `new` one.
+ * Subdirectories are matched by name, merging the two sorted lists; shared images are skipped.
+ * A moved directory shows up as a removal and a creation.
+ */
+static void diff_nodes(SnapDiff* diff, SnapNode* old, SnapNode* new, char** path, size_t* capacity, size_t len) {
+    if (old == new)
+        return; // Untouched since the previous checkpoint
+    size_t i = 0, j = 0;
+    while (i < old->n_children || j < new->n_children) {
+        int cmp = i == old->n_children ? 1 : j == new->n_children ? -1 : strcmp(old->names[i], new->names[j]);
+        if (cmp < 0) {
+            size_t child_len = append_name(path, capacity, len, old->names[i]);
+            diff_removed(diff, old->children[i++], path, capacity, child_len);
+        }
+        else if (cmp > 0) {
+            size_t child_len = append_name(path, capacity, len, new->names[j]);
+            diff_created(diff, new->children[j++], path, capacity, child_len);
+        }
+        else {
+            size_t child_len = append_name(path, capacity, len, new->names[j]);
+            diff_nodes(diff, old->children[i++], new->children[j++], path, capacity, child_len);
+        }
+        (*path)[len] = '\0';
+    }
+}
+
+/**
+ * Writes a file through a temporary one, so that it appears complete or not at all.
+ * @param path : final path of the file
+ * @param temp_path : path of the temporary file
+ * @param result : result of writing and syncing the temporary file
+ * @return : success, or the errno of the first failed step
+ */
+static int publish_file(const char* path, const char* temp_path, int result) {
+    if (result == SUCCESS && rename(temp_path, path) != 0)
+        result = errno;
+    if (result == SUCCESS)
+        result = sync_parent_directory(path);
+    if (result != SUCCESS)
+        unlink(temp_path);
+    return result;
+}
+
+/**
+ * Writes the snapshot as the new base image, and removes the deltas it supersedes.
+ */
+static int write_base(TreeCheckpointer* checkpointer, TreeSnapshot* snapshot) {
+    char* path = file_path(checkpointer->directory, BASE_NAME, "");
+    char* temp_path = file_path(checkpointer->directory, BASE_NAME, TEMP_SUFFIX);
+    int result = SUCCESS;
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        result = errno;
+    }
+    else {
+        result = image_write(snapshot->root, snapshot->version, fd);
+        if (result == SUCCESS && fdatasync(fd) != 0)
+            result = errno;
+        close(fd);
+    }
+    result = publish_file(path, temp_path, result);
+    free(temp_path);
+    free(path);
+    if (result != SUCCESS)
+        return result;
+
+    // The deltas are older than the base now; recovery would skip them anyway.
+    for (size_t i = 1; i <= checkpointer->deltas; i++) {
+        char* delta = delta_path(checkpointer->directory, i, "");
+        unlink(delta);
+        free(delta);
+    }
+    checkpointer->deltas = 0;
+    return SUCCESS;
+}
+
+/**
+ * Writes the changes from the previous checkpoint to the snapshot as the next delta.
+ */
+static int write_delta(TreeCheckpointer* checkpointer, TreeSnapshot* snapshot) {
+    SnapDiff diff = { 0 };
+    size_t capacity = MAX_PATH_LENGTH + 1;
+    char* path = safe_malloc(capacity);
+    strcpy(path, "/");
+    diff_nodes(&diff, checkpointer->previous->root, snapshot->root, &path, &capacity, 1);
+    free(path);
+
+    int result = SUCCESS;
+    if (diff.count > 0) {
+        size_t number = checkpointer->deltas + 1;
+        char* final_path = delta_path(checkpointer->directory, number, "");
+        char* temp_path = delta_path(checkpointer->directory, number, TEMP_SUFFIX);
+        unlink(temp_path); // A leftover of an interrupted checkpoint
+        WriteAheadLog* delta = NULL;
+        result = wal_open(temp_path, &delta);
+        if (result == SUCCESS) {
+            // Every operation applies to the tree left by the ones before it, so the records can be
+            // cut anywhere.
+            for (size_t committed = 0; committed < diff.count; committed += DELTA_OPS_PER_RECORD) {
+                size_t n = diff.count - committed;
+                if (n > DELTA_OPS_PER_RECORD)
+                    n = DELTA_OPS_PER_RECORD;
+                wal_append(delta, snapshot->version, diff.ops + committed, n);
+            }
+            result = wal_close(delta);
+        }
+        result = publish_file(final_path, temp_path, result);
+        if (result == SUCCESS)
+            checkpointer->deltas = number;
+        free(temp_path);
+        free(final_path);
+    }
+
+    for (size_t i = 0; i < diff.count; i++)
+        free((char*)diff.ops[i].path);
+    free(diff.ops);
+    return result;
+}
+
+/**
+ * Saves the current version of the tree, if it has changed since the last checkpoint.
+ * @return : success, or the errno of a failed write
+ */
+static int checkpoint(TreeCheckpointer* checkpointer) {
+    TreeSnapshot* snapshot = tree_snapshot(checkpointer->tree);
+    if (checkpointer->previous && snapshot->version == checkpointer->previous->version) {
+        snapshot_free(snapshot);
+        return SUCCESS;
+    }
+
+    int result;
+    if (!checkpointer->previous || checkpointer->deltas >= checkpointer->deltas_per_image)
+        result = write_base(checkpointer, snapshot);
+    else
+        result = write_delta(checkpointer, snapshot);
+
+    if (result != SUCCESS) {
+        // The next checkpoint starts over from a new base, not knowing what this one has left behind.
+        snapshot_free(snapshot);
+        if (checkpointer->previous)
+            snapshot_free(checkpointer->previous);
+        checkpointer->previous = NULL;
+        return result;
+    }
+    if (checkpointer->previous)
+        snapshot_free(checkpointer->previous);
+    checkpointer->previous = snapshot;
+    return SUCCESS;
+}
+
+static void* checkpointer_main(void* data) {
+    TreeCheckpointer* checkpointer = data;
+    bool stopping = false;
+    while (!stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += checkpointer->interval_ms / 1000;
+        deadline.tv_nsec += (long)(checkpointer->interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        PTHREAD_CHECK(pthread_mutex_lock(&checkpointer->mutex));
+        while (!checkpointer->stopping) {
+            int result = pthread_cond_timedwait(&checkpointer->stop_cond, &checkpointer->mutex, &deadline);
+            if (result == ETIMEDOUT)
+                break;
+            PTHREAD_CHECK(result);
+        }
+        stopping = checkpointer->stopping;
+        PTHREAD_CHECK(pthread_mutex_unlock(&checkpointer->mutex));
+
+        // The tree is saved once more on the way out
+        int result = checkpoint(checkpointer);
+        if (checkpointer->error == SUCCESS)
+            checkpointer->error = result;
+    }
+    return NULL;
+}
+
+/**
+ * Removes the deltas left by a previous checkpointer, which extend a base other than the one about
+ * to be written. They must be gone for good before that base is published: recovery would otherwise
+ * replay the ones with a version above it onto an unrelated tree.
+ * @return : success, or the errno of a failed system call
+ */
+static int remove_stale_deltas(const char* directory) {
+    DIR* dir = opendir(directory);
+    if (!dir)
+        return errno;
+    int result = SUCCESS;
+    struct dirent* entry;
+    while ((entry = readdir(dir))) {
+        if (strncmp(entry->d_name, DELTA_PREFIX, strlen(DELTA_PREFIX)) == 0
+            && unlinkat(dirfd(dir), entry->d_name, 0) != 0 && result == SUCCESS)
+            result = errno;
+    }
+    if (result == SUCCESS && fsync(dirfd(dir)) != 0)
+        result = errno;
+    closedir(dir);
+    return result;
+}
+
+TreeCheckpointer* tree_checkpointer_start(Tree* tree, const char* directory, unsigned interval_ms,
+                                          size_t deltas_per_image) {
+    TreeCheckpointer* checkpointer = safe_calloc(1, sizeof(TreeCheckpointer));
+    checkpointer->tree = tree;
+    checkpointer->directory = strdup(directory);
+    CHECK_POINTER(checkpointer->directory);
+    checkpointer->interval_ms = interval_ms;
+    checkpointer->deltas_per_image = deltas_per_image;
+
+    // Start from a base of the current tree, so that every delta has something to apply to.
+    int result = remove_stale_deltas(directory);
+    if (result == SUCCESS)
+        result = checkpoint(checkpointer);
+    if (result != SUCCESS) {
+        free(checkpointer->directory);
+        free(checkpointer);
+        errno = result;
+        return NULL;
+    }
+
+    PTHREAD_CHECK(pthread_mutex_init(&checkpointer->mutex, NULL));
+    PTHREAD_CHECK(pthread_cond_init(&checkpointer->stop_cond, NULL));
+    PTHREAD_CHECK(pthread_create(&checkpointer->thread, NULL, checkpointer_main, checkpointer));
+    return checkpointer;
+}
+
+int tree_checkpointer_stop(TreeCheckpointer* checkpointer) {
+    UNDER_MUTEX(&checkpointer->mutex,
+        checkpointer->stopping = true;
+        PTHREAD_CHECK(pthread_cond_signal(&checkpointer->stop_cond));
+    );
+    PTHREAD_CHECK(pthread_join(checkpointer->thread, NULL));
+
+    int result = checkpointer->error;
+    if (checkpointer->previous)
+        snapshot_free(checkpointer->previous);
+    PTHREAD_CHECK(pthread_cond_destroy(&checkpointer->stop_cond));
+    PTHREAD_CHECK(pthread_mutex_destroy(&checkpointer->mutex));
+    free(checkpointer->directory);
+    free(checkpointer);
+    return result;
+}
+
+Tree* tree_checkpoint_recover(const char* directory) {
+    char* path = file_path(directory, BASE_NAME, "");
+    Tree* tree = tree_load_mmap(path);
+    free(path);
+    if (!tree)
+        return NULL;
+
+    for (size_t i = 1;; i++) {
+        path = delta_path(directory, i, "");
+        int result = tree_wal_replay(tree, path);
+        free(path);
+        if (result == ENOENT)
+            break; // The last delta
+        if (result != SUCCESS) {
+            tree_free(tree);
+            errno = result;
+            return NULL;
+        }
+    }
+    return tree;
+}
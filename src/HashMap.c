@@ -2,59 +2,138 @@
 #include <string.h>
 
 #include "HashMap.h"
+#include "mem_stats.h"
+#include "probes.h"
+#include "safe_allocations.h"
 
-// We fix the number of hash buckets for simplicity.
-#define N_BUCKETS 8
+// Number of hash buckets of a new map, kept inside the map itself.
+#define MIN_BUCKETS 8
+// The number of buckets doubles once there are more entries per bucket than this.
+#define MAX_LOAD 2
 
 typedef struct Pair Pair;
 
 struct Pair {
-    char* key;
     void* value;
     Pair* next; // Next item in a single-linked list.
+    char key[]; // Stored along with the pair, so that an entry takes a single allocation.
 };
 
 struct HashMap {
-    Pair* buckets[N_BUCKETS]; // Linked lists of key-value pairs.
+    Pair** buckets; // Linked lists of key-value pairs.
+    size_t n_buckets; // Number of buckets, a power of two.
     size_t size; // total number of entries in map.
+    size_t key_bytes; // Total length of the keys, with their terminating NULs.
+    Pair* small_buckets[MIN_BUCKETS]; // The buckets of a map which has never grown.
 };
 
 static unsigned int get_hash(const char* key);
 
 HashMap* hmap_new()
+{
+    return hmap_new_with_capacity(0);
+}
+
+HashMap* hmap_new_with_capacity(size_t capacity)
 {
     HashMap* map = malloc(sizeof(HashMap));
     if (!map)
         return NULL;
     memset(map, 0, sizeof(HashMap));
+    map->n_buckets = MIN_BUCKETS;
+    while (map->n_buckets * MAX_LOAD < capacity)
+        map->n_buckets *= 2;
+    if (map->n_buckets == MIN_BUCKETS) {
+        map->buckets = map->small_buckets;
+    } else {
+        map->buckets = calloc(map->n_buckets, sizeof(Pair*));
+        if (!map->buckets) {
+            free(map);
+            return NULL;
+        }
+        mem_account(MEM_BUCKETS, map->n_buckets * sizeof(Pair*), 1);
+    }
+    mem_account(MEM_MAPS, sizeof(HashMap), 1);
     return map;
 }
 
+// Account for `n` pairs with keys of `key_bytes` in total being added to the map, or removed if negative.
+static void account_pairs(HashMap* map, int64_t n, int64_t key_bytes)
+{
+    map->key_bytes += key_bytes;
+    mem_account(MEM_PAIRS, n * (int64_t)sizeof(Pair), n);
+    mem_account(MEM_KEYS, key_bytes, 0); // Allocated along with the pairs
+}
+
 void hmap_free(HashMap* map)
 {
-    for (int h = 0; h < N_BUCKETS; ++h) {
+    for (size_t h = 0; h < map->n_buckets; ++h) {
         for (Pair* p = map->buckets[h]; p;) {
             Pair* q = p;
             p = p->next;
-            free(q->key);
             free(q);
         }
     }
+    account_pairs(map, -(int64_t)map->size, -(int64_t)map->key_bytes);
+    if (map->buckets != map->small_buckets) {
+        free(map->buckets);
+        mem_account(MEM_BUCKETS, -(int64_t)(map->n_buckets * sizeof(Pair*)), -1);
+    }
     free(map);
+    mem_account(MEM_MAPS, -(int64_t)sizeof(HashMap), -1);
+}
+
+static size_t get_bucket(HashMap* map, const char* key)
+{
+    return get_hash(key) & (map->n_buckets - 1);
+}
+
+// Double the number of buckets if the map has become too full.
+// If memory runs out, the map just stays as it is - it only gets slower.
+static void hmap_grow(HashMap* map)
+{
+    if (map->size <= map->n_buckets * MAX_LOAD)
+        return;
+    size_t n_buckets = 2 * map->n_buckets;
+    Pair** buckets = calloc(n_buckets, sizeof(Pair*));
+    if (!buckets)
+        return;
+    for (size_t h = 0; h < map->n_buckets; ++h) {
+        for (Pair* p = map->buckets[h]; p;) {
+            Pair* next = p->next;
+            size_t new_h = get_hash(p->key) & (n_buckets - 1);
+            p->next = buckets[new_h];
+            buckets[new_h] = p;
+            p = next;
+        }
+    }
+    if (map->buckets != map->small_buckets) {
+        free(map->buckets);
+        mem_account(MEM_BUCKETS, -(int64_t)(map->n_buckets * sizeof(Pair*)), -1);
+    }
+    mem_account(MEM_BUCKETS, n_buckets * sizeof(Pair*), 1);
+    TREE_PROBE3(hmap__grow, map, map->n_buckets, n_buckets);
+    map->buckets = buckets;
+    map->n_buckets = n_buckets;
 }
 
-static Pair* hmap_find(HashMap* map, int h, const char* key)
+static Pair* hmap_find(HashMap* map, size_t h, const char* key)
 {
+    size_t steps = 0;
     for (Pair* p = map->buckets[h]; p; p = p->next) {
-        if (strcmp(key, p->key) == 0)
+        steps++;
+        if (strcmp(key, p->key) == 0) {
+            TREE_PROBE4(hmap__probe, map, h, steps, 1);
             return p;
+        }
     }
+    TREE_PROBE4(hmap__probe, map, h, steps, 0);
     return NULL;
 }
 
 void* hmap_get(HashMap* map, const char* key)
 {
-    int h = get_hash(key);
+    size_t h = get_bucket(map, key);
     Pair* p = hmap_find(map, h, key);
     if (p)
         return p->value;
@@ -62,32 +141,47 @@ void* hmap_get(HashMap* map, const char* key)
         return NULL;
 }
 
+// Add a pair to the bucket `h`, without checking whether the key is already there.
+static Pair* add_pair(HashMap* map, size_t h, const char* key, void* value)
+{
+    size_t key_size = strlen(key) + 1;
+    Pair* new_p = safe_malloc(sizeof(Pair) + key_size);
+    memcpy(new_p->key, key, key_size);
+    new_p->value = value;
+    new_p->next = map->buckets[h];
+    map->buckets[h] = new_p;
+    map->size++;
+    account_pairs(map, 1, key_size);
+    hmap_grow(map);
+    return new_p;
+}
+
 bool hmap_insert(HashMap* map, const char* key, void* value)
 {
     if (!value)
         return false;
-    int h = get_hash(key);
+    size_t h = get_bucket(map, key);
     Pair* p = hmap_find(map, h, key);
     if (p)
         return false; // Already exists.
-    Pair* new_p = malloc(sizeof(Pair));
-    new_p->key = strdup(key);
-    new_p->value = value;
-    new_p->next = map->buckets[h];
-    map->buckets[h] = new_p;
-    map->size++;
+    add_pair(map, h, key, value);
     return true;
 }
 
+const char* hmap_insert_new(HashMap* map, const char* key, void* value)
+{
+    return add_pair(map, get_bucket(map, key), key, value)->key;
+}
+
 bool hmap_remove(HashMap* map, const char* key)
 {
-    int h = get_hash(key);
+    size_t h = get_bucket(map, key);
     Pair** pp = &(map->buckets[h]);
     while (*pp) {
         Pair* p = *pp;
         if (strcmp(key, p->key) == 0) {
             *pp = p->next;
-            free(p->key);
+            account_pairs(map, -1, -(int64_t)(strlen(p->key) + 1));
             free(p);
             map->size--;
             return true;
@@ -102,6 +196,14 @@ size_t hmap_size(HashMap* map)
     return map->size;
 }
 
+size_t hmap_memory(HashMap* map)
+{
+    size_t bytes = sizeof(HashMap) + map->size * sizeof(Pair) + map->key_bytes;
+    if (map->buckets != map->small_buckets)
+        bytes += map->n_buckets * sizeof(Pair*);
+    return bytes;
+}
+
 HashMapIterator hmap_iterator(HashMap* map)
 {
     HashMapIterator it = { 0, map->buckets[0] };
@@ -111,7 +213,7 @@ HashMapIterator hmap_iterator(HashMap* map)
 bool hmap_next(HashMap* map, HashMapIterator* it, const char** key, void** value)
 {
     Pair* p = it->pair;
-    while (!p && it->bucket < N_BUCKETS - 1) {
+    while (!p && (size_t)it->bucket < map->n_buckets - 1) {
         p = map->buckets[++it->bucket];
     }
     if (!p)
@@ -129,5 +231,6 @@ static unsigned int get_hash(const char* key)
         hash = (hash << 3) + hash + *key;
         ++key;
     }
-    return hash % N_BUCKETS;
+    // Mix the high bits into the low ones, which select the bucket.
+    return hash ^ (hash >> 16);
 }
\ No newline at end of file
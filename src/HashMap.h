@@ -10,6 +10,9 @@ typedef struct HashMap HashMap;
 // Create a new, empty map.
 HashMap* hmap_new();
 
+// Create a new, empty map, sized to hold `capacity` elements without growing.
+HashMap* hmap_new_with_capacity(size_t capacity);
+
 // Clear the map and free its memory. This frees the map and the keys
 // copied by hmap_insert, but does not free any values.
 void hmap_free(HashMap* map);
@@ -23,6 +26,11 @@ void* hmap_get(HashMap* map, const char* key);
 // (The caller can free `key` at any time - the map internally uses a copy of it).
 bool hmap_insert(HashMap* map, const char* key, void* value);
 
+// Insert a `value` under `key`, which the caller guarantees is not in the map yet.
+// Skips the lookup done by hmap_insert, for building maps out of keys known to be distinct.
+// `value` must not be NULL. Returns the map's copy of `key`, which stays valid until the key is removed.
+const char* hmap_insert_new(HashMap* map, const char* key, void* value);
+
 // Remove the value under `key` and return true (the value is not free'd),
 // or do nothing and return false if `key` was not present.
 bool hmap_remove(HashMap* map, const char* key);
@@ -30,6 +38,9 @@ bool hmap_remove(HashMap* map, const char* key);
 // Return the number of elements in the map.
 size_t hmap_size(HashMap* map);
 
+// Return the number of bytes the map has requested from the allocator, including its pairs and keys.
+size_t hmap_memory(HashMap* map);
+
 typedef struct HashMapIterator HashMapIterator;
 
 // Return an iterator to the map. See `hmap_next`.
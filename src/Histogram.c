@@ -0,0 +1,75 @@
+#include "Histogram.h"
+#include <string.h>
+
+// Values below this are counted exactly, one per bucket.
+#define EXACT_LIMIT (1u << HIST_SUB_BUCKET_BITS)
+// Number of sub-buckets per power-of-two range above EXACT_LIMIT.
+#define HALF (1u << (HIST_SUB_BUCKET_BITS - 1))
+
+void hist_init(Histogram* hist) {
+    memset(hist, 0, sizeof(Histogram));
+}
+
+static size_t bucket_of(uint64_t value) {
+    if (value < EXACT_LIMIT)
+        return value;
+    // Keep the HIST_SUB_BUCKET_BITS highest bits of the value; `shift` tells which range it falls in.
+    unsigned shift = 63 - __builtin_clzll(value) - (HIST_SUB_BUCKET_BITS - 1);
+    return shift * HALF + (value >> shift);
+}
+
+// The largest value counted in the bucket.
+static uint64_t bucket_upper_bound(size_t bucket) {
+    if (bucket < EXACT_LIMIT)
+        return bucket;
+    unsigned shift = bucket / HALF - 1;
+    uint64_t sub_bucket = bucket - shift * HALF;
+    return ((sub_bucket + 1) << shift) - 1;
+}
+
+void hist_record(Histogram* hist, uint64_t value) {
+    hist->counts[bucket_of(value)]++;
+    hist->total++;
+    hist->sum += value;
+    if (value > hist->max)
+        hist->max = value;
+}
+
+void hist_merge(Histogram* into, const Histogram* from) {
+    for (size_t i = 0; i < HIST_BUCKETS; i++)
+        into->counts[i] += from->counts[i];
+    into->total += from->total;
+    into->sum += from->sum;
+    if (from->max > into->max)
+        into->max = from->max;
+}
+
+uint64_t hist_percentile(const Histogram* hist, double percentile) {
+    if (hist->total == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(percentile / 100.0 * hist->total + 0.5);
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank) {
+            uint64_t bound = bucket_upper_bound(i);
+            return bound < hist->max ? bound : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+double hist_mean(const Histogram* hist) {
+    return hist->total ? (double)hist->sum / hist->total : 0;
+}
+
+void hist_print_json(FILE* out, const Histogram* hist) {
+    fprintf(out, "{\"mean\": %.1f, \"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}",
+            hist_mean(hist),
+            (unsigned long long)hist_percentile(hist, 50),
+            (unsigned long long)hist_percentile(hist, 99),
+            (unsigned long long)hist_percentile(hist, 99.9),
+            (unsigned long long)hist->max);
+}
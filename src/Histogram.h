@@ -0,0 +1,37 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+
+// A histogram of non-negative integer values (typically latencies in nanoseconds) with bounded relative error.
+// Values below 2^HIST_SUB_BUCKET_BITS are counted exactly; above that, every power-of-two range is split
+// into 2^(HIST_SUB_BUCKET_BITS - 1) equal sub-buckets, so a value is known to within 1/64 of itself.
+// Recording is a few arithmetic instructions and an increment, with no allocation: the histogram is a
+// plain struct which can be kept per thread and merged afterwards.
+#define HIST_SUB_BUCKET_BITS 7
+#define HIST_BUCKETS ((64 - HIST_SUB_BUCKET_BITS + 2) << (HIST_SUB_BUCKET_BITS - 1))
+
+typedef struct Histogram {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total; // Number of recorded values.
+    uint64_t sum;   // Sum of recorded values, for the mean.
+    uint64_t max;   // Largest recorded value, exact.
+} Histogram;
+
+// Reset the histogram to hold no values.
+void hist_init(Histogram* hist);
+
+// Record a single value.
+void hist_record(Histogram* hist, uint64_t value);
+
+// Add all the values recorded in `from` to `into`.
+void hist_merge(Histogram* into, const Histogram* from);
+
+// Return the value below or at which `percentile` percent of the recorded values lie (0 < percentile <= 100),
+// rounded up to the end of its sub-bucket, or 0 if the histogram is empty.
+uint64_t hist_percentile(const Histogram* hist, double percentile);
+
+// Return the mean of the recorded values, or 0 if the histogram is empty.
+double hist_mean(const Histogram* hist);
+
+// Print the mean, the 50th, 99th and 99.9th percentiles and the maximum as a JSON object.
+void hist_print_json(FILE* out, const Histogram* hist);
@@ -0,0 +1,226 @@
+#include "SlowLog.h"
+#include "safe_allocations.h"
+#include "sync_utils.h"
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <linux/futex.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Number of slots of the ring buffer, a power of two **/
+#define RING_SIZE 1024
+
+/** An operation in the ring buffer **/
+typedef struct SlowOp {
+    const char* op;
+    char path[SLOW_LOG_MAX_PATH + 1];
+    char target[SLOW_LOG_MAX_PATH + 1];
+    bool has_target;
+    bool truncated;              /** Whether the path or the target was cut **/
+    int result;
+    uint64_t time;               /** Wall-clock time when the operation ended, in nanoseconds since the Epoch **/
+    uint64_t latency_ns;
+    SlowOpWaits waits;
+} SlowOp;
+
+/*
+ * The ring is a bounded queue after D. Vyukov: every slot carries a sequence number telling
+ * whose turn it is. A slot at position `pos` may be filled when its sequence is `pos`, and read
+ * when it is `pos + 1`; reading sets it to `pos + RING_SIZE`, for the next round of producers.
+ */
+typedef struct Slot {
+    atomic_size_t sequence;
+    SlowOp op;
+} Slot;
+
+struct SlowLog {
+    uint64_t threshold_ns;
+    FILE* file;
+    pthread_t drainer;
+    atomic_bool stopping;
+    atomic_uint sleeping;         /** 1 while the draining thread is asleep, or about to fall asleep **/
+    atomic_size_t tail;           /** Next position to be claimed by a producer **/
+    size_t head;                  /** Next position to be read by the draining thread **/
+    atomic_uint_least64_t dropped;
+    uint64_t reported_dropped;    /** Dropped operations already written to the file **/
+    int error;                    /** First error of a write **/
+    Slot slots[RING_SIZE];
+};
+
+static uint64_t realtime_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/** Copies a path into a slot, cutting it if it's too long. Returns whether it was cut **/
+static bool copy_path(char* to, const char* from) {
+    size_t length = strnlen(from, SLOW_LOG_MAX_PATH + 1);
+    bool truncated = length > SLOW_LOG_MAX_PATH;
+    if (truncated)
+        length = SLOW_LOG_MAX_PATH;
+    memcpy(to, from, length);
+    to[length] = '\0';
+    return truncated;
+}
+
+/** Wakes the draining thread if it is asleep **/
+static void wake_drainer(SlowLog* log) {
+    if (atomic_load(&log->sleeping) && atomic_exchange(&log->sleeping, 0))
+        syscall(SYS_futex, &log->sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+void slowlog_push(SlowLog* log, const char* op, const char* path, const char* target, int result,
+                  uint64_t latency_ns, const SlowOpWaits* waits) {
+    size_t pos = atomic_load_explicit(&log->tail, memory_order_relaxed);
+    Slot* slot;
+    for (;;) {
+        slot = &log->slots[pos & (RING_SIZE - 1)];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        if (sequence == pos) {
+            if (atomic_compare_exchange_weak_explicit(&log->tail, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if ((ptrdiff_t)(sequence - pos) < 0) {
+            // The slot still holds an operation from the previous round: the ring is full.
+            atomic_fetch_add_explicit(&log->dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&log->tail, memory_order_relaxed);
+        }
+    }
+
+    SlowOp* entry = &slot->op;
+    entry->op = op;
+    entry->truncated = copy_path(entry->path, path);
+    entry->has_target = target != NULL;
+    if (target)
+        entry->truncated |= copy_path(entry->target, target);
+    entry->result = result;
+    entry->time = realtime_ns();
+    entry->latency_ns = latency_ns;
+    entry->waits = *waits;
+    // Sequentially consistent, like the store of `sleeping` and the load of the sequence in `drainer_main`:
+    // either the draining thread sees the operation before it sleeps, or this sees it asleep.
+    atomic_store(&slot->sequence, pos + 1);
+    wake_drainer(log);
+}
+
+/** Writes the first `length` characters of a string, at most, as a JSON string literal **/
+static void write_json_string(FILE* file, const char* string, size_t length) {
+    fputc('"', file);
+    for (const unsigned char* c = (const unsigned char*)string; *c && length > 0; c++, length--) {
+        if (*c == '"' || *c == '\\')
+            fprintf(file, "\\%c", *c);
+        else if (*c < 0x20 || *c >= 0x7f)
+            fprintf(file, "\\u%04x", *c);
+        else
+            fputc(*c, file);
+    }
+    fputc('"', file);
+}
+
+/** Length of the prefix of a path which consists of `depth` components, or of the whole path if it is shorter **/
+static size_t prefix_length(const char* path, size_t depth) {
+    size_t length = 0;
+    while (path[length]) {
+        if (path[length++] == '/' && depth-- == 0)
+            break;
+    }
+    return length;
+}
+
+static void write_op(FILE* file, const SlowOp* op) {
+    fprintf(file, "{\"time_ns\": %llu, \"op\": \"%s\", \"path\": ", (unsigned long long)op->time, op->op);
+    write_json_string(file, op->path, SIZE_MAX);
+    if (op->has_target) {
+        fprintf(file, ", \"target\": ");
+        write_json_string(file, op->target, SIZE_MAX);
+    }
+    if (op->truncated)
+        fprintf(file, ", \"truncated\": true");
+    const SlowOpWaits* waits = &op->waits;
+    fprintf(file, ", \"result\": %d, \"latency_ns\": %llu, \"lock_wait_ns\": %llu, \"subtree_wait_ns\": %llu"
+                  ", \"locks\": %u, \"waits\": [",
+            op->result, (unsigned long long)op->latency_ns, (unsigned long long)waits->lock_wait_ns,
+            (unsigned long long)waits->subtree_wait_ns, waits->locks);
+    size_t kept = waits->n_waits < SLOW_LOG_MAX_WAITS ? waits->n_waits : SLOW_LOG_MAX_WAITS;
+    for (size_t i = 0; i < kept; i++) {
+        const SlowLockWait* wait = &waits->waits[i];
+        fprintf(file, "%s{\"lock\": %u, \"mode\": \"%s\", \"dir\": ", i ? ", " : "", wait->lock,
+                wait->reader ? "read" : "write");
+        const char* path = wait->on_target ? op->target : op->path;
+        write_json_string(file, path, prefix_length(path, wait->depth));
+        fprintf(file, ", \"wait_ns\": %llu}", (unsigned long long)wait->wait_ns);
+    }
+    fprintf(file, "]");
+    if (waits->n_waits > kept)
+        fprintf(file, ", \"more_waits\": %u", waits->n_waits - (uint32_t)kept);
+    fprintf(file, "}\n");
+}
+
+/** Writes out all the operations in the ring. Called by the draining thread only **/
+static void drain(SlowLog* log) {
+    for (;;) {
+        Slot* slot = &log->slots[log->head & (RING_SIZE - 1)];
+        if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != log->head + 1)
+            break;
+        write_op(log->file, &slot->op);
+        atomic_store_explicit(&slot->sequence, log->head + RING_SIZE, memory_order_release);
+        log->head++;
+    }
+    uint64_t dropped = atomic_load_explicit(&log->dropped, memory_order_relaxed);
+    if (dropped > log->reported_dropped) {
+        fprintf(log->file, "{\"time_ns\": %llu, \"dropped\": %llu}\n", (unsigned long long)realtime_ns(),
+                (unsigned long long)(dropped - log->reported_dropped));
+        log->reported_dropped = dropped;
+    }
+    if (fflush(log->file) != 0 && log->error == SUCCESS)
+        log->error = errno;
+}
+
+static void* drainer_main(void* arg) {
+    SlowLog* log = arg;
+    while (!atomic_load(&log->stopping)) {
+        drain(log);
+        atomic_store(&log->sleeping, 1);
+        Slot* next = &log->slots[log->head & (RING_SIZE - 1)];
+        if (atomic_load(&next->sequence) != log->head + 1 && !atomic_load(&log->stopping))
+            syscall(SYS_futex, &log->sleeping, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0);
+        atomic_store(&log->sleeping, 0);
+    }
+    drain(log);
+    return NULL;
+}
+
+int slowlog_open(const char* path, uint64_t threshold_ns, SlowLog** log) {
+    FILE* file = fopen(path, "ae");
+    if (!file)
+        return errno;
+    SlowLog* slow_log = safe_calloc(1, sizeof(SlowLog));
+    slow_log->threshold_ns = threshold_ns;
+    slow_log->file = file;
+    for (size_t i = 0; i < RING_SIZE; i++)
+        atomic_init(&slow_log->slots[i].sequence, i);
+    PTHREAD_CHECK(pthread_create(&slow_log->drainer, NULL, drainer_main, slow_log));
+    *log = slow_log;
+    return SUCCESS;
+}
+
+uint64_t slowlog_threshold(const SlowLog* log) {
+    return log->threshold_ns;
+}
+
+int slowlog_close(SlowLog* log) {
+    atomic_store(&log->stopping, true);
+    wake_drainer(log);
+    PTHREAD_CHECK(pthread_join(log->drainer, NULL));
+    int result = log->error;
+    if (fclose(log->file) != 0 && result == SUCCESS)
+        result = errno;
+    free(log);
+    return result;
+}
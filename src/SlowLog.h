@@ -0,0 +1,109 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Log of slow operations (see `tree_slow_log_start`).
+ *
+ * Operations which took at least the threshold are pushed into a bounded ring buffer, which a background
+ * thread drains into a file of JSON lines, one per operation. Pushing never blocks: producers claim slots
+ * with a compare-and-swap, and when the ring is full the operation is dropped and counted instead.
+ * The count of dropped operations is logged as a line of its own. The draining thread sleeps on a futex
+ * while the ring is empty, and is only woken by a push which finds it asleep.
+ */
+
+/** Lock waits of an operation kept individually. Further ones only count towards the total **/
+#define SLOW_LOG_MAX_WAITS 8
+
+/** Longest path kept in the log. Longer paths are cut, which the log marks **/
+#define SLOW_LOG_MAX_PATH 255
+
+/** A lock which an operation had to wait for **/
+typedef struct SlowLockWait {
+    uint32_t lock;      /** Which lock of the operation: the number of locks it had taken before **/
+    uint8_t reader;     /** Whether the lock was taken for reading, rather than writing **/
+    uint8_t on_target;  /** Whether the directory lies on the target of a move, rather than on the path **/
+    uint16_t depth;     /** Depth of the directory: it is the prefix of the path (or target) of that many components **/
+    uint64_t wait_ns;   /** Time spent waiting **/
+} SlowLockWait;
+
+/** Waits of an operation in progress, collected by the calling thread **/
+typedef struct SlowOpWaits {
+    uint16_t site_depth;      /** Depth of the directory whose lock is taken next **/
+    uint8_t site_on_target;   /** Whether that directory lies on the target of a move **/
+    uint32_t locks;           /** Number of locks taken so far **/
+    uint32_t n_waits;         /** Number of locks waited for **/
+    uint64_t lock_wait_ns;    /** Total time spent waiting for locks **/
+    uint64_t subtree_wait_ns; /** Time spent waiting for operations in a subtree to finish **/
+    SlowLockWait waits[SLOW_LOG_MAX_WAITS]; /** The first `n_waits` lock waits, in order **/
+} SlowOpWaits;
+
+/**
+ * Records that an operation waited for a lock, before taking it. The lock is that of the directory
+ * last set with `slowlog_set_lock_site`.
+ * @param waits : waits of the operation
+ * @param reader : whether the lock is taken for reading
+ * @param wait_ns : time spent waiting
+ */
+static inline void slowlog_note_lock_wait(SlowOpWaits* waits, bool reader, uint64_t wait_ns) {
+    if (waits->n_waits < SLOW_LOG_MAX_WAITS)
+        waits->waits[waits->n_waits] = (SlowLockWait) {
+            .lock = waits->locks,
+            .reader = reader,
+            .on_target = waits->site_on_target,
+            .depth = waits->site_depth,
+            .wait_ns = wait_ns,
+        };
+    waits->n_waits++;
+    waits->lock_wait_ns += wait_ns;
+}
+
+/**
+ * Sets the directory whose lock an operation takes next.
+ * @param waits : waits of the operation
+ * @param depth : depth of the directory
+ * @param on_target : whether the directory lies on the target of a move, rather than on the path
+ */
+static inline void slowlog_set_lock_site(SlowOpWaits* waits, size_t depth, bool on_target) {
+    waits->site_depth = depth;
+    waits->site_on_target = on_target;
+}
+
+typedef struct SlowLog SlowLog;
+
+/**
+ * Opens the log file for appending and starts the thread draining the log into it.
+ * @param path : path to the log file, created if it doesn't exist
+ * @param threshold_ns : latency from which operations are logged, in nanoseconds
+ * @param log : set to the log on success
+ * @return : 0 on success, or the errno of a failed system call
+ */
+int slowlog_open(const char* path, uint64_t threshold_ns, SlowLog** log);
+
+/**
+ * Returns the latency from which operations are logged, in nanoseconds.
+ */
+uint64_t slowlog_threshold(const SlowLog* log);
+
+/**
+ * Pushes an operation into the log, or counts it as dropped if the log is full. Never blocks.
+ * @param log : slow operation log
+ * @param op : name of the operation
+ * @param path : path of the operation
+ * @param target : target of a move, NULL for the other operations
+ * @param result : error code returned by the operation
+ * @param latency_ns : latency of the operation
+ * @param waits : waits of the operation
+ */
+void slowlog_push(SlowLog* log, const char* op, const char* path, const char* target, int result,
+                  uint64_t latency_ns, const SlowOpWaits* waits);
+
+/**
+ * Writes out the operations still in the log, stops the draining thread and closes the log.
+ * No thread may be pushing meanwhile.
+ * @param log : slow operation log
+ * @return : 0 on success, or the errno of the first failed write
+ */
+int slowlog_close(SlowLog* log);
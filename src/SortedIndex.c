@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "SortedIndex.h"
+#include "mem_stats.h"
+#include "safe_allocations.h"
+
+// Capacity of a freshly allocated key array.
+#define INITIAL_CAPACITY 4
+
+// Keys and values are kept in two parallel arrays, so that the keys of a range
+// can be handed out without copying (see `sidx_keys`).
+struct SortedIndex {
+    char** keys;     // Keys, lexicographically sorted.
+    void** values;   // values[i] is stored under keys[i].
+    size_t size;     // Number of elements.
+    size_t capacity; // Allocated length of both arrays.
+    size_t key_bytes; // Total length of the keys copied by the index, with their terminating NULs.
+    bool borrows_keys; // Whether the keys belong to the caller rather than to the index.
+};
+
+// Account for the key and value arrays of `capacity` elements being allocated, or freed if `sign` is -1.
+static void account_arrays(size_t capacity, int sign)
+{
+    if (capacity > 0)
+        mem_account(MEM_INDEXES, sign * (int64_t)(capacity * (sizeof(char*) + sizeof(void*))), sign * 2);
+}
+
+// Account for a copy of `key` being allocated by the index, or freed if `sign` is -1.
+static void account_key(SortedIndex* index, const char* key, int sign)
+{
+    index->key_bytes += sign * (strlen(key) + 1);
+    mem_account(MEM_KEYS, sign * (int64_t)(strlen(key) + 1), sign);
+}
+
+SortedIndex* sidx_new()
+{
+    mem_account(MEM_INDEXES, sizeof(SortedIndex), 1);
+    return safe_calloc(1, sizeof(SortedIndex));
+}
+
+SortedIndex* sidx_new_with_capacity(size_t capacity)
+{
+    SortedIndex* index = sidx_new();
+    if (capacity > 0) {
+        index->capacity = capacity;
+        index->keys = safe_malloc(capacity * sizeof(char*));
+        index->values = safe_malloc(capacity * sizeof(void*));
+        account_arrays(capacity, 1);
+    }
+    return index;
+}
+
+SortedIndex* sidx_new_borrowing_keys(size_t capacity)
+{
+    SortedIndex* index = sidx_new_with_capacity(capacity);
+    index->borrows_keys = true;
+    return index;
+}
+
+// Return the key to be stored in the index: a copy of `key`, or `key` itself if the index borrows its keys.
+static char* store_key(SortedIndex* index, const char* key)
+{
+    if (index->borrows_keys)
+        return (char*)key;
+    char* copy = strdup(key);
+    CHECK_POINTER(copy);
+    account_key(index, key, 1);
+    return copy;
+}
+
+// Free a key stored in the index, unless it is borrowed.
+static void free_key(SortedIndex* index, char* key)
+{
+    if (index->borrows_keys)
+        return;
+    account_key(index, key, -1);
+    free(key);
+}
+
+void sidx_free(SortedIndex* index)
+{
+    for (size_t i = 0; i < index->size; ++i)
+        free_key(index, index->keys[i]);
+    account_arrays(index->capacity, -1);
+    mem_account(MEM_INDEXES, -(int64_t)sizeof(SortedIndex), -1);
+    free(index->keys);
+    free(index->values);
+    free(index);
+}
+
+size_t sidx_lower_bound(SortedIndex* index, const char* key)
+{
+    if (!key)
+        return index->size;
+    size_t lo = 0, hi = index->size;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(index->keys[mid], key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Check whether the element at `pos` (as returned by `sidx_lower_bound`) is stored under `key`.
+static bool sidx_found(SortedIndex* index, size_t pos, const char* key)
+{
+    return pos < index->size && strcmp(index->keys[pos], key) == 0;
+}
+
+void* sidx_get(SortedIndex* index, const char* key)
+{
+    size_t pos = sidx_lower_bound(index, key);
+    return sidx_found(index, pos, key) ? index->values[pos] : NULL;
+}
+
+static void sidx_reserve_one(SortedIndex* index)
+{
+    if (index->size < index->capacity)
+        return;
+    account_arrays(index->capacity, -1);
+    index->capacity = index->capacity ? 2 * index->capacity : INITIAL_CAPACITY;
+    account_arrays(index->capacity, 1);
+    index->keys = safe_realloc(index->keys, index->capacity * sizeof(char*));
+    index->values = safe_realloc(index->values, index->capacity * sizeof(void*));
+}
+
+bool sidx_insert(SortedIndex* index, const char* key, void* value)
+{
+    if (!value)
+        return false;
+    size_t pos = sidx_lower_bound(index, key);
+    if (sidx_found(index, pos, key))
+        return false; // Already exists.
+    sidx_reserve_one(index);
+    size_t tail = index->size - pos;
+    memmove(index->keys + pos + 1, index->keys + pos, tail * sizeof(char*));
+    memmove(index->values + pos + 1, index->values + pos, tail * sizeof(void*));
+    index->keys[pos] = store_key(index, key);
+    index->values[pos] = value;
+    index->size++;
+    return true;
+}
+
+void sidx_append(SortedIndex* index, const char* key, void* value)
+{
+    sidx_reserve_one(index);
+    index->keys[index->size] = store_key(index, key);
+    index->values[index->size] = value;
+    index->size++;
+}
+
+bool sidx_remove(SortedIndex* index, const char* key)
+{
+    size_t pos = sidx_lower_bound(index, key);
+    if (!sidx_found(index, pos, key))
+        return false;
+    free_key(index, index->keys[pos]);
+    size_t tail = index->size - pos - 1;
+    memmove(index->keys + pos, index->keys + pos + 1, tail * sizeof(char*));
+    memmove(index->values + pos, index->values + pos + 1, tail * sizeof(void*));
+    index->size--;
+    return true;
+}
+
+size_t sidx_size(SortedIndex* index)
+{
+    return index->size;
+}
+
+size_t sidx_memory(SortedIndex* index)
+{
+    return sizeof(SortedIndex) + index->capacity * (sizeof(char*) + sizeof(void*)) + index->key_bytes;
+}
+
+const char* const* sidx_keys(SortedIndex* index)
+{
+    return (const char* const*)index->keys;
+}
+
+void* sidx_value_at(SortedIndex* index, size_t pos)
+{
+    return index->values[pos];
+}
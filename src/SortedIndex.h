@@ -0,0 +1,63 @@
+#pragma once
+#include <stdbool.h>
+#include <sys/types.h>
+
+// A structure representing a mapping from keys to values, kept in lexicographic order of keys.
+// Keys are C-strings (null-terminated char*), all distinct.
+// Values are non-null pointers (void*, which you can cast to any other pointer type).
+// Elements are addressed by their position (rank) in the order, starting from 0.
+//
+// As with HashMap, the index does no synchronization of its own: modifying operations
+// (`sidx_insert`/`sidx_remove`/`sidx_free`) must not run concurrently with any other
+// operation on the same index.
+typedef struct SortedIndex SortedIndex;
+
+// Create a new, empty index.
+SortedIndex* sidx_new();
+
+// Create a new, empty index, sized to hold `capacity` elements without growing.
+SortedIndex* sidx_new_with_capacity(size_t capacity);
+
+// Create a new, empty index, sized like `sidx_new_with_capacity`, which borrows its keys instead of copying them:
+// it keeps the very pointers passed to `sidx_insert` and `sidx_append`, and never frees them. The caller must keep
+// every key alive and unchanged until it is removed from the index (e.g. keys owned by a HashMap with the same keys).
+SortedIndex* sidx_new_borrowing_keys(size_t capacity);
+
+// Clear the index and free its memory. This frees the index and the keys
+// copied by sidx_insert, but does not free any values.
+void sidx_free(SortedIndex* index);
+
+// Get the value stored under `key`, or NULL if not present.
+void* sidx_get(SortedIndex* index, const char* key);
+
+// Insert a `value` under `key` and return true,
+// or do nothing and return false if `key` already exists in the index.
+// `value` must not be NULL.
+// (The caller can free `key` at any time - the index internally uses a copy of it,
+// unless it borrows its keys; see `sidx_new_borrowing_keys`).
+bool sidx_insert(SortedIndex* index, const char* key, void* value);
+
+// Append a `value` under `key`, which must be greater than every key already present.
+// Cheaper than `sidx_insert` for building an index from keys that are already sorted.
+void sidx_append(SortedIndex* index, const char* key, void* value);
+
+// Remove the value under `key` and return true (the value is not free'd),
+// or do nothing and return false if `key` was not present.
+bool sidx_remove(SortedIndex* index, const char* key);
+
+// Return the number of elements in the index.
+size_t sidx_size(SortedIndex* index);
+
+// Return the number of bytes the index has requested from the allocator, including its keys.
+size_t sidx_memory(SortedIndex* index);
+
+// Return the position of the first key not less than `key` (`sidx_size` if there is none).
+// A NULL `key` yields `sidx_size`.
+size_t sidx_lower_bound(SortedIndex* index, const char* key);
+
+// Return the array of all keys, in order. It has `sidx_size` elements and stays
+// valid until the next modification of the index.
+const char* const* sidx_keys(SortedIndex* index);
+
+// Return the value at position `pos`, which must be less than `sidx_size`.
+void* sidx_value_at(SortedIndex* index, size_t pos);
@@ -1,54 +1,131 @@
 #include "Tree.h"
 #include "HashMap.h"
+#include "SlowLog.h"
+#include "SortedIndex.h"
 #include "path_utils.h"
+#include "probes.h"
 #include "safe_allocations.h"
+#include "sync_utils.h"
+#include "WorkPool.h"
+#include "TreeSnapshot.h"
+#include "TreeImage.h"
+#include "TreeMetrics.h"
+#include "TreeTrace.h"
+#include "WriteAheadLog.h"
+#include "mem_stats.h"
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#if __has_include(<linux/openat2.h>)
+#include <linux/openat2.h>
+#endif
 
 #define READER 1
 #define WRITER 0
 
-/** Generic success code **/
-#define SUCCESS 0
 /** Error code for when an ancestor is being moved to its descendant **/
 #define EMOVINGANCESTOR (-1)
 
 /** Checks if the directory represents the root **/
 #define IS_ROOT(path) (strcmp(path, "/") == 0)
 
-/** Checks whether the result of a pthread_* function is 0 (SUCCESS) **/
-#define PTHREAD_CHECK(x)                                                          \
-    do {                                                                          \
-        int err = (x);                                                            \
-        if (err != SUCCESS) {                                                     \
-            fprintf(stderr, "Runtime error: %s returned %d in %s at %s:%d\n%s\n", \
-                #x, err, __func__, __FILE__, __LINE__, strerror(err));            \
-            exit(EXIT_FAILURE);                                                   \
-        }                                                                         \
-    } while (0)
-
-/** Performs a block of code under the node's mutex **/
-#define UNDER_MUTEX(mutex, code_block)           \
-do {                                             \
-    PTHREAD_CHECK(pthread_mutex_lock(mutex));    \
-    code_block;                                  \
-    PTHREAD_CHECK(pthread_mutex_unlock(mutex));  \
-} while(0);
+/** Code compiled in only with TREE_CONTENTION_PROFILING (see `tree_contention_report`) **/
+#ifdef TREE_CONTENTION_PROFILING
+#define PROFILE(...) __VA_ARGS__
+#else
+#define PROFILE(...)
+#endif
+
+#ifdef TREE_CONTENTION_PROFILING
+/** Lock contention of a single node. Protected by its `var_protection` **/
+typedef struct NodeContention {
+    uint64_t read_wait_ns;    /** Time readers spent waiting for the lock **/
+    uint64_t write_wait_ns;   /** Time writers spent waiting for the lock **/
+    uint64_t subtree_wait_ns; /** Time spent waiting for operations in the subtree to finish **/
+    uint64_t read_hold_ns;    /** Time the node was locked by at least one reader **/
+    uint64_t write_hold_ns;   /** Time the node was locked by a writer **/
+    uint64_t hold_start;      /** When the current holders took the lock **/
+    uint64_t acquisitions;    /** Number of times the lock was taken **/
+    uint64_t waits;           /** Number of times the lock, or the subtree, had to be waited for **/
+    size_t max_waiters;       /** Largest number of readers and writers waiting at once **/
+} NodeContention;
+#endif
+
+/** State of the tree as a whole, kept by its root **/
+typedef struct TreeGlobals {
+    atomic_uint_least64_t version;       /** Number of modifications made to the tree so far **/
+    pthread_mutex_t snapshot_protection; /** Mutual exclusion for `latest` and `latest_version` **/
+    SnapNode* latest;                    /** Image of the tree in the most recent snapshot **/
+    uint64_t latest_version;             /** Version of the tree shown by `latest` **/
+    WriteAheadLog* wal;                  /** Log of modifications. NULL if the tree is not logged **/
+    TraceWriter* tracer;                 /** Trace of operations. NULL if the tree is not traced **/
+    TreeMetrics* metrics;                /** Latencies of operations. NULL if they are not collected **/
+    SlowLog* slow_log;                   /** Log of slow operations. NULL if they are not logged **/
+} TreeGlobals;
 
 struct Tree {
+    TreeGlobals* globals;                    /** State of the whole tree. Set in the root only **/
     Tree* parent;                            /** Parent directory. NULL for the root **/
     HashMap* subdirectories;                 /** HashMap of (name, node) pairs, where node is of type Tree **/
+    SortedIndex* ordered_subdirectories;     /** The same pairs as in `subdirectories`, kept sorted by name.
+                                                 Borrows the names from `subdirectories` **/
     pthread_mutex_t var_protection;          /** Mutual exclusion for variable access **/
     pthread_cond_t reader_cond;              /** Condition to hang readers **/
     pthread_cond_t writer_cond;              /** Condition to hang writers **/
     pthread_cond_t subtree_cond;             /** Condition to wait on until all subtree operations finish **/
     size_t r_count, w_count, r_wait, w_wait; /** Counters of active and waiting readers/writers **/
     size_t refcount;                         /** Reference count of operations currently performed in the subtree **/
+    size_t descendants;                      /** Number of directories in the subtree, excluding this one **/
+    size_t subtree_bytes;                    /** Bytes held by the directories of the subtree (see `own_bytes`) **/
+    size_t map_bytes;                        /** Bytes held by the maps of subdirectories, as counted in `subtree_bytes`.
+                                                 Only changed under the node's write lock **/
+    size_t height;                           /** Length of the longest path to a descendant. 0 for a leaf **/
+    long* height_histogram;                  /** Number of subdirectories of each height. Entries may temporarily
+                                                 go negative, as concurrent updates are applied in any order **/
+    size_t histogram_length;                 /** Allocated length of `height_histogram` **/
+    SnapNode* frozen;                        /** Image of the subtree shared with snapshots.
+                                                 NULL if the subtree has been modified since it was taken **/
+#ifdef TREE_CONTENTION_PROFILING
+    NodeContention contention;               /** Lock contention of the node **/
+#endif
 };
 
+/**
+ * Inserts `subdir` into the `tree` under the specified name.
+ * Keeps the hash map and the ordered index of subdirectories in sync. The index borrows the hash map's
+ * copy of the name, so every name is stored once.
+ * @param tree : file tree
+ * @param name : subdirectory name
+ * @param subdir : subdirectory to insert
+ * @return : false if a subdirectory with this name already exists, true otherwise
+ */
+static inline bool insert_subdir(Tree* tree, const char* name, Tree* subdir) {
+    if (hmap_get(tree->subdirectories, name))
+        return false;
+    sidx_insert(tree->ordered_subdirectories, hmap_insert_new(tree->subdirectories, name, subdir), subdir);
+    return true;
+}
+
+/**
+ * Counterpart of `insert_subdir` for a name known to be greater than those of all the subdirectories
+ * of the `tree`, e.g. while building a directory from a sorted list of names.
+ * @param tree : file tree
+ * @param name : subdirectory name
+ * @param subdir : subdirectory to insert
+ */
+static inline void append_subdir(Tree* tree, const char* name, Tree* subdir) {
+    sidx_append(tree->ordered_subdirectories, hmap_insert_new(tree->subdirectories, name, subdir), subdir);
+}
+
 /**
  * Removes and returns a subdirectory of the `tree` with the specified name.
  * @param tree : file tree
@@ -57,6 +134,7 @@ struct Tree {
  */
 static inline Tree* pop_subdir(Tree* tree, const char* name) {
     Tree* subdir = hmap_get(tree->subdirectories, name);
+    sidx_remove(tree->ordered_subdirectories, name); // Before the hash map frees the name the index borrows
     hmap_remove(tree->subdirectories, name);
     return subdir;
 }
@@ -70,22 +148,62 @@ static inline size_t subdir_count(Tree* tree) {
     return hmap_size(tree->subdirectories);
 }
 
+static inline uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/** Waits of the operation in progress on this thread, if slow operations are logged. NULL otherwise **/
+static _Thread_local SlowOpWaits* op_waits;
+
+#ifdef TREE_CONTENTION_PROFILING
+/**
+ * Records that a reader or a writer is about to wait for the lock of the node.
+ * Called with `var_protection` held, before the waiter is counted.
+ * @param tree : node in a file tree
+ * @return : start of the wait
+ */
+static uint64_t contention_wait_begin(Tree* tree) {
+    size_t waiters = tree->r_wait + tree->w_wait + 1;
+    if (waiters > tree->contention.max_waiters)
+        tree->contention.max_waiters = waiters;
+    tree->contention.waits++;
+    return monotonic_ns();
+}
+#endif
+
 /**
  * Called by a read-type operation to lock the tree for reading.
  * Waits if there are other active or waiting writers.
  * @param tree : file tree
  */
 static void reader_lock(Tree* tree) {
+    SlowOpWaits* waits = op_waits;
     UNDER_MUTEX(&tree->var_protection,
         if (tree->w_wait || tree->w_count) {
+            TREE_PROBE3(lock__wait, tree, READER, tree->r_wait + tree->w_wait);
+            PROFILE(uint64_t wait_start = contention_wait_begin(tree);)
+            uint64_t slow_wait_start = waits ? monotonic_ns() : 0;
             tree->r_wait++;
             do {
                 PTHREAD_CHECK(pthread_cond_wait(&tree->reader_cond, &tree->var_protection));
             } while (tree->w_count > 0);
             tree->r_wait--;
+            PROFILE(tree->contention.read_wait_ns += monotonic_ns() - wait_start;)
+            if (waits)
+                slowlog_note_lock_wait(waits, READER, monotonic_ns() - slow_wait_start);
         }
+        if (waits)
+            waits->locks++;
         assert(tree->w_count == 0);
         tree->r_count++;
+        TREE_PROBE1(read__lock, tree);
+        PROFILE(
+            tree->contention.acquisitions++;
+            if (tree->r_count == 1)
+                tree->contention.hold_start = monotonic_ns();
+        )
     );
 }
 
@@ -98,6 +216,11 @@ static void reader_unlock(Tree* tree) {
         assert(tree->r_count > 0);
         assert(tree->w_count == 0);
         tree->r_count--;
+        TREE_PROBE1(read__unlock, tree);
+        PROFILE(
+            if (tree->r_count == 0)
+                tree->contention.read_hold_ns += monotonic_ns() - tree->contention.hold_start;
+        )
 
         if (tree->r_count == 0)
             PTHREAD_CHECK(pthread_cond_signal(&tree->writer_cond));
@@ -110,15 +233,32 @@ static void reader_unlock(Tree* tree) {
  * @param tree : file tree
  */
 static void writer_lock(Tree* tree) {
+    SlowOpWaits* waits = op_waits;
     UNDER_MUTEX(&tree->var_protection,
+        if (tree->r_count || tree->w_count)
+            TREE_PROBE3(lock__wait, tree, WRITER, tree->r_wait + tree->w_wait);
+        PROFILE(uint64_t wait_start = tree->r_count || tree->w_count ? contention_wait_begin(tree) : 0;)
+        uint64_t slow_wait_start = waits && (tree->r_count || tree->w_count) ? monotonic_ns() : 0;
         while (tree->r_count || tree->w_count) {
             tree->w_wait++;
             PTHREAD_CHECK(pthread_cond_wait(&tree->writer_cond, &tree->var_protection));
             tree->w_wait--;
         }
+        if (slow_wait_start)
+            slowlog_note_lock_wait(waits, WRITER, monotonic_ns() - slow_wait_start);
+        if (waits)
+            waits->locks++;
         assert(tree->r_count == 0);
         assert(tree->w_count == 0);
         tree->w_count++;
+        TREE_PROBE1(write__lock, tree);
+        PROFILE(
+            uint64_t now = monotonic_ns();
+            if (wait_start)
+                tree->contention.write_wait_ns += now - wait_start;
+            tree->contention.acquisitions++;
+            tree->contention.hold_start = now;
+        )
     );
 }
 
@@ -131,6 +271,8 @@ static void writer_unlock(Tree* tree) {
         assert(tree->w_count == 1);
         assert(tree->r_count == 0);
         tree->w_count--;
+        TREE_PROBE1(write__unlock, tree);
+        PROFILE(tree->contention.write_hold_ns += monotonic_ns() - tree->contention.hold_start;)
 
         if (tree->r_wait > 0)
             PTHREAD_CHECK(pthread_cond_broadcast(&tree->reader_cond));
@@ -139,14 +281,72 @@ static void writer_unlock(Tree* tree) {
     );
 }
 
+/** A lock held by a multi-node operation **/
+typedef struct HeldLock {
+    Tree* node;  /** Locked node **/
+    bool reader; /** Whether the node is locked for reading or for writing **/
+} HeldLock;
+
+/** Locks held by a multi-node operation, to be released all at once when it ends **/
+typedef struct HeldLocks {
+    HeldLock* locks;
+    size_t count, capacity;
+} HeldLocks;
+
+/**
+ * Records that the `node` has been locked.
+ * @param held : locks held by the operation
+ * @param node : locked node
+ * @param reader : whether the node was locked for reading or for writing
+ */
+static void hold_lock(HeldLocks* held, Tree* node, bool reader) {
+    if (held->count == held->capacity) {
+        held->capacity = 2 * held->capacity + 16;
+        held->locks = safe_realloc(held->locks, held->capacity * sizeof(HeldLock));
+    }
+    held->locks[held->count++] = (HeldLock) { .node = node, .reader = reader };
+}
+
+/**
+ * Releases all the recorded locks, in reverse order of acquisition.
+ * @param held : locks held by the operation
+ */
+static void release_held_locks(HeldLocks* held) {
+    while (held->count > 0) {
+        HeldLock* lock = &held->locks[--held->count];
+        if (lock->reader)
+            reader_unlock(lock->node);
+        else
+            writer_unlock(lock->node);
+    }
+    free(held->locks);
+    held->locks = NULL;
+    held->capacity = 0;
+}
+
 /**
- * Waits for all operations to finish in the subtree of the `node`.
+ * Waits for all operations to finish in the subtree of the `node`,
+ * except for the caller's own, which hold `own_references` references to the node.
  * @param node : node in a file tree
+ * @param own_references : number of references to the node held by the caller
  */
-static void wait_until_subtree_activity_ceases(Tree* node) {
-    UNDER_MUTEX(&node->var_protection, // This is only to satisfy `pthread_cond_wait`
-        while (node->refcount > 0)     // Wait if necessary
+static void wait_until_subtree_activity_ceases(Tree* node, size_t own_references) {
+    SlowOpWaits* waits = op_waits;
+    UNDER_MUTEX(&node->var_protection,          // This is only to satisfy `pthread_cond_wait`
+        PROFILE(uint64_t wait_start = node->refcount > own_references ? monotonic_ns() : 0;)
+        uint64_t slow_wait_start = waits && node->refcount > own_references ? monotonic_ns() : 0;
+        TREE_PROBE2(subtree__wait, node, node->refcount);
+        while (node->refcount > own_references) // Wait if necessary
             PTHREAD_CHECK(pthread_cond_wait(&node->subtree_cond, &node->var_protection));
+        TREE_PROBE1(subtree__wait__done, node);
+        if (slow_wait_start)
+            waits->subtree_wait_ns += monotonic_ns() - slow_wait_start;
+        PROFILE(
+            if (wait_start) {
+                node->contention.subtree_wait_ns += monotonic_ns() - wait_start;
+                node->contention.waits++;
+            }
+        )
     );
 }
 
@@ -161,13 +361,305 @@ static void unwind_path(Tree *start, Tree *end) {
         UNDER_MUTEX(&start->var_protection,
             next = start->parent;
             start->refcount--;
-            if (start->refcount == 0)
-                PTHREAD_CHECK(pthread_cond_signal(&start->subtree_cond));
+            if (start->refcount <= 1) // Someone may be waiting for everyone but themselves to leave
+                PTHREAD_CHECK(pthread_cond_broadcast(&start->subtree_cond));
         );
         start = next;
     }
 }
 
+/** Marks a missing child height in `update_subtree_stats` **/
+#define NO_HEIGHT (-1)
+
+/**
+ * Recomputes the height of the `node` from the histogram of its subdirectories' heights.
+ * Must be called under the node's mutex.
+ * @param node : node in a file tree
+ */
+static void recompute_height(Tree* node) {
+    size_t h = node->histogram_length;
+    while (h > 0 && node->height_histogram[h - 1] <= 0)
+        h--;
+    node->height = h; // The highest subdirectory has height h - 1, or there are none at all
+}
+
+/**
+ * Records a subdirectory of the given height in the histogram of the `node`, growing it if needed.
+ * Must be called under the node's mutex, unless the node is not shared yet.
+ * @param node : node in a file tree
+ * @param child_height : height of the subdirectory
+ */
+static void count_child_height(Tree* node, long child_height) {
+    if (child_height >= (long)node->histogram_length) {
+        size_t length = 2 * child_height + 2;
+        mem_account(MEM_HISTOGRAMS, (length - node->histogram_length) * sizeof(long), node->histogram_length ? 0 : 1);
+        node->height_histogram = safe_realloc(node->height_histogram, length * sizeof(long));
+        memset(node->height_histogram + node->histogram_length, 0,
+            (length - node->histogram_length) * sizeof(long));
+        node->histogram_length = length;
+    }
+    node->height_histogram[child_height]++;
+}
+
+/**
+ * Counts the bytes held by the maps of subdirectories of the `node`, with their names.
+ * @param node : node in a file tree, locked for writing or not shared yet
+ * @return : number of bytes requested from the allocator
+ */
+static size_t count_map_bytes(Tree* node) {
+    return hmap_memory(node->subdirectories) + sidx_memory(node->ordered_subdirectories);
+}
+
+/**
+ * Counts the bytes held by the `node` itself: the node, its height histogram and its maps of subdirectories,
+ * with their names. Updates `map_bytes`.
+ * @param node : node in a file tree, not shared yet
+ * @return : number of bytes requested from the allocator
+ */
+static size_t own_bytes(Tree* node) {
+    node->map_bytes = count_map_bytes(node);
+    return sizeof(Tree) + node->histogram_length * sizeof(long) + node->map_bytes;
+}
+
+/**
+ * Applies a change in the subtree of `node` to the statistics of `node` and all of its ancestors.
+ * The change is given as the number of directories added to (or removed from) the subtree, the bytes
+ * they hold, and the height of the affected subdirectory before and after, NO_HEIGHT meaning it didn't /
+ * doesn't exist. The change in the size of the maps of `node` itself is counted here as well.
+ * Updates are only additions to counters, so concurrent updates along the same path may interleave.
+ * The caller must keep the path to the root from being moved or removed (i.e. hold references to it).
+ * @param node : node whose subdirectory has changed, locked for writing
+ * @param descendants_delta : change in the number of descendants
+ * @param bytes_delta : change in the bytes held by the descendants
+ * @param old_child_height : previous height of the subdirectory
+ * @param new_child_height : current height of the subdirectory
+ */
+static void update_subtree_stats(Tree* node, long descendants_delta, long bytes_delta, long old_child_height,
+                                 long new_child_height) {
+    size_t map_bytes = count_map_bytes(node);
+    bytes_delta += (long)(map_bytes - node->map_bytes);
+    node->map_bytes = map_bytes;
+    while (node && (descendants_delta != 0 || bytes_delta != 0 || old_child_height != new_child_height)) {
+        Tree* next = NULL;
+        long old_height = 0, new_height = 0;
+        UNDER_MUTEX(&node->var_protection,
+            node->descendants += descendants_delta;
+            if (old_child_height != new_child_height) {
+                size_t histogram_length = node->histogram_length;
+                if (old_child_height != NO_HEIGHT)
+                    node->height_histogram[old_child_height]--;
+                if (new_child_height != NO_HEIGHT)
+                    count_child_height(node, new_child_height);
+                bytes_delta += (long)((node->histogram_length - histogram_length) * sizeof(long));
+            }
+            node->subtree_bytes += bytes_delta;
+            old_height = node->height;
+            recompute_height(node);
+            new_height = node->height;
+            next = node->parent;
+        );
+        old_child_height = old_height;
+        new_child_height = new_height;
+        node = next;
+    }
+}
+
+/**
+ * Updates the statistics of the ancestors of `subtree` after it has been moved from `old_parent` to `new_parent`.
+ * No operations may be in progress in the subtree.
+ * @param subtree : moved subtree
+ * @param old_parent : former parent of the subtree
+ * @param new_parent : current parent of the subtree
+ */
+static void move_subtree_stats(Tree* subtree, Tree* old_parent, Tree* new_parent) {
+    if (old_parent == new_parent) { // A rename - only the length of the name may have changed
+        update_subtree_stats(old_parent, 0, 0, NO_HEIGHT, NO_HEIGHT);
+        return;
+    }
+    long size = subtree->descendants + 1, bytes = subtree->subtree_bytes, height = subtree->height;
+    update_subtree_stats(old_parent, -size, -bytes, height, NO_HEIGHT);
+    update_subtree_stats(new_parent, size, bytes, NO_HEIGHT, height);
+}
+
+/**
+ * Discards the images of the `node` and its ancestors, after its list of subdirectories has changed.
+ * Must be called before the node is unlocked, so that no snapshot can see the change but not the invalidation.
+ * A directory without an image has no ancestor with one either, which ends the walk up early.
+ * @param node : modified node
+ */
+static void invalidate_frozen(Tree* node) {
+    while (node) {
+        SnapNode* image = NULL;
+        Tree* next = NULL;
+        UNDER_MUTEX(&node->var_protection,
+            image = node->frozen;
+            node->frozen = NULL;
+            next = node->parent;
+        );
+        if (!image)
+            break;
+        snap_node_unref(image);
+        node = next;
+    }
+}
+
+/**
+ * Checks whether the `node` has an up-to-date image of its subtree which can be reused as it is.
+ * The image is up to date if no operation is in progress in the subtree (or all of them would already
+ * have discarded it). It can then be reused as long as the node stays locked for writing.
+ * @param node : node in a file tree
+ * @return : true if the image can be reused
+ */
+static bool is_frozen_and_idle(Tree* node) {
+    bool result = false;
+    UNDER_MUTEX(&node->var_protection, result = node->frozen && node->refcount == 0);
+    return result;
+}
+
+static SnapNode* freeze_subtree(Tree* node, HeldLocks* held);
+
+/**
+ * Builds an image of the subtree of a locked `node` out of the images of its subdirectories,
+ * which are locked on the way, and caches it in the node.
+ * @param node : node locked by the caller, for reading or for writing
+ * @param held : locks held by the snapshot
+ * @return : image of the subtree, with a reference owned by the caller
+ */
+static SnapNode* freeze_locked(Tree* node, HeldLocks* held) {
+    size_t n = subdir_count(node);
+    SnapNode** children = safe_malloc((n + 1) * sizeof(SnapNode*));
+    for (size_t i = 0; i < n; i++)
+        children[i] = freeze_subtree(sidx_value_at(node->ordered_subdirectories, i), held);
+    SnapNode* image = snap_node_new(sidx_keys(node->ordered_subdirectories), children, n);
+    free(children);
+
+    UNDER_MUTEX(&node->var_protection,
+        if (!node->frozen)
+            node->frozen = snap_node_ref(image);
+    );
+    return image;
+}
+
+/**
+ * Locks the `node` and returns an image of its subtree, reusing the cached images wherever possible.
+ * Directories with a cached image are locked for writing, which keeps new operations out of the
+ * shared subtree; the others are locked for reading and rebuilt from the images of their subdirectories.
+ * Everything stays locked until the snapshot is complete, so it shows a single state of the tree.
+ * @param node : node in a file tree, not locked yet
+ * @param held : locks held by the snapshot
+ * @return : image of the subtree, with a reference owned by the caller
+ */
+static SnapNode* freeze_subtree(Tree* node, HeldLocks* held) {
+    SnapNode* image = NULL;
+    if (is_frozen_and_idle(node)) {
+        writer_lock(node);
+        hold_lock(held, node, WRITER);
+        UNDER_MUTEX(&node->var_protection,
+            if (node->frozen && node->refcount == 0)
+                image = snap_node_ref(node->frozen);
+        );
+        if (image)
+            return image;
+    }
+    else {
+        reader_lock(node);
+        hold_lock(held, node, READER);
+    }
+    return freeze_locked(node, held);
+}
+
+/**
+ * Stamps a modification of the tree with a new version and appends it to the log, if there is one.
+ * Must be called before the modified nodes are unlocked, so that the versions and the order of records
+ * in the log agree with the order in which conflicting modifications take effect.
+ * @param tree : root of the file tree
+ * @param ops : operations making up the modification
+ * @param n_ops : number of operations
+ * @return : position of the modification in the log, to be passed to `wait_until_durable`
+ */
+static uint64_t commit_modification(Tree* tree, const WalOp* ops, size_t n_ops) {
+    uint64_t version = atomic_fetch_add(&tree->globals->version, 1) + 1;
+    WriteAheadLog* wal = tree->globals->wal;
+    return wal ? wal_append(wal, version, ops, n_ops) : 0;
+}
+
+/**
+ * Waits until a logged modification is on stable storage. Should be called after all locks are
+ * released, so that modifications of other directories can proceed (and share the sync) meanwhile.
+ * @param tree : root of the file tree
+ * @param lsn : position returned by `commit_modification`
+ * @return : success, or the errno of a failed write of the log
+ */
+static int wait_until_durable(Tree* tree, uint64_t lsn) {
+    WriteAheadLog* wal = tree->globals->wal;
+    return wal ? wal_sync(wal, lsn) : SUCCESS;
+}
+
+/** Start of an operation, as far as its trace, its latency and the slow operation log are concerned **/
+typedef struct OpStart {
+    uint64_t trace;     /** As returned by `trace_now`. 0 if the tree is not traced **/
+    uint64_t clock;     /** Monotonic time in nanoseconds. 0 if latencies are neither collected nor logged **/
+    SlowOpWaits waits;  /** Waits of the operation. Only set if slow operations are logged **/
+} OpStart;
+
+/** Names of the operations, for probes **/
+static const char* const op_names[] = {
+    [TRACE_LIST] = "list",
+    [TRACE_CREATE] = "create",
+    [TRACE_REMOVE] = "remove",
+    [TRACE_MOVE] = "move",
+};
+
+/**
+ * Starts timing an operation for the trace of the tree, for its latency histograms and for the slow
+ * operation log. The waits of the operation are collected into `start` until `op_end`.
+ * @param tree : root of the tree
+ * @param start : filled in with the start of the operation, to be passed to `op_end`
+ * @param type : type of the operation
+ * @param path : path of the operation
+ * @param target : target of a move, NULL for the other operations
+ */
+static inline void op_begin(Tree* tree, OpStart* start, TraceOpType type, const char* path, const char* target) {
+    TREE_PROBE3(op__start, op_names[type], path, target);
+    TraceWriter* tracer = tree->globals->tracer;
+    start->trace = tracer ? trace_now(tracer) : 0;
+    start->clock = tree->globals->metrics || tree->globals->slow_log ? monotonic_ns() : 0;
+    if (tree->globals->slow_log) {
+        start->waits = (SlowOpWaits) { 0 };
+        op_waits = &start->waits;
+    }
+}
+
+/**
+ * Records a finished operation in the trace of the tree, in its latency histograms and in the slow
+ * operation log, if they are enabled.
+ * @param tree : root of the tree
+ * @param type : type of the operation
+ * @param path : path of the operation
+ * @param target : target of a move, NULL for the other operations
+ * @param result : error code returned by the operation
+ * @param start : start of the operation, filled in by `op_begin`
+ */
+static inline void op_end(Tree* tree, TraceOpType type, const char* path, const char* target, int result,
+                          OpStart* start) {
+    TREE_PROBE4(op__done, op_names[type], path, target, result);
+    TraceWriter* tracer = tree->globals->tracer;
+    TreeMetrics* metrics = tree->globals->metrics;
+    SlowLog* slow_log = tree->globals->slow_log;
+    if (tracer)
+        trace_record(tracer, type, path, target, result, start->trace);
+    if (metrics || slow_log) {
+        uint64_t latency = monotonic_ns() - start->clock;
+        if (metrics) // Both enums list the operations in the same order
+            metrics_record(metrics, type - TRACE_LIST + TREE_OP_LIST, latency);
+        if (slow_log) {
+            op_waits = NULL;
+            if (latency >= slowlog_threshold(slow_log))
+                slowlog_push(slow_log, op_names[type], path, target, result, latency, &start->waits);
+        }
+    }
+}
+
 /**
  * Gets a pointer to the directory in the `tree` specified by the `path`.
  * Locks the directory according to the `reader` flag.
@@ -181,8 +673,11 @@ static void unwind_path(Tree *start, Tree *end) {
 static Tree* get_node(Tree* tree, const char* path, bool start_locked, const bool reader) {
     char child_name[MAX_FOLDER_NAME_LENGTH + 1];
     Tree* end = NULL;
+    SlowOpWaits* waits = op_waits; // A search from a locked node goes on from the lock site its caller set
 
     if (!start_locked) {
+        if (waits)
+            slowlog_set_lock_site(waits, 0, false);
         if (IS_ROOT(path) && !reader)
             writer_lock(tree);
         else
@@ -194,12 +689,15 @@ static Tree* get_node(Tree* tree, const char* path, bool start_locked, const boo
 
     while ((path = split_path(path, child_name))) {
         Tree* subtree = hmap_get(tree->subdirectories, child_name);
+        TREE_PROBE3(node__hop, tree, child_name, subtree);
         if (subtree == NULL) {
             unwind_path(tree, end);
             if (!start_locked)
                 reader_unlock(tree);
             return NULL;
         }
+        if (waits)
+            slowlog_set_lock_site(waits, waits->site_depth + 1, waits->site_on_target);
         if (IS_ROOT(path) && !reader) // Last node in the path
             writer_lock(subtree);
         else
@@ -214,37 +712,102 @@ static Tree* get_node(Tree* tree, const char* path, bool start_locked, const boo
     return tree;
 }
 
-Tree* tree_new() {
+/**
+ * Creates a new, empty directory, with room for the expected number of subdirectories.
+ * @param expected_subdirectories : number of subdirectories the maps are sized for
+ * @return : pointer to the new node
+ */
+static Tree* node_new_with_capacity(size_t expected_subdirectories) {
     Tree* tree = safe_calloc(1, sizeof(Tree));
-    tree->subdirectories = hmap_new();
+    mem_account(MEM_NODES, sizeof(Tree), 1);
+    tree->subdirectories = hmap_new_with_capacity(expected_subdirectories);
+    CHECK_POINTER(tree->subdirectories);
+    tree->ordered_subdirectories = sidx_new_borrowing_keys(expected_subdirectories);
     PTHREAD_CHECK(pthread_mutex_init(&tree->var_protection, NULL));
     PTHREAD_CHECK(pthread_cond_init(&tree->reader_cond, NULL));
     PTHREAD_CHECK(pthread_cond_init(&tree->writer_cond, NULL));
     PTHREAD_CHECK(pthread_cond_init(&tree->subtree_cond, NULL));
+    tree->subtree_bytes = own_bytes(tree);
 
     return tree;
 }
 
-void tree_free(Tree* tree) {
-    const char* key = NULL;
-    void* value = NULL;
-    HashMapIterator it = hmap_iterator(tree->subdirectories);
+/**
+ * Creates a new, empty directory.
+ * @return : pointer to the new node
+ */
+static Tree* node_new() {
+    return node_new_with_capacity(0);
+}
 
-    while (hmap_next(tree->subdirectories, &it, &key, &value)) {
-        Tree* subdir = pop_subdir(tree, key);
-        tree_free(subdir);
-    }
+/**
+ * Deallocates the node and its whole subtree.
+ * @param tree : node in a file tree
+ */
+static void node_free(Tree* tree) {
+    // The maps are freed as a whole below, so there is no point in popping the children one by one.
+    for (size_t i = 0; i < subdir_count(tree); i++)
+        node_free(sidx_value_at(tree->ordered_subdirectories, i));
 
     hmap_free(tree->subdirectories);
+    sidx_free(tree->ordered_subdirectories);
+    if (tree->histogram_length > 0)
+        mem_account(MEM_HISTOGRAMS, -(int64_t)(tree->histogram_length * sizeof(long)), -1);
+    free(tree->height_histogram);
+    if (tree->frozen)
+        snap_node_unref(tree->frozen);
     PTHREAD_CHECK(pthread_cond_destroy(&tree->writer_cond));
     PTHREAD_CHECK(pthread_cond_destroy(&tree->reader_cond));
     PTHREAD_CHECK(pthread_cond_destroy(&tree->subtree_cond));
     PTHREAD_CHECK(pthread_mutex_destroy(&tree->var_protection));
     free(tree);
+    mem_account(MEM_NODES, -(int64_t)sizeof(Tree), -1);
     tree = NULL;
 }
 
+/**
+ * Makes the node the root of a tree.
+ * @param tree : node without a parent
+ * @param version : initial version of the tree
+ * @return : the node
+ */
+static Tree* make_root(Tree* tree, uint64_t version) {
+    tree->globals = safe_calloc(1, sizeof(TreeGlobals));
+    atomic_init(&tree->globals->version, version);
+    PTHREAD_CHECK(pthread_mutex_init(&tree->globals->snapshot_protection, NULL));
+    return tree;
+}
+
+Tree* tree_new() {
+    return make_root(node_new(), 0);
+}
+
+void tree_free(Tree* tree) {
+    TreeGlobals* globals = tree->globals;
+    if (globals->latest)
+        snap_node_unref(globals->latest);
+    if (globals->wal)
+        wal_close(globals->wal);
+    if (globals->tracer)
+        trace_close(globals->tracer);
+    if (globals->metrics)
+        metrics_free(globals->metrics);
+    if (globals->slow_log)
+        slowlog_close(globals->slow_log);
+    PTHREAD_CHECK(pthread_mutex_destroy(&globals->snapshot_protection));
+    free(globals);
+    node_free(tree);
+}
+
 char* tree_list(Tree* tree, const char* path) {
+    OpStart start;
+    op_begin(tree, &start, TRACE_LIST, path, NULL);
+    char* result = tree_list_range(tree, path, NULL, NULL);
+    op_end(tree, TRACE_LIST, path, NULL, result ? SUCCESS : is_valid_path(path) ? ENOENT : EINVAL, &start);
+    return result;
+}
+
+char* tree_list_range(Tree* tree, const char* path, const char* from, const char* to) {
     if (!is_valid_path(path))
         return NULL;
 
@@ -254,77 +817,694 @@ char* tree_list(Tree* tree, const char* path) {
         return NULL; // The directory doesn't exist
     }
 
-    result = make_map_contents_string(dir->subdirectories); // The read
+    result = make_index_contents_string(dir->ordered_subdirectories, from, to); // The read
 
     unwind_path(dir, NULL);
     reader_unlock(dir);
     return result;
 }
 
-int tree_create(Tree* tree, const char* path) {
+char* tree_list_match(Tree* tree, const char* path, const char* pattern) {
+    if (!is_valid_path(path) || !is_valid_pattern(pattern))
+        return NULL;
+
+    char* result = NULL;
+    Tree* dir = get_node(tree, path, false, READER);
+    if (!dir) {
+        return NULL; // The directory doesn't exist
+    }
+
+    result = make_index_matches_string(dir->ordered_subdirectories, pattern); // The read
+
+    unwind_path(dir, NULL);
+    reader_unlock(dir);
+    return result;
+}
+
+/** State shared by the nodes of a walk **/
+typedef struct WalkState {
+    tree_walk_fn callback;   /** Function to call on every visited directory **/
+    void* arg;               /** Argument passed to `callback` **/
+    size_t locked;           /** Number of descendants locked so far (sequential walks) **/
+    atomic_int result;       /** First non-zero result of `callback` (parallel walks) **/
+} WalkState;
+
+/** A directory to visit in a parallel walk, in an image of the walked subtree **/
+typedef struct WalkTask {
+    SnapNode* node;
+    size_t depth;
+    char path[];
+} WalkTask;
+
+/**
+ * Appends "name/" to the path in `*buffer`, which has length `len`, growing the buffer if necessary.
+ * @param buffer : pointer to a malloc'd buffer holding the path
+ * @param capacity : pointer to the size of the buffer
+ * @param len : length of the path
+ * @param name : directory name to append
+ * @return : length of the new path
+ */
+static size_t append_to_path(char** buffer, size_t* capacity, size_t len, const char* name) {
+    size_t name_len = strlen(name);
+    if (len + name_len + 2 > *capacity) {
+        *capacity = 2 * (len + name_len + 2);
+        *buffer = safe_realloc(*buffer, *capacity);
+    }
+    memcpy(*buffer + len, name, name_len);
+    (*buffer)[len + name_len] = '/';
+    (*buffer)[len + name_len + 1] = '\0';
+    return len + name_len + 1;
+}
+
+/**
+ * Visits `node` and its subtree in pre-order, with subdirectories in lexicographic order.
+ * The node is already locked for reading; the subdirectories are locked before being visited
+ * and stay locked until the whole walk is over, so that the walk sees a consistent state of the subtree.
+ * @param node : current directory
+ * @param path : pointer to a malloc'd buffer holding the path of the directory
+ * @param capacity : pointer to the size of the buffer
+ * @param len : length of the path
+ * @param depth : depth of the directory, relative to the start of the walk
+ * @param state : state of the walk
+ * @return : 0, or the first non-zero result of the callback (which ends the walk)
+ */
+static int walk_subtree(Tree* node, char** path, size_t* capacity, size_t len, size_t depth, WalkState* state) {
+    int result = state->callback(*path, depth, state->arg);
+    if (result != SUCCESS)
+        return result;
+
+    const char* const* names = sidx_keys(node->ordered_subdirectories);
+    for (size_t i = 0; i < subdir_count(node); i++) {
+        Tree* child = sidx_value_at(node->ordered_subdirectories, i);
+        reader_lock(child);
+        state->locked++;
+        size_t child_len = append_to_path(path, capacity, len, names[i]);
+        if ((result = walk_subtree(child, path, capacity, child_len, depth + 1, state)) != SUCCESS)
+            return result;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Unlocks the first `*remaining` descendants of the `node` locked by `walk_subtree`.
+ * As the locked directories can't change, they are found by repeating the same pre-order traversal.
+ * @param node : current directory
+ * @param remaining : number of locked descendants yet to be unlocked
+ */
+static void unlock_walked_subtree(Tree* node, size_t* remaining) {
+    for (size_t i = 0; i < subdir_count(node) && *remaining > 0; i++) {
+        Tree* child = sidx_value_at(node->ordered_subdirectories, i);
+        (*remaining)--;
+        unlock_walked_subtree(child, remaining);
+        reader_unlock(child);
+    }
+}
+
+/**
+ * Parallel counterpart of `walk_subtree`: visits a single directory and submits its subdirectories
+ * as new tasks. It walks an image of the subtree, which needs no locks, so workers taking tasks in any
+ * order can't end up waiting for each other's locks.
+ * @param pool : pool executing the walk
+ * @param worker : calling worker
+ * @param data : the `WalkTask` to execute
+ */
+static void walk_task(WorkPool* pool, size_t worker, void* data) {
+    WalkTask* task = data;
+    WalkState* state = wpool_arg(pool);
+
+    if (atomic_load(&state->result) == SUCCESS) {
+        int result = state->callback(task->path, task->depth, state->arg);
+        if (result != SUCCESS) {
+            int expected = SUCCESS;
+            atomic_compare_exchange_strong(&state->result, &expected, result);
+        }
+    }
+    if (atomic_load(&state->result) != SUCCESS) {
+        free(task); // The walk is over - don't descend any further
+        return;
+    }
+
+    size_t path_len = strlen(task->path);
+    const char* const* names = task->node->names;
+    for (size_t i = 0; i < task->node->n_children; i++) {
+        size_t name_len = strlen(names[i]);
+        WalkTask* subtask = safe_malloc(sizeof(WalkTask) + path_len + name_len + 2);
+        subtask->node = task->node->children[i];
+        subtask->depth = task->depth + 1;
+        memcpy(subtask->path, task->path, path_len);
+        memcpy(subtask->path + path_len, names[i], name_len);
+        subtask->path[path_len + name_len] = '/';
+        subtask->path[path_len + name_len + 1] = '\0';
+        wpool_submit(pool, worker, subtask);
+    }
+    free(task);
+}
+
+int tree_walk(Tree* tree, const char* path, tree_walk_fn callback, void* arg, int flags) {
     if (!is_valid_path(path))
         return EINVAL; // Invalid path
-    if (IS_ROOT(path))
-        return EEXIST; // The root always exists
 
-    char child_name[MAX_FOLDER_NAME_LENGTH + 1], parent_path[MAX_PATH_LENGTH + 1];
-    make_path_to_parent(path, child_name, parent_path);
+    WalkState state = { .callback = callback, .arg = arg };
+    if (flags & TREE_WALK_PARALLEL) {
+        // The subtree is frozen first, which locks it in pre-order like a sequential walk does.
+        SnapNode* image = tree_freeze(tree, path);
+        if (!image)
+            return ENOENT; // The directory doesn't exist
+        atomic_init(&state.result, SUCCESS);
 
-    Tree* parent = get_node(tree, parent_path, false, WRITER);
-    if (!parent) {
-        return ENOENT; // The directory's parent doesn't exist
+        size_t path_len = strlen(path);
+        WalkTask* root_task = safe_malloc(sizeof(WalkTask) + path_len + 1);
+        root_task->node = image;
+        root_task->depth = 0;
+        memcpy(root_task->path, path, path_len + 1);
+        wpool_run(wpool_default_size(), walk_task, &state, root_task);
+        snap_node_unref(image);
+        return atomic_load(&state.result);
     }
 
-    Tree* child = tree_new();
-    child->parent = parent;
-    if (!hmap_insert(parent->subdirectories, child_name, child)) {
-        unwind_path(parent, NULL);
-        writer_unlock(parent);
-        tree_free(child);
-        return EEXIST; // The directory already exists
+    Tree* start = get_node(tree, path, false, READER);
+    if (!start) {
+        return ENOENT; // The directory doesn't exist
     }
 
-    unwind_path(parent, NULL);
-    writer_unlock(parent);
-    return SUCCESS;
+    size_t capacity = MAX_PATH_LENGTH + 1;
+    char* buffer = safe_malloc(capacity);
+    strcpy(buffer, path);
+    int result = walk_subtree(start, &buffer, &capacity, strlen(path), 0, &state);
+    free(buffer);
+    unlock_walked_subtree(start, &state.locked);
+
+    unwind_path(start, NULL);
+    reader_unlock(start);
+    return result;
 }
 
-int tree_remove(Tree* tree, const char* path) {
-    if (IS_ROOT(path))
-        return EBUSY; // Cannot remove the root
+#ifdef TREE_CONTENTION_PROFILING
+/** Total time the node was waited for, by which nodes are ranked **/
+static uint64_t contention_rank(const TreeContention* entry) {
+    return entry->read_wait_ns + entry->write_wait_ns + entry->subtree_wait_ns;
+}
 
-    char child_name[MAX_FOLDER_NAME_LENGTH + 1], parent_path[MAX_PATH_LENGTH + 1];
-    make_path_to_parent(path, child_name, parent_path);
+/**
+ * Adds the contention of the `node` and of its subtree to the report, keeping only the `top_k` nodes
+ * waited for the longest. The node is already locked for reading; the subdirectories are locked while
+ * they are visited.
+ * @param node : current directory
+ * @param path : pointer to a malloc'd buffer holding the path of the directory
+ * @param capacity : pointer to the size of the buffer
+ * @param len : length of the path
+ * @param report : report, with room for `top_k` entries, ordered by `contention_rank`
+ * @param top_k : largest number of entries
+ */
+static void collect_contention(Tree* node, char** path, size_t* capacity, size_t len,
+                               TreeContentionReport* report, size_t top_k) {
+    NodeContention contention;
+    UNDER_MUTEX(&node->var_protection, contention = node->contention);
+    TreeContention entry = {
+        .read_wait_ns = contention.read_wait_ns,
+        .write_wait_ns = contention.write_wait_ns,
+        .subtree_wait_ns = contention.subtree_wait_ns,
+        .read_hold_ns = contention.read_hold_ns,
+        .write_hold_ns = contention.write_hold_ns,
+        .acquisitions = contention.acquisitions,
+        .waits = contention.waits,
+        .max_waiters = contention.max_waiters,
+    };
+    uint64_t rank = contention_rank(&entry);
+    if (rank > 0 && (report->count < top_k || rank > contention_rank(&report->entries[top_k - 1]))) {
+        // Insert the node in order, dropping the last entry if the report is full.
+        size_t position;
+        if (report->count < top_k) {
+            position = report->count++;
+        } else {
+            position = top_k - 1;
+            free(report->entries[position].path);
+        }
+        while (position > 0 && contention_rank(&report->entries[position - 1]) < rank) {
+            report->entries[position] = report->entries[position - 1];
+            position--;
+        }
+        entry.path = strdup(*path);
+        CHECK_POINTER(entry.path);
+        report->entries[position] = entry;
+    }
 
-    Tree* parent = get_node(tree, parent_path, false, WRITER);
-    if (!parent) {
-        return ENOENT; // The directory's parent doesn't exist
+    const char* const* names = sidx_keys(node->ordered_subdirectories);
+    for (size_t i = 0; i < subdir_count(node); i++) {
+        Tree* child = sidx_value_at(node->ordered_subdirectories, i);
+        reader_lock(child);
+        size_t child_len = append_to_path(path, capacity, len, names[i]);
+        collect_contention(child, path, capacity, child_len, report, top_k);
+        reader_unlock(child);
     }
+}
+#endif
 
-    Tree* child = hmap_get(parent->subdirectories, child_name);
-    if (!child) {
-        unwind_path(parent, NULL);
-        writer_unlock(parent);
-        return ENOENT; // The directory doesn't exist
+TreeContentionReport* tree_contention_report(Tree* tree, size_t top_k) {
+#ifdef TREE_CONTENTION_PROFILING
+    TreeContentionReport* report = safe_calloc(1, sizeof(TreeContentionReport) + top_k * sizeof(TreeContention));
+    if (top_k == 0)
+        return report;
+    size_t capacity = MAX_PATH_LENGTH + 1;
+    char* path = safe_malloc(capacity);
+    strcpy(path, "/");
+    reader_lock(tree);
+    collect_contention(tree, &path, &capacity, 1, report, top_k);
+    reader_unlock(tree);
+    free(path);
+    return report;
+#else
+    (void)tree;
+    (void)top_k;
+    errno = ENOTSUP;
+    return NULL;
+#endif
+}
+
+void tree_contention_report_free(TreeContentionReport* report) {
+    if (!report)
+        return;
+    for (size_t i = 0; i < report->count; i++)
+        free(report->entries[i].path);
+    free(report);
+}
+
+bool tree_exists(Tree* tree, const char* path) {
+    return tree_child_count(tree, path) >= 0;
+}
+
+ssize_t tree_child_count(Tree* tree, const char* path) {
+    if (!is_valid_path(path))
+        return -1;
+
+    Tree* dir = get_node(tree, path, false, READER);
+    if (!dir) {
+        return -1; // The directory doesn't exist
     }
-    writer_lock(child);
 
-    if (subdir_count(child) > 0) {
-        writer_unlock(child);
-        unwind_path(parent, NULL);
-        writer_unlock(parent);
-        return ENOTEMPTY; // The directory is not empty
+    ssize_t count = subdir_count(dir); // The read
+
+    unwind_path(dir, NULL);
+    reader_unlock(dir);
+    return count;
+}
+
+int tree_stat(Tree* tree, const char* path, TreeStat* stat) {
+    if (!is_valid_path(path))
+        return EINVAL; // Invalid path
+
+    Tree* dir = get_node(tree, path, false, READER);
+    if (!dir) {
+        return ENOENT; // The directory doesn't exist
     }
-    pop_subdir(parent, child_name); // The removal
 
-    writer_unlock(child);
-    unwind_path(parent, NULL);
-    writer_unlock(parent);
-    tree_free(child);
+    stat->depth = path_depth(path);
+    UNDER_MUTEX(&dir->var_protection,
+        stat->subdirectories = subdir_count(dir);
+        stat->descendants = dir->descendants;
+        stat->bytes = dir->subtree_bytes;
+        stat->height = dir->height;
+    );
+
+    unwind_path(dir, NULL);
+    reader_unlock(dir);
     return SUCCESS;
 }
 
-int tree_move(Tree* tree, const char* s_path, const char* t_path) {
+TreeSnapshot* tree_snapshot(Tree* tree) {
+    TreeGlobals* globals = tree->globals;
+    SnapNode* root = NULL;
+    uint64_t version = atomic_load(&globals->version);
+    UNDER_MUTEX(&globals->snapshot_protection,
+        if (globals->latest && globals->latest_version == version)
+            root = snap_node_ref(globals->latest);
+    );
+    if (root)
+        return snapshot_new(root, version); // Nothing has changed since the last snapshot
+
+    HeldLocks held = { 0 };
+    root = freeze_subtree(tree, &held);
+    version = atomic_load(&globals->version);
+    release_held_locks(&held);
+
+    SnapNode* replaced = NULL;
+    UNDER_MUTEX(&globals->snapshot_protection,
+        if (!globals->latest || globals->latest_version < version) {
+            replaced = globals->latest;
+            globals->latest = snap_node_ref(root);
+            globals->latest_version = version;
+        }
+    );
+    if (replaced)
+        snap_node_unref(replaced);
+    return snapshot_new(root, version);
+}
+
+SnapNode* tree_freeze(Tree* tree, const char* path) {
+    if (IS_ROOT(path)) {
+        TreeSnapshot* snapshot = tree_snapshot(tree); // Shares the latest image of the whole tree
+        SnapNode* root = snap_node_ref(snapshot->root);
+        snapshot_free(snapshot);
+        return root;
+    }
+
+    Tree* dir = get_node(tree, path, false, READER);
+    if (!dir)
+        return NULL; // The directory doesn't exist
+    HeldLocks held = { 0 };
+    SnapNode* image = freeze_locked(dir, &held);
+    release_held_locks(&held);
+    unwind_path(dir, NULL);
+    reader_unlock(dir);
+    return image;
+}
+
+uint64_t tree_version(Tree* tree) {
+    return atomic_load(&tree->globals->version);
+}
+
+TreeReadTxn* tree_read_txn_begin(Tree* tree) {
+    return read_txn_new(tree_snapshot(tree));
+}
+
+int tree_save(Tree* tree, int fd) {
+    TreeSnapshot* snapshot = tree_snapshot(tree);
+    int result = image_write(snapshot->root, snapshot->version, fd);
+    snapshot_free(snapshot);
+    return result;
+}
+
+/** Directories being built out of a mapped image **/
+typedef struct ImageLoad {
+    const TreeImage* image;
+    Tree** nodes; /** nodes[i] is built out of the i-th entry of the node table **/
+} ImageLoad;
+
+static void allocate_loaded_nodes(void* arg, size_t begin, size_t end) {
+    ImageLoad* load = arg;
+    for (size_t i = begin; i < end; i++)
+        load->nodes[i] = node_new_with_capacity(load->image->nodes[i].child_count);
+}
+
+static void link_loaded_nodes(void* arg, size_t begin, size_t end) {
+    ImageLoad* load = arg;
+    for (size_t i = begin; i < end; i++) {
+        Tree* node = load->nodes[i];
+        const ImageNode* entry = &load->image->nodes[i];
+        // Names within the image are distinct and sorted, so neither map needs to search for them.
+        char name[MAX_FOLDER_NAME_LENGTH + 1];
+        size_t length = 0;
+        for (uint64_t c = entry->first_child; c < entry->first_child + entry->child_count; c++) {
+            image_decode_name(load->image, c, name, &length);
+            append_subdir(node, name, load->nodes[c]);
+            load->nodes[c]->parent = node;
+        }
+    }
+}
+
+Tree* tree_load_mmap(const char* path) {
+    TreeImage image;
+    int result = image_map(path, &image);
+    if (result != SUCCESS) {
+        errno = result;
+        return NULL;
+    }
+
+    // Every directory is built independently of the others, none of them being shared yet,
+    // so no locks are taken and the work is split evenly between all processors.
+    size_t count = image.header->node_count;
+    ImageLoad load = { .image = &image, .nodes = safe_malloc(count * sizeof(Tree*)) };
+    size_t n_workers = wpool_default_size();
+    size_t grain = count / (8 * n_workers) + 1;
+    wpool_parallel_for(n_workers, count, grain, allocate_loaded_nodes, &load);
+    wpool_parallel_for(n_workers, count, grain, link_loaded_nodes, &load);
+
+    // Children come after their parents, so going backwards finishes every subtree before its parent.
+    for (size_t i = count - 1; i > 0; i--) {
+        Tree* node = load.nodes[i];
+        recompute_height(node);
+        node->parent->descendants += node->descendants + 1;
+        count_child_height(node->parent, node->height);
+    }
+    Tree* root = load.nodes[0];
+    recompute_height(root);
+    // The histograms are complete now, so the bytes can be counted the same way, bottom-up.
+    for (size_t i = 0; i < count; i++)
+        load.nodes[i]->subtree_bytes = own_bytes(load.nodes[i]);
+    for (size_t i = count - 1; i > 0; i--)
+        load.nodes[i]->parent->subtree_bytes += load.nodes[i]->subtree_bytes;
+
+    free(load.nodes);
+    uint64_t version = image.header->tree_version;
+    image_unmap(&image);
+    return make_root(root, version);
+}
+
+/** Progress of replaying a log onto a tree **/
+typedef struct WalReplay {
+    Tree* tree;
+    uint64_t base_version;   /** Version of the tree before the replay. Older records are already in it **/
+    uint64_t latest_version; /** Highest version replayed so far **/
+} WalReplay;
+
+/**
+ * Applies a single logged operation to the tree.
+ * @return : error code / success of the operation
+ */
+static int apply_logged_op(Tree* tree, const WalOp* op) {
+    switch (op->type) {
+        case WAL_CREATE:
+            return tree_create(tree, op->path);
+        case WAL_REMOVE:
+            return tree_remove(tree, op->path);
+        case WAL_MOVE:
+            return tree_move(tree, op->path, op->target);
+    }
+    return EINVAL;
+}
+
+static int replay_record(void* arg, uint64_t version, const WalOp* ops, size_t n_ops) {
+    WalReplay* replay = arg;
+    if (version <= replay->base_version)
+        return SUCCESS; // Already part of the tree
+
+    int result = SUCCESS;
+    if (n_ops == 1) {
+        result = apply_logged_op(replay->tree, &ops[0]);
+    }
+    else {
+        TreeTxn* txn = tree_txn_begin(replay->tree);
+        for (size_t i = 0; i < n_ops && result == SUCCESS; i++) {
+            if (ops[i].type == WAL_CREATE)
+                result = tree_txn_create(txn, ops[i].path);
+            else if (ops[i].type == WAL_REMOVE)
+                result = tree_txn_remove(txn, ops[i].path);
+            else
+                result = tree_txn_move(txn, ops[i].path, ops[i].target);
+        }
+        if (result == SUCCESS)
+            result = tree_txn_commit(txn, NULL);
+        else
+            tree_txn_abort(txn);
+    }
+    if (result != SUCCESS)
+        return EINVAL; // Every logged modification has succeeded before, so the log doesn't fit the tree
+
+    // Records of independent modifications may be logged out of the order of their versions
+    if (version > replay->latest_version)
+        replay->latest_version = version;
+    atomic_store(&replay->tree->globals->version, replay->latest_version);
+    return SUCCESS;
+}
+
+int tree_wal_replay(Tree* tree, const char* path) {
+    uint64_t version = tree_version(tree);
+    WalReplay replay = { .tree = tree, .base_version = version, .latest_version = version };
+    return wal_read(path, replay_record, &replay, NULL);
+}
+
+int tree_wal_open(Tree* tree, const char* path) {
+    if (tree->globals->wal)
+        return EBUSY; // The tree is logged already
+
+    int result = tree_wal_replay(tree, path);
+    if (result != SUCCESS && result != ENOENT)
+        return result;
+    return wal_open(path, &tree->globals->wal);
+}
+
+int tree_wal_close(Tree* tree) {
+    WriteAheadLog* wal = tree->globals->wal;
+    if (!wal)
+        return SUCCESS;
+    tree->globals->wal = NULL;
+    return wal_close(wal);
+}
+
+int tree_trace_start(Tree* tree, const char* path) {
+    if (tree->globals->tracer)
+        return EBUSY;
+    return trace_open(path, tree_version(tree), &tree->globals->tracer);
+}
+
+int tree_trace_stop(Tree* tree) {
+    TraceWriter* tracer = tree->globals->tracer;
+    if (!tracer)
+        return SUCCESS;
+    tree->globals->tracer = NULL;
+    return trace_close(tracer);
+}
+
+int tree_metrics_start(Tree* tree) {
+    if (tree->globals->metrics)
+        return EBUSY;
+    return metrics_new(&tree->globals->metrics);
+}
+
+void tree_metrics_stop(Tree* tree) {
+    if (tree->globals->metrics)
+        metrics_free(tree->globals->metrics);
+    tree->globals->metrics = NULL;
+}
+
+int tree_metrics_snapshot(Tree* tree, TreeMetricsSnapshot* snapshot) {
+    TreeMetrics* metrics = tree->globals->metrics;
+    if (!metrics)
+        return EINVAL;
+    metrics_snapshot(metrics, snapshot);
+    return SUCCESS;
+}
+
+int tree_slow_log_start(Tree* tree, const char* path, uint64_t threshold_ns) {
+    if (tree->globals->slow_log)
+        return EBUSY;
+    return slowlog_open(path, threshold_ns, &tree->globals->slow_log);
+}
+
+int tree_slow_log_stop(Tree* tree) {
+    SlowLog* slow_log = tree->globals->slow_log;
+    if (!slow_log)
+        return SUCCESS;
+    tree->globals->slow_log = NULL;
+    return slowlog_close(slow_log);
+}
+
+void tree_memory_stats(TreeMemoryStats* stats) {
+    MemTotals totals;
+    mem_totals(&totals);
+    *stats = (TreeMemoryStats) {
+        .nodes = totals.allocations[MEM_NODES],
+        .node_bytes = totals.bytes[MEM_NODES] + totals.bytes[MEM_HISTOGRAMS],
+        .maps = totals.allocations[MEM_MAPS],
+        .map_bytes = totals.bytes[MEM_MAPS],
+        .bucket_bytes = totals.bytes[MEM_BUCKETS],
+        .pairs = totals.allocations[MEM_PAIRS],
+        .pair_bytes = totals.bytes[MEM_PAIRS],
+        .key_bytes = totals.bytes[MEM_KEYS],
+        .index_bytes = totals.bytes[MEM_INDEXES],
+    };
+    for (size_t category = 0; category < MEM_CATEGORIES; category++) {
+        stats->allocations += totals.allocations[category];
+        stats->total_bytes += totals.bytes[category];
+    }
+}
+
+int tree_memory_estimate(Tree* tree, const char* path, size_t* bytes) {
+    TreeStat stat;
+    int err = tree_stat(tree, path, &stat);
+    if (err == SUCCESS)
+        *bytes = stat.bytes;
+    return err;
+}
+
+static int create_directory(Tree* tree, const char* path) {
+    if (!is_valid_path(path))
+        return EINVAL; // Invalid path
+    if (IS_ROOT(path))
+        return EEXIST; // The root always exists
+
+    char child_name[MAX_FOLDER_NAME_LENGTH + 1], parent_path[MAX_PATH_LENGTH + 1];
+    make_path_to_parent(path, child_name, parent_path);
+
+    Tree* parent = get_node(tree, parent_path, false, WRITER);
+    if (!parent) {
+        return ENOENT; // The directory's parent doesn't exist
+    }
+
+    Tree* child = node_new();
+    child->parent = parent;
+    if (!insert_subdir(parent, child_name, child)) {
+        unwind_path(parent, NULL);
+        writer_unlock(parent);
+        node_free(child);
+        return EEXIST; // The directory already exists
+    }
+    update_subtree_stats(parent, 1, child->subtree_bytes, NO_HEIGHT, 0);
+    invalidate_frozen(parent);
+    uint64_t lsn = commit_modification(tree, &(WalOp) { .type = WAL_CREATE, .path = path }, 1);
+
+    unwind_path(parent, NULL);
+    writer_unlock(parent);
+    return wait_until_durable(tree, lsn);
+}
+
+int tree_create(Tree* tree, const char* path) {
+    OpStart start;
+    op_begin(tree, &start, TRACE_CREATE, path, NULL);
+    int result = create_directory(tree, path);
+    op_end(tree, TRACE_CREATE, path, NULL, result, &start);
+    return result;
+}
+
+static int remove_directory(Tree* tree, const char* path) {
+    if (IS_ROOT(path))
+        return EBUSY; // Cannot remove the root
+
+    char child_name[MAX_FOLDER_NAME_LENGTH + 1], parent_path[MAX_PATH_LENGTH + 1];
+    make_path_to_parent(path, child_name, parent_path);
+
+    Tree* parent = get_node(tree, parent_path, false, WRITER);
+    if (!parent) {
+        return ENOENT; // The directory's parent doesn't exist
+    }
+
+    Tree* child = hmap_get(parent->subdirectories, child_name);
+    if (!child) {
+        unwind_path(parent, NULL);
+        writer_unlock(parent);
+        return ENOENT; // The directory doesn't exist
+    }
+    if (op_waits)
+        slowlog_set_lock_site(op_waits, path_depth(path), false);
+    writer_lock(child);
+
+    if (subdir_count(child) > 0) {
+        writer_unlock(child);
+        unwind_path(parent, NULL);
+        writer_unlock(parent);
+        return ENOTEMPTY; // The directory is not empty
+    }
+    pop_subdir(parent, child_name); // The removal
+    update_subtree_stats(parent, -1, -(long)child->subtree_bytes, 0, NO_HEIGHT);
+    invalidate_frozen(parent);
+    uint64_t lsn = commit_modification(tree, &(WalOp) { .type = WAL_REMOVE, .path = path }, 1);
+
+    writer_unlock(child);
+    unwind_path(parent, NULL);
+    writer_unlock(parent);
+    node_free(child);
+    return wait_until_durable(tree, lsn);
+}
+
+int tree_remove(Tree* tree, const char* path) {
+    OpStart start;
+    op_begin(tree, &start, TRACE_REMOVE, path, NULL);
+    int result = remove_directory(tree, path);
+    op_end(tree, TRACE_REMOVE, path, NULL, result, &start);
+    return result;
+}
+
+static int move_directory(Tree* tree, const char* s_path, const char* t_path) {
     if (!is_valid_path(s_path) || !is_valid_path(t_path))
         return EINVAL; // Invalid path names
     if (IS_ROOT(s_path))
@@ -336,6 +1516,7 @@ int tree_move(Tree* tree, const char* s_path, const char* t_path) {
 
     int cmp;
     size_t index_after_lca;
+    uint64_t lsn = 0;
     char s_name[MAX_FOLDER_NAME_LENGTH + 1], t_name[MAX_FOLDER_NAME_LENGTH + 1];
     char s_parent_path[MAX_PATH_LENGTH + 1], t_parent_path[MAX_PATH_LENGTH + 1], lca_path[MAX_PATH_LENGTH + 1];
     Tree *s_dir = NULL, *s_parent = NULL, *t_parent = NULL, *lca = NULL;
@@ -368,6 +1549,8 @@ int tree_move(Tree* tree, const char* s_path, const char* t_path) {
             writer_unlock(lca);
             return ENOENT; // The source's parent doesn't exist
         }
+        if (op_waits) // The search for the target's parent starts over from the LCA
+            slowlog_set_lock_site(op_waits, path_depth(lca_path), true);
         if (!(t_parent = get_node(lca, t_parent_path + index_after_lca, true, WRITER))) {
             if (s_parent != lca) {
                 unwind_path(s_parent, lca);
@@ -390,11 +1573,15 @@ int tree_move(Tree* tree, const char* s_path, const char* t_path) {
             CLEANUP();
             return EEXIST; // There already exists a directory with the same name as the target
         }
-        wait_until_subtree_activity_ceases(s_dir);
+        wait_until_subtree_activity_ceases(s_dir, 0);
         // Pop and insert the source
         pop_subdir(s_parent, s_name);
         s_dir->parent = t_parent;
-        hmap_insert(t_parent->subdirectories, t_name, s_dir);
+        insert_subdir(t_parent, t_name, s_dir);
+        move_subtree_stats(s_dir, s_parent, t_parent);
+        invalidate_frozen(s_parent);
+        invalidate_frozen(t_parent);
+        lsn = commit_modification(tree, &(WalOp) { .type = WAL_MOVE, .path = s_path, .target = t_path }, 1);
         CLEANUP();
         #undef CLEANUP
     }
@@ -433,12 +1620,963 @@ int tree_move(Tree* tree, const char* s_path, const char* t_path) {
             CLEANUP();
             return EEXIST; // There already exists a directory with the same name as the target
         }
-        wait_until_subtree_activity_ceases(s_dir);
+        wait_until_subtree_activity_ceases(s_dir, 0);
         // Pop and insert the source
         s_dir = pop_subdir(s_parent, s_name);
-        hmap_insert(t_parent->subdirectories, t_name, s_dir);
+        insert_subdir(t_parent, t_name, s_dir);
         s_dir->parent = t_parent;
+        move_subtree_stats(s_dir, s_parent, t_parent);
+        invalidate_frozen(s_parent);
+        invalidate_frozen(t_parent);
+        lsn = commit_modification(tree, &(WalOp) { .type = WAL_MOVE, .path = s_path, .target = t_path }, 1);
         CLEANUP();
     }
+    return wait_until_durable(tree, lsn);
+}
+
+int tree_move(Tree* tree, const char* s_path, const char* t_path) {
+    OpStart start;
+    op_begin(tree, &start, TRACE_MOVE, s_path, t_path);
+    int result = move_directory(tree, s_path, t_path);
+    op_end(tree, TRACE_MOVE, s_path, t_path, result, &start);
+    return result;
+}
+
+/** Kinds of operations in a write transaction **/
+typedef enum TxnOpType {
+    TXN_CREATE,
+    TXN_REMOVE,
+    TXN_MOVE
+} TxnOpType;
+
+/** An operation in a write transaction **/
+typedef struct TxnOp {
+    TxnOpType type;
+    char* path;   /** Directory to create / remove, or the source of a move **/
+    char* target; /** Target of a move. NULL for the other operations **/
+} TxnOp;
+
+struct TreeTxn {
+    Tree* tree;
+    TxnOp* ops;
+    size_t count, capacity;
+};
+
+/** What has to be done to revert an applied operation. The names come from the operation's paths **/
+typedef struct TxnUndo {
+    TxnOpType type;    /** Type of the applied operation **/
+    Tree* node;        /** Directory created, removed or moved **/
+    Tree* parent;      /** Its parent before the operation **/
+    Tree* new_parent;  /** Its parent after the operation (moves only) **/
+} TxnUndo;
+
+/**
+ * Attaches `subdir` to the `parent` under the specified name, keeping the statistics and snapshot images
+ * up to date. Used by transactions, which hold the locks of the directories they modify.
+ * @param parent : new parent directory
+ * @param name : subdirectory name, not present in the parent
+ * @param subdir : detached directory
+ */
+static void attach_subdir(Tree* parent, const char* name, Tree* subdir) {
+    insert_subdir(parent, name, subdir);
+    subdir->parent = parent;
+    update_subtree_stats(parent, subdir->descendants + 1, subdir->subtree_bytes, NO_HEIGHT, subdir->height);
+    invalidate_frozen(parent);
+}
+
+/**
+ * Counterpart of `attach_subdir`: detaches and returns the subdirectory of the `parent` with the specified name.
+ * @param parent : parent directory
+ * @param name : name of an existing subdirectory
+ * @return : the detached directory
+ */
+static Tree* detach_subdir(Tree* parent, const char* name) {
+    Tree* subdir = pop_subdir(parent, name);
+    update_subtree_stats(parent, -(long)(subdir->descendants + 1), -(long)subdir->subtree_bytes, subdir->height,
+                         NO_HEIGHT);
+    invalidate_frozen(parent);
+    return subdir;
+}
+
+/**
+ * Finds the directory at the path, without any locking. The caller must own the subtree of `start`.
+ * @param start : directory the path is relative to
+ * @param path : valid path, relative to `start`
+ * @return : the directory, or NULL if it doesn't exist
+ */
+static Tree* find_owned_node(Tree* start, const char* path) {
+    char child_name[MAX_FOLDER_NAME_LENGTH + 1];
+    while (start && (path = split_path(path, child_name)))
+        start = hmap_get(start->subdirectories, child_name);
+    return start;
+}
+
+/** A directory whose contents a transaction changes, locked for writing before any operation is applied **/
+typedef struct TxnLock {
+    char* path;   /** Path of the directory, malloc'd **/
+    Tree* node;   /** The locked directory. NULL if it didn't exist, isn't locked on its own or has been removed **/
+    bool drained; /** Whether it's the common ancestor of the parents in a move, whose whole subtree is taken over **/
+    bool covered; /** Whether it lies in the subtree of a drained directory, and so isn't locked on its own **/
+} TxnLock;
+
+/** Directories locked by a transaction **/
+typedef struct TxnLocks {
+    TxnLock* locks;     /** Sorted by path, which is the pre-order of the tree **/
+    size_t count, capacity;
+    HeldLocks held;     /** Write locks of the directories **/
+    Tree** referenced;  /** Every directory locked on the way, whose reference counter has been incremented **/
+    size_t n_referenced, referenced_capacity;
+} TxnLocks;
+
+/** A locked directory on the way from the root to the directory a transaction locks next **/
+typedef struct TxnSpine {
+    Tree* node;
+    const char* path;   /** Path of a directory in its subtree, whose first `length` characters are its own **/
+    size_t length;
+    size_t depth;
+    bool reader;        /** Whether it's only locked on the way **/
+} TxnSpine;
+
+/**
+ * Adds a directory to the set locked by a transaction.
+ * @param locks : directories locked by the transaction
+ * @param path : path of the directory, copied
+ * @param drained : whether the transaction takes over its whole subtree
+ */
+static void txn_add_lock(TxnLocks* locks, const char* path, bool drained) {
+    if (locks->count == locks->capacity) {
+        locks->capacity = 2 * locks->capacity + 8;
+        locks->locks = safe_realloc(locks->locks, locks->capacity * sizeof(TxnLock));
+    }
+    char* copy = strdup(path);
+    CHECK_POINTER(copy);
+    locks->locks[locks->count++] = (TxnLock) { .path = copy, .drained = drained };
+}
+
+static int compare_txn_locks(const void* a, const void* b) {
+    return strcmp(((const TxnLock*)a)->path, ((const TxnLock*)b)->path);
+}
+
+/**
+ * Finds a directory in the set locked by a transaction.
+ * @param locks : directories locked by the transaction
+ * @param path : path of the directory
+ * @return : the directory's entry, or NULL if it's not in the set
+ */
+static TxnLock* txn_find_lock(TxnLocks* locks, const char* path) {
+    TxnLock key = { .path = (char*)path };
+    return bsearch(&key, locks->locks, locks->count, sizeof(TxnLock), compare_txn_locks);
+}
+
+/**
+ * Collects the directories whose contents the operations of a transaction change: the parents of created
+ * and removed directories, and the removed directories themselves. A move is given the deepest common
+ * ancestor of its source's and target's parents, like `tree_move` takes, whose whole subtree the transaction
+ * then takes over. Directories in such a subtree are not locked on their own.
+ * @param txn : write transaction
+ * @param locks : empty set, filled in with the directories in pre-order
+ */
+static void txn_collect_locks(const TreeTxn* txn, TxnLocks* locks) {
+    char parent_path[MAX_PATH_LENGTH + 1], t_parent_path[MAX_PATH_LENGTH + 1], lca_path[MAX_PATH_LENGTH + 1];
+    for (size_t i = 0; i < txn->count; i++) {
+        const TxnOp* op = &txn->ops[i];
+        make_path_to_parent(op->path, NULL, parent_path);
+        switch (op->type) {
+            case TXN_CREATE:
+                txn_add_lock(locks, parent_path, false);
+                break;
+            case TXN_REMOVE:
+                txn_add_lock(locks, parent_path, false);
+                txn_add_lock(locks, op->path, false);
+                break;
+            case TXN_MOVE:
+                make_path_to_parent(op->target, NULL, t_parent_path);
+                make_path_to_common_ancestor(parent_path, t_parent_path, lca_path);
+                txn_add_lock(locks, lca_path, true);
+                break;
+        }
+    }
+    qsort(locks->locks, locks->count, sizeof(TxnLock), compare_txn_locks);
+
+    size_t distinct = 0;
+    for (size_t i = 0; i < locks->count; i++) {
+        if (distinct > 0 && strcmp(locks->locks[distinct - 1].path, locks->locks[i].path) == 0) {
+            locks->locks[distinct - 1].drained |= locks->locks[i].drained;
+            free(locks->locks[i].path);
+        }
+        else
+            locks->locks[distinct++] = locks->locks[i];
+    }
+    locks->count = distinct;
+
+    // A subtree is a contiguous range in pre-order, starting with its root
+    const char* drained = NULL;
+    for (size_t i = 0; i < locks->count; i++) {
+        TxnLock* lock = &locks->locks[i];
+        if (drained && strncmp(drained, lock->path, strlen(drained)) == 0) {
+            lock->covered = true;
+            lock->drained = false;
+        }
+        else
+            drained = lock->drained ? lock->path : NULL;
+    }
+}
+
+/**
+ * Locks a directory on behalf of a transaction, and increments its reference counter.
+ * @param locks : directories locked by the transaction
+ * @param node : the directory
+ * @param reader : whether it's locked for reading, on the way to another directory
+ * @param depth : its depth, for the slow operation log
+ */
+static void txn_lock_node(TxnLocks* locks, Tree* node, bool reader, size_t depth) {
+    if (op_waits)
+        slowlog_set_lock_site(op_waits, depth, false);
+    if (reader)
+        reader_lock(node);
+    else
+        writer_lock(node);
+    UNDER_MUTEX(&node->var_protection, node->refcount++);
+    if (locks->n_referenced == locks->referenced_capacity) {
+        locks->referenced_capacity = 2 * locks->referenced_capacity + 16;
+        locks->referenced = safe_realloc(locks->referenced, locks->referenced_capacity * sizeof(Tree*));
+    }
+    locks->referenced[locks->n_referenced++] = node;
+}
+
+/**
+ * Write-locks the collected directories which exist, in pre-order, and waits for the operations in progress
+ * in the drained subtrees to finish. Like a sequential walk, it goes down from the root, read-locking the
+ * directories on the way, and releases them when it leaves their subtrees. No lock is requested on a directory
+ * above one already held, so transactions can't deadlock with each other, nor with the other operations.
+ * The reference counters of all the directories on the way stay incremented, so that none of them is moved
+ * until the transaction ends.
+ * @param tree : root of the tree
+ * @param locks : directories collected by `txn_collect_locks`
+ */
+static void txn_acquire(Tree* tree, TxnLocks* locks) {
+    char child_name[MAX_FOLDER_NAME_LENGTH + 1];
+    TxnSpine* spine = safe_malloc((MAX_PATH_LENGTH / 2 + 1) * sizeof(TxnSpine));
+    size_t height = 0;
+
+    for (size_t i = 0; i < locks->count; i++) {
+        TxnLock* lock = &locks->locks[i];
+        if (lock->covered)
+            continue;
+        size_t length = strlen(lock->path);
+        // Leave the subtrees the directory doesn't lie in
+        while (height > 0 && (spine[height - 1].length > length ||
+                              strncmp(spine[height - 1].path, lock->path, spine[height - 1].length) != 0)) {
+            height--;
+            if (spine[height].reader)
+                reader_unlock(spine[height].node);
+        }
+        if (height == 0) {
+            bool is_lock = IS_ROOT(lock->path);
+            txn_lock_node(locks, tree, !is_lock, 0);
+            spine[height++] = (TxnSpine) { .node = tree, .path = lock->path, .length = 1, .reader = !is_lock };
+        }
+
+        const char* subpath = lock->path + spine[height - 1].length - 1;
+        while (spine[height - 1].length < length) {
+            subpath = split_path(subpath, child_name);
+            TxnSpine* parent = &spine[height - 1];
+            Tree* child = hmap_get(parent->node->subdirectories, child_name);
+            TREE_PROBE3(node__hop, parent->node, child_name, child);
+            if (!child)
+                break; // The directory doesn't exist
+            size_t child_length = length - strlen(subpath) + 1;
+            bool is_lock = child_length == length;
+            txn_lock_node(locks, child, !is_lock, parent->depth + 1);
+            spine[height++] = (TxnSpine) {
+                .node = child, .path = lock->path, .length = child_length, .depth = parent->depth + 1,
+                .reader = !is_lock,
+            };
+        }
+
+        lock->node = NULL;
+        if (spine[height - 1].length == length) {
+            lock->node = spine[height - 1].node;
+            hold_lock(&locks->held, lock->node, false);
+            // No operation can enter the subtree past the locked directory; wait for those already inside to leave.
+            // The only reference left is then ours, and the whole subtree can be modified without further locking.
+            if (lock->drained)
+                wait_until_subtree_activity_ceases(lock->node, 1);
+        }
+    }
+
+    while (height > 0) {
+        height--;
+        if (spine[height].reader)
+            reader_unlock(spine[height].node);
+    }
+    free(spine);
+}
+
+/**
+ * Releases the directories locked by a transaction, and frees the set.
+ * @param locks : directories locked by `txn_acquire`
+ */
+static void txn_release(TxnLocks* locks) {
+    while (locks->n_referenced > 0) {
+        Tree* node = locks->referenced[--locks->n_referenced];
+        unwind_path(node, node->parent);
+    }
+    release_held_locks(&locks->held);
+    for (size_t i = 0; i < locks->count; i++)
+        free(locks->locks[i].path);
+    free(locks->locks);
+    free(locks->referenced);
+}
+
+/**
+ * Finds a directory the transaction may modify: a locked one, one in a drained subtree, or one the
+ * transaction has created in either of them.
+ * @param locks : directories locked by the transaction
+ * @param path : path of the directory
+ * @return : the directory, or NULL if it doesn't exist
+ */
+static Tree* txn_find_node(TxnLocks* locks, const char* path) {
+    char prefix[MAX_PATH_LENGTH + 1], child_name[MAX_FOLDER_NAME_LENGTH + 1];
+    Tree* node = NULL;
+    const char* subpath = path;
+    size_t length = 1;
+    strcpy(prefix, "/");
+    while (true) {
+        TxnLock* lock = txn_find_lock(locks, prefix);
+        if (!lock)
+            node = NULL; // Not locked, so its contents may be changing
+        else if (lock->node)
+            node = lock->node;
+        else if (node)
+            node = hmap_get(node->subdirectories, child_name); // Created or moved here by the transaction
+        else
+            node = NULL;
+        if (lock && lock->drained)
+            return node ? find_owned_node(node, subpath) : NULL;
+        if (!(subpath = split_path(subpath, child_name)))
+            return node;
+        length = strlen(path) - strlen(subpath) + 1;
+        memcpy(prefix, path, length);
+        prefix[length] = '\0';
+    }
+}
+
+/**
+ * Applies a single operation of a transaction, which has locked the directories it modifies.
+ * Checks and error codes are those of `tree_create`, `tree_remove` and `tree_move`.
+ * @param locks : directories locked by the transaction
+ * @param op : the operation
+ * @param undo : where to record how to revert the operation
+ * @return : error code / success
+ */
+static int txn_apply(TxnLocks* locks, const TxnOp* op, TxnUndo* undo) {
+    char name[MAX_FOLDER_NAME_LENGTH + 1], new_name[MAX_FOLDER_NAME_LENGTH + 1];
+    char parent_path[MAX_PATH_LENGTH + 1], t_parent_path[MAX_PATH_LENGTH + 1];
+    Tree *parent = NULL, *child = NULL;
+    undo->type = op->type;
+    make_path_to_parent(op->path, name, parent_path);
+    if (!(parent = txn_find_node(locks, parent_path)))
+        return ENOENT; // The directory's parent doesn't exist
+    child = hmap_get(parent->subdirectories, name);
+
+    switch (op->type) {
+        case TXN_CREATE:
+            if (child)
+                return EEXIST; // The directory already exists
+            undo->node = node_new();
+            undo->parent = parent;
+            attach_subdir(parent, name, undo->node);
+            return SUCCESS;
+
+        case TXN_REMOVE: {
+            if (!child)
+                return ENOENT; // The directory doesn't exist
+            if (subdir_count(child) > 0)
+                return ENOTEMPTY; // The directory is not empty
+            undo->node = detach_subdir(parent, name);
+            undo->parent = parent;
+            TxnLock* lock = txn_find_lock(locks, op->path);
+            if (lock && lock->node == undo->node)
+                lock->node = NULL; // A directory created in its place later is found through the parent
+            return SUCCESS;
+        }
+
+        case TXN_MOVE:
+            make_path_to_parent(op->target, new_name, t_parent_path);
+            if (!(undo->new_parent = txn_find_node(locks, t_parent_path)))
+                return ENOENT; // The target's parent doesn't exist
+            if (!child)
+                return ENOENT; // The source doesn't exist
+            if (hmap_get(undo->new_parent->subdirectories, new_name)) {
+                if (strcmp(op->path, op->target) == 0) {
+                    undo->node = NULL;
+                    return SUCCESS; // The source and target are the same - nothing to move
+                }
+                return EEXIST; // There already exists a directory with the same name as the target
+            }
+            // An earlier operation may have moved a descendant of the source to the target's path
+            for (Tree* ancestor = undo->new_parent; ancestor; ancestor = ancestor->parent) {
+                if (ancestor == child)
+                    return EMOVINGANCESTOR; // No directory can be moved to its descendant
+            }
+            undo->node = detach_subdir(parent, name);
+            undo->parent = parent;
+            attach_subdir(undo->new_parent, new_name, undo->node);
+            return SUCCESS;
+    }
     return SUCCESS;
-}
\ No newline at end of file
+}
+
+/**
+ * Reverts an operation applied by `txn_apply`.
+ * @param op : the operation
+ * @param undo : how to revert the operation
+ */
+static void txn_revert(const TxnOp* op, TxnUndo* undo) {
+    char name[MAX_FOLDER_NAME_LENGTH + 1], new_name[MAX_FOLDER_NAME_LENGTH + 1], parent_path[MAX_PATH_LENGTH + 1];
+    make_path_to_parent(op->path, name, parent_path);
+    switch (undo->type) {
+        case TXN_CREATE:
+            node_free(detach_subdir(undo->parent, name));
+            break;
+        case TXN_REMOVE:
+            attach_subdir(undo->parent, name, undo->node);
+            break;
+        case TXN_MOVE:
+            if (undo->node) {
+                make_path_to_parent(op->target, new_name, parent_path);
+                attach_subdir(undo->parent, name, detach_subdir(undo->new_parent, new_name));
+            }
+            break;
+    }
+}
+
+TreeTxn* tree_txn_begin(Tree* tree) {
+    TreeTxn* txn = safe_calloc(1, sizeof(TreeTxn));
+    txn->tree = tree;
+    return txn;
+}
+
+/** Types of the operations of a transaction in the trace of the tree **/
+static const TraceOpType txn_trace_types[] = {
+    [TXN_CREATE] = TRACE_CREATE, [TXN_REMOVE] = TRACE_REMOVE, [TXN_MOVE] = TRACE_MOVE
+};
+
+/**
+ * Describes an operation of a transaction for the log.
+ * @param op : operation of a transaction
+ * @return : the logged operation, referring to the paths of `op`
+ */
+static WalOp txn_log_op(const TxnOp* op) {
+    static const WalOpType types[] = { [TXN_CREATE] = WAL_CREATE, [TXN_REMOVE] = WAL_REMOVE, [TXN_MOVE] = WAL_MOVE };
+    return (WalOp) { .type = types[op->type], .path = op->path, .target = op->target };
+}
+
+/**
+ * Appends an operation to the transaction.
+ * @param txn : write transaction
+ * @param type : type of the operation
+ * @param path : its path, copied
+ * @param target : its target, copied. NULL unless it's a move
+ */
+static void txn_append(TreeTxn* txn, TxnOpType type, const char* path, const char* target) {
+    if (txn->count == txn->capacity) {
+        txn->capacity = 2 * txn->capacity + 4;
+        txn->ops = safe_realloc(txn->ops, txn->capacity * sizeof(TxnOp));
+    }
+    TxnOp* op = &txn->ops[txn->count++];
+    op->type = type;
+    op->path = strdup(path);
+    CHECK_POINTER(op->path);
+    op->target = NULL;
+    if (target) {
+        op->target = strdup(target);
+        CHECK_POINTER(op->target);
+    }
+}
+
+int tree_txn_create(TreeTxn* txn, const char* path) {
+    if (!is_valid_path(path))
+        return EINVAL; // Invalid path
+    if (IS_ROOT(path))
+        return EEXIST; // The root always exists
+    txn_append(txn, TXN_CREATE, path, NULL);
+    return SUCCESS;
+}
+
+int tree_txn_remove(TreeTxn* txn, const char* path) {
+    if (!is_valid_path(path))
+        return EINVAL; // Invalid path
+    if (IS_ROOT(path))
+        return EBUSY; // Cannot remove the root
+    txn_append(txn, TXN_REMOVE, path, NULL);
+    return SUCCESS;
+}
+
+int tree_txn_move(TreeTxn* txn, const char* s_path, const char* t_path) {
+    if (!is_valid_path(s_path) || !is_valid_path(t_path))
+        return EINVAL; // Invalid path names
+    if (IS_ROOT(s_path))
+        return EBUSY; // Can't move the root
+    if (IS_ROOT(t_path))
+        return EEXIST; // Can't assign a new root
+    if (is_ancestor(s_path, t_path))
+        return EMOVINGANCESTOR; // No directory can be moved to its descendant
+    txn_append(txn, TXN_MOVE, s_path, t_path);
+    return SUCCESS;
+}
+
+void tree_txn_abort(TreeTxn* txn) {
+    for (size_t i = 0; i < txn->count; i++) {
+        free(txn->ops[i].path);
+        free(txn->ops[i].target);
+    }
+    free(txn->ops);
+    free(txn);
+}
+
+/**
+ * Starts timing the operations of a transaction being committed. The waits of the commit are collected
+ * with those of its first operation.
+ * @param txn : write transaction
+ * @param starts : filled in with the start of every operation
+ */
+static void txn_begin_ops(TreeTxn* txn, OpStart* starts) {
+    for (size_t i = 0; i < txn->count; i++)
+        op_begin(txn->tree, &starts[i], txn_trace_types[txn->ops[i].type], txn->ops[i].path, txn->ops[i].target);
+    if (txn->tree->globals->slow_log)
+        op_waits = &starts[0].waits;
+}
+
+/**
+ * Finishes the operations of a committed transaction. If they took effect, each of them is recorded as if
+ * it had been called on its own and taken as long as the whole commit. Otherwise they are only reported
+ * to the probes.
+ * @param txn : write transaction
+ * @param starts : start of every operation, filled in by `txn_begin_ops`
+ * @param applied : whether the operations took effect
+ * @param result : result of the commit
+ */
+static void txn_end_ops(TreeTxn* txn, OpStart* starts, bool applied, int result) {
+    for (size_t i = 0; i < txn->count; i++) {
+        const TxnOp* op = &txn->ops[i];
+        if (applied) {
+            if (txn->tree->globals->slow_log)
+                starts[i].waits = starts[0].waits;
+            op_end(txn->tree, txn_trace_types[op->type], op->path, op->target, result, &starts[i]);
+        }
+        else
+            TREE_PROBE4(op__done, op_names[txn_trace_types[op->type]], op->path, op->target, result);
+    }
+    op_waits = NULL;
+}
+
+int tree_txn_commit(TreeTxn* txn, size_t* failed_op) {
+    Tree* tree = txn->tree;
+    if (txn->count == 0) {
+        tree_txn_abort(txn);
+        return SUCCESS;
+    }
+    OpStart* starts = safe_malloc(txn->count * sizeof(OpStart));
+    txn_begin_ops(txn, starts);
+
+    TxnLocks locks = { 0 };
+    txn_collect_locks(txn, &locks);
+    txn_acquire(tree, &locks);
+
+    TxnUndo* undo = safe_malloc(txn->count * sizeof(TxnUndo));
+    int result = SUCCESS;
+    uint64_t lsn = 0;
+    size_t applied = 0;
+    for (; applied < txn->count; applied++) {
+        if ((result = txn_apply(&locks, &txn->ops[applied], &undo[applied])) != SUCCESS)
+            break;
+    }
+
+    if (result != SUCCESS) {
+        if (failed_op)
+            *failed_op = applied;
+        while (applied > 0) {
+            applied--;
+            txn_revert(&txn->ops[applied], &undo[applied]);
+        }
+    }
+    else {
+        // All the operations take effect at once, and are logged as a single record
+        WalOp* logged = safe_malloc(txn->count * sizeof(WalOp));
+        for (size_t i = 0; i < txn->count; i++)
+            logged[i] = txn_log_op(&txn->ops[i]);
+        lsn = commit_modification(tree, logged, txn->count);
+        free(logged);
+    }
+
+    txn_release(&locks);
+
+    for (size_t i = 0; result == SUCCESS && i < txn->count; i++) {
+        if (undo[i].type == TXN_REMOVE)
+            node_free(undo[i].node);
+    }
+    free(undo);
+    bool applied_all = result == SUCCESS;
+    if (applied_all)
+        result = wait_until_durable(tree, lsn);
+    txn_end_ops(txn, starts, applied_all, result);
+    free(starts);
+    tree_txn_abort(txn);
+    return result;
+}
+
+/**
+ * Computes the statistics of a detached subtree, built without maintaining them.
+ * @param node : root of the subtree, not shared with any other thread
+ */
+static void compute_subtree_stats(Tree* node) {
+    node->descendants = 0;
+    size_t bytes = 0;
+    if (node->histogram_length > 0)
+        memset(node->height_histogram, 0, node->histogram_length * sizeof(long));
+    for (size_t i = 0; i < subdir_count(node); i++) {
+        Tree* child = sidx_value_at(node->ordered_subdirectories, i);
+        compute_subtree_stats(child);
+        node->descendants += child->descendants + 1;
+        bytes += child->subtree_bytes;
+        count_child_height(node, child->height);
+    }
+    recompute_height(node);
+    node->subtree_bytes = own_bytes(node) + bytes;
+}
+
+/**
+ * Appends the paths of the subtree to the list of operations creating it, in pre-order.
+ * @param node : root of the subtree
+ * @param path : path of `node`
+ * @param ops : pointer to a malloc'd array of operations, grown as needed
+ * @param count : pointer to the number of operations
+ * @param capacity : pointer to the length of the array
+ */
+static void log_created_subtree(Tree* node, const char* path, WalOp** ops, size_t* count, size_t* capacity) {
+    if (*count == *capacity) {
+        *capacity = *capacity ? 2 * *capacity : 64;
+        *ops = safe_realloc(*ops, *capacity * sizeof(WalOp));
+    }
+    char* copy = strdup(path);
+    CHECK_POINTER(copy);
+    (*ops)[(*count)++] = (WalOp) { .type = WAL_CREATE, .path = copy };
+
+    size_t len = strlen(path);
+    char* child_path = safe_malloc(len + MAX_FOLDER_NAME_LENGTH + 2);
+    memcpy(child_path, path, len);
+    for (size_t i = 0; i < subdir_count(node); i++) {
+        const char* name = sidx_keys(node->ordered_subdirectories)[i];
+        size_t name_len = strlen(name);
+        memcpy(child_path + len, name, name_len);
+        strcpy(child_path + len + name_len, "/");
+        log_created_subtree(sidx_value_at(node->ordered_subdirectories, i), child_path, ops, count, capacity);
+    }
+    free(child_path);
+}
+
+/** Largest number of directories whose creation is logged as a single record when a subtree is attached **/
+#define GRAFT_OPS_PER_RECORD 4096
+
+/**
+ * Attaches a detached subtree to the tree as a new directory, as a single modification.
+ * Its directories are logged in pre-order, in records of at most GRAFT_OPS_PER_RECORD creations each,
+ * so that the log's records stay bounded however big the subtree is.
+ * The subtree must have its statistics computed. On failure, it is left to the caller.
+ * @param tree : file tree
+ * @param path : valid path of the new directory, other than the root
+ * @param subtree : root of the subtree
+ * @return : error code / success
+ */
+static int graft_subtree(Tree* tree, const char* path, Tree* subtree) {
+    char child_name[MAX_FOLDER_NAME_LENGTH + 1], parent_path[MAX_PATH_LENGTH + 1];
+    make_path_to_parent(path, child_name, parent_path);
+
+    // The subtree is logged as the creation of all of its directories, prepared before any locking.
+    WalOp* ops = NULL;
+    size_t n_ops = 0, capacity = 0;
+    if (tree->globals->wal)
+        log_created_subtree(subtree, path, &ops, &n_ops, &capacity);
+
+    int result = SUCCESS;
+    uint64_t lsn = 0;
+    Tree* parent = get_node(tree, parent_path, false, WRITER);
+    if (!parent) {
+        result = ENOENT; // The directory's parent doesn't exist
+    }
+    else {
+        if (insert_subdir(parent, child_name, subtree)) {
+            subtree->parent = parent;
+            update_subtree_stats(parent, subtree->descendants + 1, subtree->subtree_bytes, NO_HEIGHT, subtree->height);
+            invalidate_frozen(parent);
+            // Every record is committed under the parent's lock, so no other modification of the subtree
+            // comes between them, and a directory is always logged after its parent.
+            size_t committed = 0;
+            do {
+                size_t n = n_ops - committed < GRAFT_OPS_PER_RECORD ? n_ops - committed : GRAFT_OPS_PER_RECORD;
+                lsn = commit_modification(tree, ops + committed, n);
+                committed += n;
+            } while (committed < n_ops);
+        }
+        else {
+            result = EEXIST; // The directory already exists
+        }
+        unwind_path(parent, NULL);
+        writer_unlock(parent);
+    }
+
+    for (size_t i = 0; i < n_ops; i++)
+        free((char*)ops[i].path);
+    free(ops);
+    return result == SUCCESS ? wait_until_durable(tree, lsn) : result;
+}
+
+/** Size of the buffer for directory entries read at once **/
+#define DIRENT_BUFFER_SIZE (64 * 1024)
+
+/** A directory entry, as returned by getdents64 **/
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/** A host directory to be imported into a node **/
+typedef struct ImportTask {
+    char* path;         /** Path of the directory relative to the imported one, "." for the imported one **/
+    Tree* node;         /** Detached node to fill with subdirectories **/
+    size_t path_length; /** Length of the path of `node` in the tree **/
+} ImportTask;
+
+/** State shared by all the tasks of an import **/
+typedef struct FsImport {
+    int root_fd;      /** The imported host directory **/
+    atomic_int error; /** First error encountered **/
+} FsImport;
+
+/**
+ * Opens a directory below the imported one without following symbolic links on the way.
+ * @param root_fd : the imported directory
+ * @param path : path relative to it
+ * @return : the descriptor, or -1 with errno set
+ */
+static int open_imported_dir(int root_fd, const char* path) {
+#if defined(SYS_openat2) && __has_include(<linux/openat2.h>)
+    struct open_how how = {
+        .flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS,
+    };
+    long fd = syscall(SYS_openat2, root_fd, path, &how, sizeof(how));
+    if (fd >= 0 || errno != ENOSYS)
+        return fd;
+#endif
+    // Without openat2 only the last component is checked, which is what a concurrent rename could replace.
+    return openat(root_fd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+}
+
+static int compare_names(const void* a, const void* b) {
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+/**
+ * Reads the names of the subdirectories of an open host directory that can be imported: those with
+ * valid folder names, whose paths in the tree would not be too long. Symbolic links are not followed.
+ * @param fd : open directory
+ * @param path_length : length of the path of the directory in the tree
+ * @param names : set to a malloc'd array of malloc'd names, sorted
+ * @param count : set to the number of names
+ * @return : success, or the errno of a failed system call
+ */
+static int read_subdirectories(int fd, size_t path_length, char*** names, size_t* count) {
+    char* buffer = safe_malloc(DIRENT_BUFFER_SIZE);
+    size_t capacity = 0;
+    *names = NULL;
+    *count = 0;
+    int result = SUCCESS;
+    while (true) {
+        long size = syscall(SYS_getdents64, fd, buffer, DIRENT_BUFFER_SIZE);
+        if (size <= 0) {
+            if (size < 0)
+                result = errno;
+            break;
+        }
+        for (long offset = 0; offset < size;) {
+            struct linux_dirent64* entry = (struct linux_dirent64*)(buffer + offset);
+            offset += entry->d_reclen;
+            if (!is_valid_name(entry->d_name) || path_length + strlen(entry->d_name) + 1 > MAX_PATH_LENGTH)
+                continue;
+            bool is_dir = entry->d_type == DT_DIR;
+            if (entry->d_type == DT_UNKNOWN) { // Not every filesystem reports the type
+                struct stat st;
+                is_dir = fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+            }
+            if (!is_dir)
+                continue;
+            if (*count == capacity) {
+                capacity = capacity ? 2 * capacity : 16;
+                *names = safe_realloc(*names, capacity * sizeof(char*));
+            }
+            (*names)[*count] = strdup(entry->d_name);
+            CHECK_POINTER((*names)[*count]);
+            (*count)++;
+        }
+    }
+    free(buffer);
+    if (*count > 1)
+        qsort(*names, *count, sizeof(char*), compare_names);
+    return result;
+}
+
+static void import_task(WorkPool* pool, size_t worker, void* data) {
+    FsImport* import = wpool_arg(pool);
+    ImportTask* task = data;
+    char** names = NULL;
+    size_t count = 0;
+    if (atomic_load(&import->error) == SUCCESS) {
+        // The directory is closed as soon as its entries are read, so that an import holds at most
+        // one descriptor per worker, however wide and deep the hierarchy is.
+        int fd = open_imported_dir(import->root_fd, task->path);
+        int result = fd < 0 ? errno : read_subdirectories(fd, task->path_length, &names, &count);
+        if (fd >= 0)
+            close(fd);
+        if (result != SUCCESS) {
+            int expected = SUCCESS;
+            atomic_compare_exchange_strong(&import->error, &expected, result);
+        }
+    }
+
+    // The names are sorted, and the node is not shared yet, so they are appended without any checks.
+    bool is_top = strcmp(task->path, ".") == 0;
+    size_t path_length = is_top ? 0 : strlen(task->path);
+    for (size_t i = 0; i < count; i++) {
+        Tree* child = node_new();
+        child->parent = task->node;
+        append_subdir(task->node, names[i], child);
+
+        size_t name_length = strlen(names[i]);
+        char* child_path;
+        if (is_top) {
+            child_path = names[i];
+        }
+        else {
+            child_path = safe_malloc(path_length + name_length + 2);
+            memcpy(child_path, task->path, path_length);
+            child_path[path_length] = '/';
+            memcpy(child_path + path_length + 1, names[i], name_length + 1);
+            free(names[i]);
+        }
+        ImportTask* subtask = safe_malloc(sizeof(ImportTask));
+        *subtask = (ImportTask) {
+            .path = child_path, .node = child, .path_length = task->path_length + name_length + 1,
+        };
+        wpool_submit(pool, worker, subtask);
+    }
+    free(names);
+    free(task->path);
+    free(task);
+}
+
+int tree_import_fs(Tree* tree, const char* mount_path, const char* target_path) {
+    if (!is_valid_path(target_path))
+        return EINVAL; // Invalid path
+    if (IS_ROOT(target_path))
+        return EEXIST; // The root always exists
+
+    FsImport import;
+    import.root_fd = open(mount_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (import.root_fd < 0)
+        return errno;
+    atomic_init(&import.error, SUCCESS);
+
+    // The subtree is built off-line, in parallel, and attached as a whole.
+    Tree* subtree = node_new();
+    ImportTask* root_task = safe_malloc(sizeof(ImportTask));
+    *root_task = (ImportTask) { .path = strdup("."), .node = subtree, .path_length = strlen(target_path) };
+    CHECK_POINTER(root_task->path);
+    wpool_run(wpool_default_size(), import_task, &import, root_task);
+    close(import.root_fd);
+
+    int result = atomic_load(&import.error);
+    if (result == SUCCESS) {
+        compute_subtree_stats(subtree);
+        result = graft_subtree(tree, target_path, subtree);
+    }
+    if (result != SUCCESS && !subtree->parent)
+        node_free(subtree); // Not attached
+    return result;
+}
+
+/** A subtree under construction, not yet part of any tree **/
+struct TreeBuilder {
+    Tree* root; /** The directory to be grafted. Its subtree is only ever accessed by the builder's owner **/
+};
+
+TreeBuilder* tree_builder_new(size_t expected_subdirectories) {
+    TreeBuilder* builder = safe_malloc(sizeof(TreeBuilder));
+    builder->root = node_new_with_capacity(expected_subdirectories);
+    return builder;
+}
+
+TreeBuilderDir* tree_builder_root(TreeBuilder* builder) {
+    return (TreeBuilderDir*)builder->root;
+}
+
+TreeBuilderDir* tree_builder_add(TreeBuilder* builder, TreeBuilderDir* parent, const char* name,
+                                 size_t expected_subdirectories) {
+    (void)builder;
+    if (!is_valid_name(name)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    // Nothing is shared yet: no locks, reference counts or statistics are needed until the graft.
+    Tree* dir = (Tree*)parent;
+    Tree* child = node_new_with_capacity(expected_subdirectories);
+    if (!insert_subdir(dir, name, child)) {
+        node_free(child);
+        errno = EEXIST;
+        return NULL;
+    }
+    child->parent = dir;
+    return (TreeBuilderDir*)child;
+}
+
+void tree_builder_free(TreeBuilder* builder) {
+    node_free(builder->root);
+    free(builder);
+}
+
+/**
+ * Finds the length of the longest path in the subtree, relative to its root.
+ * @param node : root of the subtree
+ * @return : length of the path, 0 for a single directory
+ */
+static size_t subtree_path_length(Tree* node) {
+    size_t longest = 0;
+    for (size_t i = 0; i < subdir_count(node); i++) {
+        size_t length = strlen(sidx_keys(node->ordered_subdirectories)[i]) + 1
+            + subtree_path_length(sidx_value_at(node->ordered_subdirectories, i));
+        if (length > longest)
+            longest = length;
+    }
+    return longest;
+}
+
+int tree_graft(Tree* tree, const char* path, TreeBuilder* builder) {
+    if (!is_valid_path(path))
+        return EINVAL; // Invalid path
+    if (IS_ROOT(path))
+        return EEXIST; // The root always exists
+    if (strlen(path) + subtree_path_length(builder->root) > MAX_PATH_LENGTH)
+        return EINVAL; // The paths of some grafted directories would be too long
+
+    Tree* subtree = builder->root;
+    compute_subtree_stats(subtree);
+    int result = graft_subtree(tree, path, subtree);
+    if (subtree->parent)
+        free(builder); // The subtree belongs to the tree now
+    return result;
+}
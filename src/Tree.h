@@ -1,5 +1,11 @@
 #pragma once
 
+#include "Histogram.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
 /* Let "Tree" mean the same as "struct Tree". */
 typedef struct Tree Tree;
 
@@ -22,6 +28,561 @@ void tree_free(Tree* tree);
  */
 char *tree_list(Tree *tree, const char *path);
 
+/**
+ * Lists the directories contained by the tree at the path whose names lie in the range [`from`, `to`).
+ * Names are compared lexicographically and listed in that order, so consecutive ranges can be used to page
+ * through a large directory. A NULL bound leaves that side of the range open.
+ * @param tree : file tree
+ * @param path : file path
+ * @param from : first name that may be listed (inclusive), or NULL
+ * @param to : name at which the listing stops (exclusive), or NULL
+ * @return : comma-separated list of the matching names, NULL if the path is invalid or doesn't exist
+ */
+char* tree_list_range(Tree* tree, const char* path, const char* from, const char* to);
+
+/**
+ * Lists the directories contained by the tree at the path whose names match a glob pattern.
+ * Patterns consist of letters and the wildcards '*', '?' and bracket expressions, e.g. "log*" or "f?o[a-c]".
+ * @param tree : file tree
+ * @param path : file path
+ * @param pattern : glob pattern
+ * @return : sorted, comma-separated list of the matching names,
+ *           NULL if the path or the pattern is invalid or the path doesn't exist
+ */
+char* tree_list_match(Tree* tree, const char* path, const char* pattern);
+
+/**
+ * Callback of `tree_walk`, called once for every visited directory.
+ * @param path : path of the directory
+ * @param depth : depth of the directory, relative to the directory the walk started from
+ * @param arg : argument passed to `tree_walk`
+ * @return : 0 to continue the walk, anything else to stop it
+ */
+typedef int (*tree_walk_fn)(const char* path, size_t depth, void* arg);
+
+/** `tree_walk` flag: visit the subtrees concurrently, on a work-stealing pool of threads **/
+#define TREE_WALK_PARALLEL 1
+
+/**
+ * Visits the directory at the path and all of its descendants.
+ * The whole subtree is seen in a single consistent state.
+ * Sequential walks visit directories in pre-order, with subdirectories in lexicographic order. Every
+ * visited directory stays locked for reading until the walk is over (concurrent reads proceed,
+ * modifications in the subtree wait).
+ * Parallel walks (`TREE_WALK_PARALLEL`) visit them in no particular order and call `callback`
+ * concurrently from several threads; a parent is still always visited before its subdirectories.
+ * They walk an image of the subtree (see `tree_snapshot`), so the subtree is only locked while the image
+ * is taken, and modifications proceed during the walk itself.
+ * @param tree : file tree
+ * @param path : path of the directory to start from
+ * @param callback : function called for every visited directory
+ * @param arg : argument passed to `callback`
+ * @param flags : bitwise OR of `TREE_WALK_*` flags
+ * @return : error code / success, or the non-zero value returned by `callback` that stopped the walk
+ */
+int tree_walk(Tree* tree, const char* path, tree_walk_fn callback, void* arg, int flags);
+
+/**
+ * Checks whether a directory exists at the path.
+ * Unlike `tree_list`, doesn't build any string: the check allocates no memory.
+ * @param tree : file tree
+ * @param path : file path
+ * @return : true if the path is valid and the directory exists, false otherwise
+ */
+bool tree_exists(Tree* tree, const char* path);
+
+/**
+ * Counts the immediate subdirectories of the directory at the path, without allocating any memory.
+ * @param tree : file tree
+ * @param path : file path
+ * @return : number of subdirectories, -1 if the path is invalid or doesn't exist
+ */
+ssize_t tree_child_count(Tree* tree, const char* path);
+
+/** Aggregate statistics of a directory's subtree **/
+typedef struct TreeStat {
+    size_t subdirectories; /** Number of immediate subdirectories **/
+    size_t descendants;    /** Number of all directories in the subtree, excluding the directory itself **/
+    size_t height;         /** Length of the longest path from the directory down to a descendant **/
+    size_t depth;          /** Number of components in the path of the directory. 0 for the root **/
+    size_t bytes;          /** Memory held by the subtree, including the directory itself (see `tree_memory_estimate`) **/
+} TreeStat;
+
+/**
+ * Gets the statistics of the directory at the path in O(1): they are maintained incrementally
+ * by every operation on the way back from the directory it modifies.
+ * The statistics may not yet reflect operations still in progress in the subtree.
+ * @param tree : file tree
+ * @param path : file path
+ * @param stat : where to store the statistics
+ * @return : error code / success
+ */
+int tree_stat(Tree* tree, const char* path, TreeStat* stat);
+
+/** A read-only, point-in-time view of a tree **/
+typedef struct TreeSnapshot TreeSnapshot;
+
+/**
+ * Takes a snapshot of the whole tree.
+ * Snapshots share structure with the tree and with each other: only the directories modified since
+ * the previous snapshot (and their ancestors) are copied, so taking one is cheap when few changes were made,
+ * and free when there were none. A directory gets its image from the first snapshot that needs it, so the
+ * first snapshot of a tree, or the first one after a subtree was loaded, imported or grafted, builds the
+ * images of all of it and read-locks it meanwhile; until then, directories cost no memory for images.
+ * Writers are only held up while the snapshot is being taken, never while it is being read.
+ * @param tree : file tree
+ * @return : the snapshot, to be freed with `snapshot_free`
+ */
+TreeSnapshot* tree_snapshot(Tree* tree);
+
+/**
+ * Gets the version of the tree shown by the snapshot (see `tree_version`).
+ * @param snapshot : tree snapshot
+ * @return : version of the tree
+ */
+uint64_t snapshot_version(TreeSnapshot* snapshot);
+
+/**
+ * Snapshot counterpart of `tree_list`. Takes no locks at all.
+ * @param snapshot : tree snapshot
+ * @param path : file path
+ * @return : list of all of the path's contents as of the snapshot, NULL if the path is invalid or didn't exist
+ */
+char* snapshot_list(TreeSnapshot* snapshot, const char* path);
+
+/**
+ * Snapshot counterpart of a sequential `tree_walk`. Takes no locks at all.
+ * @param snapshot : tree snapshot
+ * @param path : path of the directory to start from
+ * @param callback : function called for every visited directory
+ * @param arg : argument passed to `callback`
+ * @return : error code / success, or the non-zero value returned by `callback` that stopped the walk
+ */
+int snapshot_walk(TreeSnapshot* snapshot, const char* path, tree_walk_fn callback, void* arg);
+
+/** Formats of `tree_export` **/
+#define TREE_EXPORT_TEXT 0   /** Paths of the directories, one per line **/
+#define TREE_EXPORT_BINARY 1 /** Depth and name of every directory, in pre-order **/
+
+/**
+ * Writes the subtree at the path out to the file, listing every directory in pre-order (i.e. in the order
+ * of `tree_walk`). The export is served from an image of the subtree alone, so only the subtree is locked,
+ * and only while the image is taken. The subtree is serialized in parallel, in chunks which are written
+ * out in order with vectored I/O as soon as they are ready, so just a bounded window of them is buffered.
+ * @param tree : file tree
+ * @param path : path to the exported directory
+ * @param fd : file descriptor open for writing
+ * @param format : TREE_EXPORT_TEXT or TREE_EXPORT_BINARY
+ * @return : error code / success, or the errno of a failed write
+ */
+int tree_export(Tree* tree, const char* path, int fd, int format);
+
+/**
+ * Snapshot counterpart of `tree_export`.
+ * @param snapshot : snapshot of the tree
+ * @param path : path to the exported directory
+ * @param fd : file descriptor open for writing
+ * @param format : TREE_EXPORT_TEXT or TREE_EXPORT_BINARY
+ * @return : error code / success, or the errno of a failed write
+ */
+int snapshot_export(TreeSnapshot* snapshot, const char* path, int fd, int format);
+
+/**
+ * Snapshot destructor. Snapshots are independent of the tree and may outlive it.
+ */
+void snapshot_free(TreeSnapshot* snapshot);
+
+/**
+ * Gets the current version of the tree.
+ * Every modification made by `tree_create`, `tree_remove` and `tree_move` stamps the tree
+ * with a new, higher version at the moment it takes effect.
+ * @param tree : file tree
+ * @return : version of the tree
+ */
+uint64_t tree_version(Tree* tree);
+
+/**
+ * A read transaction: a sequence of reads all served from a single, fixed version of the tree,
+ * without taking any locks. Versions no longer visible to any transaction or snapshot are freed
+ * as soon as the last one referring to them ends.
+ */
+typedef struct TreeReadTxn TreeReadTxn;
+
+/**
+ * Starts a read transaction at the current version of the tree.
+ * If the tree hasn't been modified since the last transaction or snapshot began, shares its version.
+ * Otherwise it takes a snapshot (see `tree_snapshot`), which rebuilds and locks only the directories
+ * modified since then and their ancestors, and those which have never been in a snapshot yet.
+ * @param tree : file tree
+ * @return : the transaction, to be ended with `tree_read_txn_end`
+ */
+TreeReadTxn* tree_read_txn_begin(Tree* tree);
+
+/**
+ * Gets the version of the tree the transaction reads from.
+ * @param txn : read transaction
+ * @return : version of the tree
+ */
+uint64_t read_txn_version(TreeReadTxn* txn);
+
+/**
+ * Transactional counterpart of `tree_list`.
+ * @param txn : read transaction
+ * @param path : file path
+ * @return : list of all of the path's contents at the transaction's version,
+ *           NULL if the path is invalid or didn't exist
+ */
+char* read_txn_list(TreeReadTxn* txn, const char* path);
+
+/**
+ * Transactional counterpart of `tree_exists`.
+ * @param txn : read transaction
+ * @param path : file path
+ * @return : true if the path is valid and the directory existed at the transaction's version
+ */
+bool read_txn_exists(TreeReadTxn* txn, const char* path);
+
+/**
+ * Transactional counterpart of `tree_child_count`.
+ * @param txn : read transaction
+ * @param path : file path
+ * @return : number of subdirectories at the transaction's version, -1 if the path is invalid or didn't exist
+ */
+ssize_t read_txn_child_count(TreeReadTxn* txn, const char* path);
+
+/**
+ * Ends a read transaction, releasing the version it was reading from.
+ * @param txn : read transaction
+ */
+void tree_read_txn_end(TreeReadTxn* txn);
+
+/**
+ * Saves the current version of the tree to a file in a compact binary format.
+ * The image is taken from a snapshot, so the tree is only locked while the snapshot is being taken.
+ * @param tree : file tree
+ * @param fd : file descriptor open for writing
+ * @return : success, or the errno of a failed write
+ */
+int tree_save(Tree* tree, int fd);
+
+/**
+ * Loads a tree saved with `tree_save`. The file is mapped into memory and all directories are
+ * built in bulk, in parallel. The loaded tree continues from the version it was saved at.
+ * @param path : path to the file
+ * @return : pointer to the tree, or NULL with errno set (EINVAL if the file is not a valid image)
+ */
+Tree* tree_load_mmap(const char* path);
+
+/**
+ * Starts logging the modifications of the tree to a write-ahead log at the given path.
+ * Modifications already in the log but not in the tree (i.e. made after the tree was saved) are
+ * replayed first, and a record torn by a crash is cut off. From then on, `tree_create`, `tree_remove`,
+ * `tree_move` and `tree_txn_commit` return only once their modification is on stable storage;
+ * concurrent modifications share a single sync. If the log can't be written, they return its errno,
+ * with the modification already applied in memory.
+ * Must not be called concurrently with any other operation on the tree.
+ * @param tree : file tree
+ * @param path : path to the log file, created if it doesn't exist
+ * @return : success, EBUSY if the tree is already logged, EINVAL if the file is not a log or doesn't
+ *           fit the tree, or the errno of a failed system call
+ */
+int tree_wal_open(Tree* tree, const char* path);
+
+/**
+ * Replays a write-ahead log onto the tree, without attaching it (see `tree_wal_open`).
+ * Only modifications newer than the version of the tree are applied, so the tree may be empty or
+ * loaded from an image saved while the log was being written. The tree ends up at the version of
+ * the last replayed modification. Must not be called on a logged tree, or concurrently with any other
+ * operation on the tree.
+ * @param tree : file tree
+ * @param path : path to the log file
+ * @return : success, EINVAL if the file is not a log or a modification doesn't fit the tree,
+ *           or the errno of a failed system call. The tree keeps the modifications replayed before an error
+ */
+int tree_wal_replay(Tree* tree, const char* path);
+
+/**
+ * Makes all logged modifications durable and stops logging. Must not be called concurrently
+ * with any other operation on the tree. `tree_free` closes the log as well.
+ * @param tree : file tree
+ * @return : success, or the errno of a failed write of the log
+ */
+int tree_wal_close(Tree* tree);
+
+/**
+ * Starts recording the operations issued on the tree to a trace file (see TreeTrace.h), to be replayed
+ * offline by `tree_replay`. `tree_list`, `tree_create`, `tree_remove` and `tree_move` are traced, with
+ * their results and timings, as are the operations of committed transactions. To replay against the
+ * same starting state, save the tree with `tree_save` right before. Must not be called concurrently with
+ * any other operation on the tree.
+ * @param tree : file tree
+ * @param path : path to the trace file, replaced if it exists
+ * @return : success, EBUSY if the tree is already traced, or the errno of a failed system call
+ */
+int tree_trace_start(Tree* tree, const char* path);
+
+/**
+ * Writes out the rest of the trace and stops tracing. Must not be called concurrently with any other
+ * operation on the tree. `tree_free` stops tracing as well.
+ * @param tree : file tree
+ * @return : success, or the errno of the first failed write of the trace
+ */
+int tree_trace_stop(Tree* tree);
+
+/** Operations whose latencies are collected by `tree_metrics_start` **/
+typedef enum TreeOp {
+    TREE_OP_LIST,
+    TREE_OP_CREATE,
+    TREE_OP_REMOVE,
+    TREE_OP_MOVE,
+
+    TREE_OPS
+} TreeOp;
+
+/** Latencies of the operations issued since `tree_metrics_start`, in nanoseconds **/
+typedef struct TreeMetricsSnapshot {
+    Histogram latency[TREE_OPS]; /** Indexed by `TreeOp` **/
+} TreeMetricsSnapshot;
+
+/**
+ * Starts collecting the latencies of `tree_list`, `tree_create`, `tree_remove` and `tree_move` into
+ * histograms (see Histogram.h). Every thread records into histograms of its own; `tree_metrics_snapshot`
+ * merges them. Must not be called concurrently with any other operation on the tree.
+ * @param tree : file tree
+ * @return : success, EBUSY if latencies are already being collected,
+ *           or EAGAIN if the process ran out of thread-specific keys
+ */
+int tree_metrics_start(Tree* tree);
+
+/**
+ * Stops collecting latencies and drops the collected ones. Must not be called concurrently with any
+ * other operation on the tree. `tree_free` stops collecting as well.
+ * @param tree : file tree
+ */
+void tree_metrics_stop(Tree* tree);
+
+/**
+ * Merges the latencies collected by all threads so far. May be called concurrently with operations
+ * on the tree, whose latencies are then included or not. The snapshot is large (see HIST_BUCKETS),
+ * so it is best not kept on the stack.
+ * @param tree : file tree
+ * @param snapshot : filled in with the latencies of every operation
+ * @return : success, or EINVAL if latencies are not being collected
+ */
+int tree_metrics_snapshot(Tree* tree, TreeMetricsSnapshot* snapshot);
+
+/** Lock contention of a directory, collected when the library is built with TREE_CONTENTION_PROFILING **/
+typedef struct TreeContention {
+    char* path;               /** Current path of the directory **/
+    uint64_t read_wait_ns;    /** Time readers spent waiting for the lock of the directory **/
+    uint64_t write_wait_ns;   /** Time writers spent waiting for the lock of the directory **/
+    uint64_t subtree_wait_ns; /** Time moves and transactions spent waiting for operations in the subtree to finish **/
+    uint64_t read_hold_ns;    /** Time the directory was locked by at least one reader **/
+    uint64_t write_hold_ns;   /** Time the directory was locked by a writer **/
+    uint64_t acquisitions;    /** Number of times the lock was taken **/
+    uint64_t waits;           /** Number of times the lock, or the subtree, had to be waited for **/
+    size_t max_waiters;       /** Largest number of readers and writers waiting for the lock at once **/
+} TreeContention;
+
+/** The directories with the most lock contention **/
+typedef struct TreeContentionReport {
+    size_t count;                 /** Number of entries **/
+    TreeContention entries[];     /** Ordered by the total time waited, most first **/
+} TreeContentionReport;
+
+/**
+ * Finds the directories whose locks were waited for the longest in total (reads, writes and subtree waits),
+ * counting since each directory was created. Directories which were never waited for are left out.
+ * Locks every directory for reading in turn, so it may be called concurrently with other operations.
+ * Contention is only collected when the library is built with TREE_CONTENTION_PROFILING;
+ * otherwise the locks carry no instrumentation at all.
+ * @param tree : file tree
+ * @param top_k : largest number of directories to report
+ * @return : the report, to be freed with `tree_contention_report_free`,
+ *           or NULL with errno set to ENOTSUP if contention is not collected
+ */
+TreeContentionReport* tree_contention_report(Tree* tree, size_t top_k);
+
+/**
+ * Frees a report returned by `tree_contention_report`.
+ */
+void tree_contention_report_free(TreeContentionReport* report);
+
+/**
+ * Starts logging the operations (`tree_list`, `tree_create`, `tree_remove` and `tree_move`) which take
+ * at least the given time, to a file of JSON lines (see SlowLog.h). Every line holds the paths of
+ * an operation, its result, its latency, the time it spent waiting for locks, each lock it waited for
+ * (the path of the directory, and the number of locks the operation had taken before), and the time
+ * it spent waiting for operations in a subtree to finish.
+ * Operations push their lines into a lock-free ring buffer, drained into the file by a background
+ * thread; when the buffer is full, lines are dropped rather than delaying operations, and the number
+ * of dropped lines is logged. Must not be called concurrently with any other operation on the tree.
+ * @param tree : file tree
+ * @param path : path to the log file, appended to if it exists
+ * @param threshold_ns : latency from which operations are logged, in nanoseconds
+ * @return : success, EBUSY if slow operations are already logged, or the errno of a failed system call
+ */
+int tree_slow_log_start(Tree* tree, const char* path, uint64_t threshold_ns);
+
+/**
+ * Writes out the rest of the slow operation log and stops logging. Must not be called concurrently
+ * with any other operation on the tree. `tree_free` stops logging as well.
+ * @param tree : file tree
+ * @return : success, or the errno of the first failed write of the log
+ */
+int tree_slow_log_stop(Tree* tree);
+
+/** Memory held by all the trees of the process, by kind. Bytes are the sizes requested from the allocator **/
+typedef struct TreeMemoryStats {
+    int64_t nodes;        /** Number of directories **/
+    int64_t node_bytes;   /** Bytes in `Tree` structs and their height histograms **/
+    int64_t maps;         /** Number of maps of subdirectories **/
+    int64_t map_bytes;    /** Bytes in `HashMap` structs, including the buckets of maps which never grew **/
+    int64_t bucket_bytes; /** Bytes in the bucket arrays of maps which grew **/
+    int64_t pairs;        /** Number of key-value pairs in the maps **/
+    int64_t pair_bytes;   /** Bytes in the key-value pairs **/
+    int64_t key_bytes;    /** Bytes in the names of subdirectories, copied by the maps (the ordered indexes share them) **/
+    int64_t index_bytes;  /** Bytes in the ordered indexes of subdirectories **/
+    int64_t allocations;  /** Number of live allocations of all the kinds above **/
+    int64_t total_bytes;  /** Sum of the bytes of all the kinds above **/
+} TreeMemoryStats;
+
+/**
+ * Gets the memory held by the nodes, maps and names of all trees in the process.
+ * The counters are kept per thread and summed here, so operations in progress may be only partly counted.
+ * The allocator adds its own overhead to every allocation: with glibc, roughly 8 to 16 bytes each,
+ * which `allocations` allows to estimate. Snapshots, logs and other auxiliary structures are not counted.
+ * @param stats : where to store the statistics
+ */
+void tree_memory_stats(TreeMemoryStats* stats);
+
+/**
+ * Gets the memory held by the subtree of the directory at the path, in O(1): every directory keeps the
+ * total for its subtree up to date along with its other statistics (see `tree_stat`). A directory holds
+ * its node and height histogram, and its maps of subdirectories with their names; the sum over the whole
+ * tree is its share of `total_bytes` in `tree_memory_stats`. As there, these are the sizes requested
+ * from the allocator, without its overhead, and the total may not yet reflect operations in progress.
+ * @param tree : file tree
+ * @param path : file path
+ * @param bytes : where to store the estimate
+ * @return : error code / success
+ */
+int tree_memory_estimate(Tree* tree, const char* path, size_t* bytes);
+
+/**
+ * A background thread saving the tree to a directory periodically and incrementally.
+ * The first checkpoint writes a full image of the tree (see `tree_save`); each of the following writes
+ * only the directories modified since the previous one, as a delta file. After the given number of
+ * deltas, the next checkpoint writes a full image of the tree again instead, which supersedes them.
+ *
+ * Every checkpoint takes a snapshot (see `tree_snapshot`), and that is when it holds operations up.
+ * Until the snapshot is complete, the directories modified since the previous checkpoint and their
+ * ancestors are locked for reading, which stalls modifications of those directories, and every idle
+ * untouched subtree next to them is locked for writing at its top, which stalls any operation entering it.
+ * (A subtree with operations in progress is locked for reading down to its idle parts instead.) How long
+ * this lasts grows with the number of modified directories and their subdirectories; the first checkpoint,
+ * and one after modifications all over the tree, read-lock every directory.
+ */
+typedef struct TreeCheckpointer TreeCheckpointer;
+
+/**
+ * Saves the tree to the directory and starts checkpointing it in the background.
+ * Deltas left in the directory by an earlier checkpointer are removed before the initial image is written.
+ * @param tree : file tree, which must outlive the checkpointer
+ * @param directory : existing directory to save the tree to
+ * @param interval_ms : time between checkpoints, in milliseconds
+ * @param deltas_per_image : number of deltas written before a checkpoint writes a full image again
+ * @return : the checkpointer, or NULL with errno set if the stale deltas can't be removed or the initial
+ *           image can't be written
+ */
+TreeCheckpointer* tree_checkpointer_start(Tree* tree, const char* directory, unsigned interval_ms,
+                                          size_t deltas_per_image);
+
+/**
+ * Takes a final checkpoint and stops the checkpointer.
+ * @param checkpointer : checkpointer
+ * @return : success, or the errno of the first checkpoint that failed to be written
+ */
+int tree_checkpointer_stop(TreeCheckpointer* checkpointer);
+
+/**
+ * Loads the tree saved by the last checkpoint in the directory.
+ * To recover modifications made after it, replay a write-ahead log onto the tree (see `tree_wal_replay`).
+ * @param directory : directory passed to `tree_checkpointer_start`
+ * @return : pointer to the tree, or NULL with errno set
+ */
+Tree* tree_checkpoint_recover(const char* directory);
+
+/**
+ * Imports a directory hierarchy of the host filesystem as a new directory of the tree.
+ * The hierarchy is read in parallel and built aside from the tree, which is then modified once,
+ * under a single lock. Only subdirectories with valid folder names are imported, as long as their
+ * paths in the tree are not too long; symbolic links are not followed. A host directory is kept open
+ * only while its entries are read. The new directories are logged in bounded records, so after a crash
+ * replaying the write-ahead log may restore only part of an import that was not yet durable.
+ * @param tree : file tree
+ * @param mount_path : host directory to import
+ * @param target_path : path of the new directory in the tree
+ * @return : error code / success, or the errno of the first host directory that failed to be read
+ *           (in which case nothing is imported)
+ */
+int tree_import_fs(Tree* tree, const char* mount_path, const char* target_path);
+
+/**
+ * A subtree built aside from any tree, for loaders which know the whole structure upfront.
+ * Its directories are created without locking, and the finished subtree is attached to a tree
+ * with `tree_graft` as a single modification. A builder is used by a single thread.
+ */
+typedef struct TreeBuilder TreeBuilder;
+
+/** A directory of a subtree under construction **/
+typedef struct TreeBuilderDir TreeBuilderDir;
+
+/**
+ * Starts building a subtree.
+ * @param expected_subdirectories : number of subdirectories the top directory is sized for (only a hint)
+ * @return : the builder
+ */
+TreeBuilder* tree_builder_new(size_t expected_subdirectories);
+
+/**
+ * Gets the top directory of the subtree, the one which `tree_graft` creates.
+ * @param builder : builder
+ * @return : the directory
+ */
+TreeBuilderDir* tree_builder_root(TreeBuilder* builder);
+
+/**
+ * Adds a new, empty subdirectory to a directory of the subtree.
+ * Adding subdirectories in lexicographic order is fastest.
+ * @param builder : builder
+ * @param parent : directory of the builder's subtree
+ * @param name : name of the subdirectory
+ * @param expected_subdirectories : number of subdirectories the new directory is sized for (only a hint)
+ * @return : the new directory, or NULL with errno set to EINVAL if the name is not a valid folder name,
+ *           or EEXIST if the parent already has a subdirectory with this name
+ */
+TreeBuilderDir* tree_builder_add(TreeBuilder* builder, TreeBuilderDir* parent, const char* name,
+                                 size_t expected_subdirectories);
+
+/**
+ * Frees a builder which has not been grafted, along with its subtree.
+ * @param builder : builder
+ */
+void tree_builder_free(TreeBuilder* builder);
+
+/**
+ * Attaches the subtree of the builder to the tree as a new directory, all at once.
+ * As with `tree_import_fs`, a big subtree is logged in several records.
+ * @param tree : file tree
+ * @param path : path of the new directory
+ * @param builder : builder, freed once its subtree is attached (i.e. on success, or if only writing
+ *                  the write-ahead log failed). Otherwise, it is left intact
+ * @return : error code / success. EINVAL is returned for an invalid path,
+ *           or if the paths of some grafted directories would be too long
+ */
+int tree_graft(Tree* tree, const char* path, TreeBuilder* builder);
+
 /**
  * Creates a new directory in the specified path.
  * @param tree : file tree
@@ -46,3 +607,63 @@ int tree_remove(Tree* tree, const char* path);
   * @return : error code / success
   */
 int tree_move(Tree *tree, const char *s_path, const char *t_path);
+
+/**
+ * A write transaction: a list of `tree_create`, `tree_remove` and `tree_move` operations
+ * applied all-or-nothing, at a single point in time.
+ */
+typedef struct TreeTxn TreeTxn;
+
+/**
+ * Starts building a write transaction on the tree.
+ * @param tree : file tree
+ * @return : the transaction, to be finished with `tree_txn_commit` or `tree_txn_abort`
+ */
+TreeTxn* tree_txn_begin(Tree* tree);
+
+/**
+ * Adds a `tree_create` operation to the transaction.
+ * @param txn : write transaction
+ * @param path : file path
+ * @return : error code (of the checks that don't depend on the tree's state) / success
+ */
+int tree_txn_create(TreeTxn* txn, const char* path);
+
+/**
+ * Adds a `tree_remove` operation to the transaction.
+ * @param txn : write transaction
+ * @param path : file path
+ * @return : error code (of the checks that don't depend on the tree's state) / success
+ */
+int tree_txn_remove(TreeTxn* txn, const char* path);
+
+/**
+ * Adds a `tree_move` operation to the transaction.
+ * @param txn : write transaction
+ * @param s_path : source directory
+ * @param t_path : target directory
+ * @return : error code (of the checks that don't depend on the tree's state) / success
+ */
+int tree_txn_move(TreeTxn* txn, const char* s_path, const char* t_path);
+
+/**
+ * Applies the operations of the transaction in order, as if no other operation ran in between.
+ * If any of them fails, the ones already applied are reverted and the tree is left unchanged.
+ * Only the directories it modifies are locked, in pre-order: the parents of created and removed
+ * directories, and the removed directories. A move takes over the whole subtree of the deepest common
+ * ancestor of its source's and target's parents, like `tree_move` does, waiting for the operations in
+ * progress in it to finish. The operations of a committed transaction are traced, timed and logged as
+ * slow as if they had been issued one by one, each taking as long as the whole commit. Those of a failed
+ * transaction are only reported to the probes, since none of them took effect.
+ * Frees the transaction.
+ * @param txn : write transaction
+ * @param failed_op : if not NULL and the transaction fails, set to the index of the failed operation
+ * @return : success, or the error code of the failed operation
+ */
+int tree_txn_commit(TreeTxn* txn, size_t* failed_op);
+
+/**
+ * Discards the transaction without applying any of its operations.
+ * @param txn : write transaction
+ */
+void tree_txn_abort(TreeTxn* txn);
@@ -0,0 +1,420 @@
+#include "Tree.h"
+#include "TreeSnapshot.h"
+#include "WorkPool.h"
+#include "path_utils.h"
+#include "safe_allocations.h"
+#include "sync_utils.h"
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+/*
+ * Export of a subtree, served from a snapshot so that the tree is only locked while it is taken.
+ *
+ * The pre-order listing of the subtree is cut into chunks: single directories near the top, and runs
+ * of sibling subtrees below them. Splitting stops as soon as there are enough chunks to keep every
+ * worker busy and the window below full (CHUNKS_PER_WORKER per worker, at least MIN_CHUNKS), so a
+ * directory with millions of subdirectories becomes a few runs of them, not a chunk each. Each chunk
+ * is serialized into its own buffer by a worker of a pool. The chunks are written out in order as soon
+ * as they are ready, with vectored I/O, and freed right away. Workers only run a bounded window of
+ * chunks ahead of the first one not yet written, which bounds the memory taken by the buffers (to the
+ * size of the biggest chunks, as a subtree too deep to split stays a single chunk).
+ *
+ * The binary format is an `ExportHeader` followed by one entry per directory, in pre-order:
+ * the depth of the directory relative to the exported one (uint16_t), the length of its name (uint8_t)
+ * and the name itself. The exported directory has an empty name. Integers are in host byte order.
+ */
+
+/** Identifies binary exports **/
+#define EXPORT_MAGIC "DIRTEXP"
+
+/** Version of the binary format **/
+#define EXPORT_FORMAT_VERSION 1
+
+/** Number of chunks per worker to aim for, so that uneven subtrees still keep all workers busy **/
+#define CHUNKS_PER_WORKER 16
+
+/** Number of chunks to aim for however few workers there are, so that the window is a small part of the export **/
+#define MIN_CHUNKS 1024
+
+/** Number of chunks per worker which may be serialized ahead of the first one not yet written **/
+#define WINDOW_PER_WORKER 4
+
+/** Maximum number of rounds of splitting chunks, each of which goes at most a level further down **/
+#define MAX_SPLIT_ROUNDS 8
+
+#ifndef IOV_MAX
+/** Maximum number of buffers per writev, guaranteed by Linux **/
+#define IOV_MAX 1024
+#endif
+
+typedef struct ExportHeader {
+    char magic[8];           /** EXPORT_MAGIC, NUL-padded **/
+    uint32_t format_version; /** EXPORT_FORMAT_VERSION **/
+    uint32_t reserved;
+} ExportHeader;
+
+/**
+ * A piece of the listing: a directory, followed by the whole subtrees of a run of its subdirectories.
+ * Either part may be left out, but not both.
+ */
+typedef struct ExportChunk {
+    SnapNode* node;
+    char* path;        /** Path of the directory **/
+    size_t depth;      /** Depth relative to the exported directory **/
+    const char* name;  /** Name of the directory. Empty for the exported one **/
+    bool top;          /** Whether the chunk starts with the directory itself **/
+    size_t first;      /** First subdirectory whose subtree the chunk covers **/
+    size_t last;       /** Subdirectory right after the last one whose subtree the chunk covers **/
+    bool ready;        /** Whether the chunk is serialized. Protected by the mutex of the export **/
+    char* data;        /** Serialized chunk, freed once written out **/
+    size_t size, capacity;
+} ExportChunk;
+
+typedef struct Export {
+    ExportChunk* chunks;
+    size_t count;
+    int format;
+    int fd;
+    size_t window;         /** Number of chunks which may be serialized ahead of `next_write` **/
+    pthread_mutex_t mutex; /** Protects the fields below **/
+    pthread_cond_t cond;   /** Signalled when chunks are written out, which moves the window **/
+    size_t next_chunk;     /** First chunk no worker has taken yet **/
+    size_t next_write;     /** First chunk not written out yet **/
+    bool writing;          /** Whether a worker is writing chunks out **/
+    int error;             /** First error of a write **/
+} Export;
+
+static void chunk_put(ExportChunk* chunk, const void* data, size_t size) {
+    if (chunk->size + size > chunk->capacity) {
+        size_t capacity = chunk->capacity ? chunk->capacity : 4096;
+        while (chunk->size + size > capacity)
+            capacity *= 2;
+        chunk->data = safe_realloc(chunk->data, capacity);
+        chunk->capacity = capacity;
+    }
+    memcpy(chunk->data + chunk->size, data, size);
+    chunk->size += size;
+}
+
+/**
+ * Serializes a single directory.
+ * @param chunk : chunk to append to
+ * @param format : TREE_EXPORT_TEXT or TREE_EXPORT_BINARY
+ * @param path : path of the directory
+ * @param path_len : length of the path
+ * @param depth : depth relative to the exported directory
+ * @param name : name of the directory
+ */
+static void export_dir(ExportChunk* chunk, int format, const char* path, size_t path_len, size_t depth,
+                       const char* name) {
+    if (format == TREE_EXPORT_TEXT) {
+        chunk_put(chunk, path, path_len);
+        chunk_put(chunk, "\n", 1);
+    }
+    else {
+        uint16_t entry_depth = depth;
+        uint8_t name_len = strlen(name);
+        chunk_put(chunk, &entry_depth, sizeof(entry_depth));
+        chunk_put(chunk, &name_len, sizeof(name_len));
+        chunk_put(chunk, name, name_len);
+    }
+}
+
+/**
+ * Serializes the subdirectories [`first`, `last`) of the `node` with their subtrees, in pre-order.
+ * @param path : pointer to a malloc'd buffer holding the path of the node
+ * @param capacity : pointer to the size of the buffer
+ * @param len : length of the path
+ * @param depth : depth of the node relative to the exported directory
+ */
+static void export_subtrees(ExportChunk* chunk, int format, SnapNode* node, size_t first, size_t last,
+                            char** path, size_t* capacity, size_t len, size_t depth) {
+    for (size_t i = first; i < last; i++) {
+        size_t name_len = strlen(node->names[i]);
+        if (len + name_len + 2 > *capacity) {
+            *capacity = 2 * (len + name_len + 2);
+            *path = safe_realloc(*path, *capacity);
+        }
+        memcpy(*path + len, node->names[i], name_len);
+        (*path)[len + name_len] = '/';
+        (*path)[len + name_len + 1] = '\0';
+        export_dir(chunk, format, *path, len + name_len + 1, depth + 1, node->names[i]);
+        SnapNode* child = node->children[i];
+        export_subtrees(chunk, format, child, 0, child->n_children, path, capacity, len + name_len + 1, depth + 1);
+    }
+}
+
+/** Makes a chunk of a single subdirectory with its whole subtree **/
+static ExportChunk subtree_chunk(const ExportChunk* parent, size_t index) {
+    const char* name = parent->node->names[index];
+    size_t len = strlen(parent->path);
+    char* path = safe_malloc(len + strlen(name) + 2);
+    memcpy(path, parent->path, len);
+    strcpy(path + len, name);
+    strcat(path + len, "/");
+    SnapNode* node = parent->node->children[index];
+    return (ExportChunk) {
+        .node = node, .path = path, .depth = parent->depth + 1, .name = name,
+        .top = true, .first = 0, .last = node->n_children,
+    };
+}
+
+/**
+ * Cuts the chunk into its directory and at most `ways` runs of its subdirectories, balanced by their number.
+ * A run of a single subdirectory becomes the chunk of its subtree, so that it can be split further.
+ * @param chunk : chunk to split, whose path is taken over by the first piece
+ * @param ways : maximum number of runs
+ * @param pieces : array to append the pieces to
+ * @return : number of pieces appended
+ */
+static size_t split_chunk(ExportChunk chunk, size_t ways, ExportChunk* pieces) {
+    size_t n = 0, runs = chunk.last - chunk.first < ways ? chunk.last - chunk.first : ways;
+    bool path_used = false;
+    if (chunk.top) {
+        pieces[n++] = (ExportChunk) {
+            .node = chunk.node, .path = chunk.path, .depth = chunk.depth, .name = chunk.name, .top = true,
+        };
+        path_used = true;
+    }
+    for (size_t r = 0; r < runs; r++) {
+        size_t first = chunk.first + (chunk.last - chunk.first) * r / runs;
+        size_t last = chunk.first + (chunk.last - chunk.first) * (r + 1) / runs;
+        if (last - first == 1) {
+            pieces[n++] = subtree_chunk(&chunk, first);
+            continue;
+        }
+        char* path = chunk.path;
+        if (path_used) {
+            path = strdup(chunk.path);
+            CHECK_POINTER(path);
+        }
+        path_used = true;
+        pieces[n++] = (ExportChunk) {
+            .node = chunk.node, .path = path, .depth = chunk.depth, .name = chunk.name,
+            .first = first, .last = last,
+        };
+    }
+    if (!path_used)
+        free(chunk.path); // Every run became the chunk of a subtree
+    return n;
+}
+
+/** Checks whether splitting the chunk makes more of them **/
+static bool is_splittable(const ExportChunk* chunk) {
+    return chunk->last - chunk->first > (chunk->top ? 0 : 1);
+}
+
+/**
+ * Cuts the listing of a subtree into about `target` chunks, splitting them in rounds, until there are
+ * enough of them. A round splits each chunk into its directory and a few runs of its subdirectories,
+ * as many as make up for the missing chunks, and stops as soon as there are enough.
+ * @param start : image of the exported directory
+ * @param path : path of the exported directory
+ * @param target : number of chunks to aim for
+ * @param count : set to the number of chunks
+ * @return : malloc'd array of chunks, in pre-order
+ */
+static ExportChunk* make_chunks(SnapNode* start, const char* path, size_t target, size_t* count) {
+    ExportChunk* chunks = safe_calloc(1, sizeof(ExportChunk));
+    chunks[0] = (ExportChunk) {
+        .node = start, .path = strdup(path), .name = "", .top = true, .last = start->n_children,
+    };
+    CHECK_POINTER(chunks[0].path);
+    *count = 1;
+
+    for (size_t round = 0; round < MAX_SPLIT_ROUNDS && *count < target; round++) {
+        size_t ways = (target - *count + *count - 1) / *count + 1;
+        ExportChunk* split = safe_calloc(*count * (ways + 1), sizeof(ExportChunk));
+        size_t j = 0;
+        bool progress = false;
+        for (size_t i = 0; i < *count; i++) {
+            if (j + *count - i >= target || !is_splittable(&chunks[i])) {
+                split[j++] = chunks[i]; // Enough chunks already, or nothing to split
+                continue;
+            }
+            j += split_chunk(chunks[i], ways, split + j);
+            progress = true;
+        }
+        free(chunks);
+        chunks = split;
+        *count = j;
+        if (!progress)
+            break;
+    }
+    return chunks;
+}
+
+/**
+ * Writes the buffers out in order, in as few system calls as possible.
+ * @param iov : buffers, modified to skip what has been written
+ * @param n_iov : number of buffers
+ * @return : success, or the errno of the failed write
+ */
+static int write_buffers(int fd, struct iovec* iov, size_t n_iov) {
+    struct iovec* next = iov;
+    while (n_iov > 0) {
+        ssize_t written = writev(fd, next, n_iov < IOV_MAX ? (int)n_iov : IOV_MAX);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        // Skip what has been written, which may end in the middle of a buffer
+        while (n_iov > 0 && (size_t)written >= next->iov_len) {
+            written -= next->iov_len;
+            next++;
+            n_iov--;
+        }
+        if (n_iov > 0) {
+            next->iov_base = (char*)next->iov_base + written;
+            next->iov_len -= written;
+        }
+    }
+    return SUCCESS;
+}
+
+/**
+ * Writes out the serialized chunks [`begin`, `end`) and frees their buffers.
+ * @return : success, or the errno of the failed write
+ */
+static int write_chunks(Export* export, size_t begin, size_t end) {
+    struct iovec* iov = safe_malloc((end - begin) * sizeof(struct iovec));
+    size_t n_iov = 0;
+    for (size_t i = begin; i < end; i++) {
+        if (export->chunks[i].size > 0)
+            iov[n_iov++] = (struct iovec) { .iov_base = export->chunks[i].data, .iov_len = export->chunks[i].size };
+    }
+    int result = write_buffers(export->fd, iov, n_iov);
+    free(iov);
+    for (size_t i = begin; i < end; i++) {
+        free(export->chunks[i].data);
+        export->chunks[i].data = NULL;
+    }
+    return result;
+}
+
+/**
+ * Marks the chunk as serialized, and writes out every chunk which is ready at the front of the window,
+ * unless another worker is already doing it. Only one worker writes at a time, so the chunks reach
+ * the file in order.
+ * @param export : export
+ * @param index : index of the serialized chunk
+ */
+static void finish_chunk(Export* export, size_t index) {
+    PTHREAD_CHECK(pthread_mutex_lock(&export->mutex));
+    export->chunks[index].ready = true;
+    if (!export->writing) {
+        export->writing = true;
+        while (export->error == SUCCESS && export->next_write < export->count
+               && export->chunks[export->next_write].ready) {
+            size_t begin = export->next_write, end = begin;
+            while (end < export->count && export->chunks[end].ready)
+                end++;
+            PTHREAD_CHECK(pthread_mutex_unlock(&export->mutex));
+            int result = write_chunks(export, begin, end);
+            PTHREAD_CHECK(pthread_mutex_lock(&export->mutex));
+            export->next_write = end;
+            export->error = result;
+            PTHREAD_CHECK(pthread_cond_broadcast(&export->cond));
+        }
+        export->writing = false;
+    }
+    PTHREAD_CHECK(pthread_mutex_unlock(&export->mutex));
+}
+
+/** Serializes the chunk **/
+static void serialize_chunk(Export* export, ExportChunk* chunk) {
+    size_t len = strlen(chunk->path);
+    if (chunk->top)
+        export_dir(chunk, export->format, chunk->path, len, chunk->depth, chunk->name);
+    if (chunk->first < chunk->last) {
+        size_t capacity = len + 1;
+        export_subtrees(chunk, export->format, chunk->node, chunk->first, chunk->last, &chunk->path, &capacity,
+                        len, chunk->depth);
+    }
+}
+
+/**
+ * Takes chunks in order and serializes them, until there are none left or a write fails.
+ * Each index of the range is a worker of the export.
+ */
+static void export_chunks(void* arg, size_t begin, size_t end) {
+    Export* export = arg;
+    for (size_t worker = begin; worker < end; worker++) {
+        while (true) {
+            PTHREAD_CHECK(pthread_mutex_lock(&export->mutex));
+            // The chunk at the front of the window is always being serialized when the window is full,
+            // so a worker waits only for one which is making progress.
+            while (export->error == SUCCESS && export->next_chunk < export->count
+                   && export->next_chunk >= export->next_write + export->window)
+                PTHREAD_CHECK(pthread_cond_wait(&export->cond, &export->mutex));
+            bool done = export->error != SUCCESS || export->next_chunk == export->count;
+            size_t index = export->next_chunk;
+            if (!done)
+                export->next_chunk++;
+            PTHREAD_CHECK(pthread_mutex_unlock(&export->mutex));
+            if (done)
+                break;
+            serialize_chunk(export, &export->chunks[index]);
+            finish_chunk(export, index);
+        }
+    }
+}
+
+/**
+ * Exports the subtree of an image.
+ * @param start : image of the exported directory
+ * @param path : path of the exported directory
+ * @param fd : file descriptor open for writing
+ * @param format : TREE_EXPORT_TEXT or TREE_EXPORT_BINARY
+ * @return : success, or the errno of a failed write
+ */
+static int export_image(SnapNode* start, const char* path, int fd, int format) {
+    if (format == TREE_EXPORT_BINARY) {
+        ExportHeader header = { .magic = EXPORT_MAGIC, .format_version = EXPORT_FORMAT_VERSION };
+        struct iovec iov = { .iov_base = &header, .iov_len = sizeof(header) };
+        int result = write_buffers(fd, &iov, 1);
+        if (result != SUCCESS)
+            return result;
+    }
+
+    size_t n_workers = wpool_default_size();
+    size_t target = CHUNKS_PER_WORKER * n_workers;
+    Export export = { .format = format, .fd = fd, .window = WINDOW_PER_WORKER * n_workers, .error = SUCCESS };
+    export.chunks = make_chunks(start, path, target < MIN_CHUNKS ? MIN_CHUNKS : target, &export.count);
+    PTHREAD_CHECK(pthread_mutex_init(&export.mutex, NULL));
+    PTHREAD_CHECK(pthread_cond_init(&export.cond, NULL));
+    wpool_parallel_for(n_workers, n_workers, 1, export_chunks, &export);
+    PTHREAD_CHECK(pthread_cond_destroy(&export.cond));
+    PTHREAD_CHECK(pthread_mutex_destroy(&export.mutex));
+
+    for (size_t i = 0; i < export.count; i++) {
+        free(export.chunks[i].path);
+        free(export.chunks[i].data); // Left over if a write failed
+    }
+    free(export.chunks);
+    return export.error;
+}
+
+int snapshot_export(TreeSnapshot* snapshot, const char* path, int fd, int format) {
+    if (!is_valid_path(path) || (format != TREE_EXPORT_TEXT && format != TREE_EXPORT_BINARY))
+        return EINVAL; // Invalid path or format
+    SnapNode* start = snap_node_find(snapshot->root, path);
+    if (!start)
+        return ENOENT; // The directory doesn't exist
+    return export_image(start, path, fd, format);
+}
+
+int tree_export(Tree* tree, const char* path, int fd, int format) {
+    if (!is_valid_path(path) || (format != TREE_EXPORT_TEXT && format != TREE_EXPORT_BINARY))
+        return EINVAL; // Invalid path or format
+    // Only the exported subtree is frozen, so the rest of the tree is not locked at all.
+    SnapNode* start = tree_freeze(tree, path);
+    if (!start)
+        return ENOENT; // The directory doesn't exist
+    int result = export_image(start, path, fd, format);
+    snap_node_unref(start);
+    return result;
+}
@@ -0,0 +1,220 @@
+#include "TreeImage.h"
+#include "path_utils.h"
+#include "safe_allocations.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** Generic success code **/
+#define SUCCESS 0
+
+/** Size of the buffer used to batch writes **/
+#define WRITE_BUFFER_SIZE (1 << 20)
+
+/** Buffered writer, remembering the first error **/
+typedef struct ImageWriter {
+    int fd;
+    char* buffer;
+    size_t used;
+    int error;
+} ImageWriter;
+
+static void writer_flush(ImageWriter* writer) {
+    size_t done = 0;
+    while (done < writer->used && writer->error == SUCCESS) {
+        ssize_t written = write(writer->fd, writer->buffer + done, writer->used - done);
+        if (written >= 0)
+            done += written;
+        else if (errno != EINTR)
+            writer->error = errno;
+    }
+    writer->used = 0;
+}
+
+static void writer_put(ImageWriter* writer, const void* data, size_t size) {
+    while (size > 0) {
+        if (writer->used == WRITE_BUFFER_SIZE)
+            writer_flush(writer);
+        size_t chunk = WRITE_BUFFER_SIZE - writer->used;
+        if (chunk > size)
+            chunk = size;
+        memcpy(writer->buffer + writer->used, data, chunk);
+        writer->used += chunk;
+        data = (const char*)data + chunk;
+        size -= chunk;
+    }
+}
+
+int image_write(SnapNode* root, uint64_t version, int fd) {
+    // Lay the directories out in breadth-first order. Only the directories themselves are stored:
+    // the children of order[i] are written while visiting it, so everything else follows from the order.
+    size_t capacity = 1024, count = 1;
+    SnapNode** order = safe_malloc(capacity * sizeof(SnapNode*));
+    order[0] = root;
+    uint64_t names_size = front_encoded_size(NULL, ""); // The empty name of the root
+    for (size_t i = 0; i < count; i++) {
+        SnapNode* node = order[i];
+        if (count + node->n_children > capacity) {
+            while (count + node->n_children > capacity)
+                capacity *= 2;
+            order = safe_realloc(order, capacity * sizeof(SnapNode*));
+        }
+        for (size_t j = 0; j < node->n_children; j++) {
+            order[count++] = node->children[j];
+            names_size += front_encoded_size(j > 0 ? node->names[j - 1] : NULL, node->names[j]);
+        }
+    }
+
+    ImageWriter writer = { .fd = fd, .buffer = safe_malloc(WRITE_BUFFER_SIZE) };
+    ImageHeader header = {
+        .magic = IMAGE_MAGIC,
+        .format_version = IMAGE_FORMAT_VERSION,
+        .byte_order = IMAGE_BYTE_ORDER_MARK,
+        .tree_version = version,
+        .node_count = count,
+        .names_size = names_size,
+    };
+    writer_put(&writer, &header, sizeof(header));
+
+    // A directory's children start right after the children of all the directories before it.
+    uint64_t next_child = 1, name_offset = front_encoded_size(NULL, "");
+    ImageNode entry = { .name_offset = 0, .first_child = next_child, .child_count = root->n_children };
+    next_child += root->n_children;
+    writer_put(&writer, &entry, sizeof(entry));
+    for (size_t i = 0; i < count; i++) {
+        SnapNode* node = order[i];
+        for (size_t j = 0; j < node->n_children; j++) {
+            SnapNode* child = node->children[j];
+            entry.name_offset = name_offset;
+            entry.name_length = strlen(node->names[j]);
+            entry.first_child = next_child;
+            entry.child_count = child->n_children;
+            writer_put(&writer, &entry, sizeof(entry));
+            name_offset += front_encoded_size(j > 0 ? node->names[j - 1] : NULL, node->names[j]);
+            next_child += child->n_children;
+        }
+    }
+
+    char encoded[FRONT_CODED_MAX_ENTRY];
+    writer_put(&writer, encoded, front_encode(NULL, "", encoded));
+    for (size_t i = 0; i < count; i++) {
+        SnapNode* node = order[i];
+        for (size_t j = 0; j < node->n_children; j++) {
+            size_t size = front_encode(j > 0 ? node->names[j - 1] : NULL, node->names[j], encoded);
+            writer_put(&writer, encoded, size);
+        }
+    }
+    writer_flush(&writer);
+
+    free(writer.buffer);
+    free(order);
+    return writer.error;
+}
+
+/**
+ * Checks the name of a directory in the image and decodes it.
+ * A valid name is a valid folder name, or empty for the root.
+ * @param image : mapped image
+ * @param node : position of the directory in the node table
+ * @param name : name of the previous sibling, overwritten with the decoded name (see `image_decode_name`)
+ * @param length : length of the previous sibling's name, set to the length of the decoded name
+ * @return : whether the name is valid
+ */
+static bool decode_valid_image_name(const TreeImage* image, uint64_t node, char* name, size_t* length) {
+    const ImageNode* entry = &image->nodes[node];
+    uint64_t names_size = image->header->names_size;
+    if (entry->name_offset >= names_size
+        || front_decode(image->names + entry->name_offset, names_size - entry->name_offset, name, length) == 0)
+        return false;
+    if (*length != entry->name_length || (node == 0) != (entry->name_length == 0))
+        return false;
+    for (uint32_t i = 0; i < entry->name_length; i++) {
+        if (name[i] < 'a' || name[i] > 'z')
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Checks that the mapped image describes a tree: every directory must have a valid name, the child
+ * ranges must be adjacent, every directory must come before its children, and siblings must be sorted.
+ * @param image : mapped image, with the sizes of its parts already checked
+ * @return : whether the image is valid
+ */
+static bool is_valid_image(const TreeImage* image) {
+    char name[MAX_FOLDER_NAME_LENGTH + 1], previous[MAX_FOLDER_NAME_LENGTH + 1];
+    size_t length = 0;
+    if (!decode_valid_image_name(image, 0, name, &length))
+        return false;
+
+    // The child ranges cover every directory but the root, so this checks all the other names.
+    uint64_t count = image->header->node_count, next_child = 1;
+    for (uint64_t i = 0; i < count; i++) {
+        const ImageNode* entry = &image->nodes[i];
+        if (entry->child_count == 0)
+            continue;
+        if (entry->first_child != next_child || entry->first_child <= i
+            || entry->child_count > count - entry->first_child)
+            return false;
+        next_child += entry->child_count;
+        length = 0;
+        for (uint64_t c = entry->first_child; c < next_child; c++) {
+            memcpy(previous, name, length + 1);
+            if (!decode_valid_image_name(image, c, name, &length))
+                return false;
+            if (c > entry->first_child && strcmp(previous, name) >= 0)
+                return false;
+        }
+    }
+    return next_child == count;
+}
+
+int image_map(const char* path, TreeImage* image) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int error = errno;
+        close(fd);
+        return error;
+    }
+    if ((size_t)st.st_size < sizeof(ImageHeader)) {
+        close(fd);
+        return EINVAL;
+    }
+
+    void* mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int error = mapping == MAP_FAILED ? errno : SUCCESS;
+    close(fd); // The mapping stays valid
+    if (error != SUCCESS)
+        return error;
+    madvise(mapping, st.st_size, MADV_WILLNEED);
+
+    *image = (TreeImage) { .mapping = mapping, .mapping_size = st.st_size, .header = mapping };
+    const ImageHeader* header = image->header;
+    uint64_t table_size = header->node_count * sizeof(ImageNode);
+    bool valid = memcmp(header->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) == 0
+        && header->format_version == IMAGE_FORMAT_VERSION
+        && header->byte_order == IMAGE_BYTE_ORDER_MARK
+        && header->node_count > 0
+        && header->node_count <= (image->mapping_size - sizeof(ImageHeader)) / sizeof(ImageNode)
+        && header->names_size == image->mapping_size - sizeof(ImageHeader) - table_size;
+    if (valid) {
+        image->nodes = (const ImageNode*)(header + 1);
+        image->names = (const char*)(image->nodes + header->node_count);
+        valid = is_valid_image(image);
+    }
+    if (!valid) {
+        image_unmap(image);
+        return EINVAL;
+    }
+    return SUCCESS;
+}
+
+void image_unmap(TreeImage* image) {
+    munmap(image->mapping, image->mapping_size);
+    image->mapping = NULL;
+}
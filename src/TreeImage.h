@@ -0,0 +1,90 @@
+#pragma once
+
+#include "TreeSnapshot.h"
+#include "front_coding.h"
+#include <stdint.h>
+
+/*
+ * On-disk image of a tree, as written by `tree_save` and read back by `tree_load_mmap`.
+ *
+ * The file consists of three parts, all integers being in the byte order of the machine that wrote it:
+ *   - an `ImageHeader`,
+ *   - a table of `node_count` `ImageNode`s in breadth-first order, the root first,
+ *   - an arena of `names_size` bytes holding the names of the directories, front coded (see front_coding.h).
+ * Breadth-first order with sorted siblings places the subdirectories of every directory next to each
+ * other, in lexicographic order, so a directory only records the range of its children in the table.
+ * The children also come after their parent, and the ranges of consecutive directories are adjacent.
+ * The names of the children of a directory form one front-coded sequence, so that names of large
+ * directories (`file000001`, `file000002`, ...) only store what differs from the previous sibling.
+ * A loader can thus build every directory independently, decoding the names of its children in order.
+ */
+
+/** Identifies image files **/
+#define IMAGE_MAGIC "DIRTREE"
+
+/** Version of the file format **/
+#define IMAGE_FORMAT_VERSION 2
+
+/** Written to the header to detect images of a different byte order **/
+#define IMAGE_BYTE_ORDER_MARK 0x01020304u
+
+typedef struct ImageHeader {
+    char magic[8];            /** IMAGE_MAGIC, NUL-padded **/
+    uint32_t format_version;  /** IMAGE_FORMAT_VERSION **/
+    uint32_t byte_order;      /** IMAGE_BYTE_ORDER_MARK **/
+    uint64_t tree_version;    /** Version of the tree shown by the image **/
+    uint64_t node_count;      /** Number of directories, including the root **/
+    uint64_t names_size;      /** Size of the name arena in bytes **/
+} ImageHeader;
+
+typedef struct ImageNode {
+    uint64_t name_offset;     /** Position of the encoded name in the arena. The root has an empty name **/
+    uint64_t first_child;     /** Position of the first subdirectory in the node table **/
+    uint32_t child_count;     /** Number of subdirectories **/
+    uint32_t name_length;     /** Length of the name, excluding the terminating NUL **/
+} ImageNode;
+
+/** A validated image mapped into memory **/
+typedef struct TreeImage {
+    void* mapping;            /** Start of the mapped file **/
+    size_t mapping_size;      /** Length of the mapping **/
+    const ImageHeader* header;
+    const ImageNode* nodes;   /** The node table **/
+    const char* names;        /** The name arena **/
+} TreeImage;
+
+/**
+ * Writes the image of a directory tree to the file.
+ * @param root : image of the root directory
+ * @param version : version of the tree shown by `root`
+ * @param fd : file descriptor open for writing
+ * @return : 0 on success, or the errno of a failed write
+ */
+int image_write(SnapNode* root, uint64_t version, int fd);
+
+/**
+ * Maps an image file into memory and checks that it describes a valid tree.
+ * @param path : path to the image file
+ * @param image : filled in on success
+ * @return : 0 on success, EINVAL if the file is not a valid image, or the errno of a failed system call
+ */
+int image_map(const char* path, TreeImage* image);
+
+/**
+ * Unmaps an image mapped by `image_map`.
+ */
+void image_unmap(TreeImage* image);
+
+/**
+ * Decodes the name of a directory in the image. The names of siblings must be decoded in order.
+ * @param image : mapped image
+ * @param node : position of the directory in the node table
+ * @param name : buffer of at least MAX_FOLDER_NAME_LENGTH + 1 bytes holding the name of the previous
+ *               sibling, overwritten with the name of the directory
+ * @param length : pointer to the length of the previous sibling's name (0 for the first child),
+ *                 set to the length of the name of the directory
+ */
+static inline void image_decode_name(const TreeImage* image, uint64_t node, char* name, size_t* length) {
+    uint64_t offset = image->nodes[node].name_offset;
+    front_decode(image->names + offset, image->header->names_size - offset, name, length);
+}
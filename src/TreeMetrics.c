@@ -0,0 +1,76 @@
+#include "TreeMetrics.h"
+#include "safe_allocations.h"
+#include "sync_utils.h"
+#include <pthread.h>
+
+/** Histograms of a single thread **/
+typedef struct MetricsBuffer {
+    struct MetricsBuffer* next;   /** Next buffer of the same metrics **/
+    pthread_mutex_t mutex;        /** Held by the owning thread while recording, and while merging **/
+    Histogram latency[TREE_OPS];
+} MetricsBuffer;
+
+struct TreeMetrics {
+    pthread_key_t key;            /** The buffer of each thread **/
+    pthread_mutex_t mutex;        /** Protects `buffers` **/
+    MetricsBuffer* buffers;       /** Buffers of all the threads which recorded anything **/
+};
+
+int metrics_new(TreeMetrics** metrics) {
+    TreeMetrics* new_metrics = safe_calloc(1, sizeof(TreeMetrics));
+    // A thread's buffer stays with the metrics after the thread exits, so there is no destructor.
+    int err = pthread_key_create(&new_metrics->key, NULL);
+    if (err != SUCCESS) {
+        free(new_metrics);
+        return err;
+    }
+    PTHREAD_CHECK(pthread_mutex_init(&new_metrics->mutex, NULL));
+    *metrics = new_metrics;
+    return SUCCESS;
+}
+
+void metrics_free(TreeMetrics* metrics) {
+    for (MetricsBuffer* buffer = metrics->buffers; buffer;) {
+        MetricsBuffer* next = buffer->next;
+        PTHREAD_CHECK(pthread_mutex_destroy(&buffer->mutex));
+        free(buffer);
+        buffer = next;
+    }
+    PTHREAD_CHECK(pthread_key_delete(metrics->key));
+    PTHREAD_CHECK(pthread_mutex_destroy(&metrics->mutex));
+    free(metrics);
+}
+
+static MetricsBuffer* get_thread_buffer(TreeMetrics* metrics) {
+    MetricsBuffer* buffer = pthread_getspecific(metrics->key);
+    if (buffer)
+        return buffer;
+    buffer = safe_malloc(sizeof(MetricsBuffer));
+    PTHREAD_CHECK(pthread_mutex_init(&buffer->mutex, NULL));
+    for (size_t op = 0; op < TREE_OPS; op++)
+        hist_init(&buffer->latency[op]);
+    UNDER_MUTEX(&metrics->mutex,
+        buffer->next = metrics->buffers;
+        metrics->buffers = buffer;
+    );
+    PTHREAD_CHECK(pthread_setspecific(metrics->key, buffer));
+    return buffer;
+}
+
+void metrics_record(TreeMetrics* metrics, TreeOp op, uint64_t latency) {
+    MetricsBuffer* buffer = get_thread_buffer(metrics);
+    UNDER_MUTEX(&buffer->mutex, hist_record(&buffer->latency[op], latency));
+}
+
+void metrics_snapshot(TreeMetrics* metrics, TreeMetricsSnapshot* snapshot) {
+    for (size_t op = 0; op < TREE_OPS; op++)
+        hist_init(&snapshot->latency[op]);
+    PTHREAD_CHECK(pthread_mutex_lock(&metrics->mutex));
+    for (MetricsBuffer* buffer = metrics->buffers; buffer; buffer = buffer->next) {
+        PTHREAD_CHECK(pthread_mutex_lock(&buffer->mutex));
+        for (size_t op = 0; op < TREE_OPS; op++)
+            hist_merge(&snapshot->latency[op], &buffer->latency[op]);
+        PTHREAD_CHECK(pthread_mutex_unlock(&buffer->mutex));
+    }
+    PTHREAD_CHECK(pthread_mutex_unlock(&metrics->mutex));
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "Histogram.h"
+#include "Tree.h"
+#include <stdint.h>
+
+/*
+ * Latency histograms of the operations issued on a tree (see `tree_metrics_start`).
+ *
+ * Every thread records into histograms of its own, kept under a thread-specific key of the metrics
+ * and guarded by a mutex of its own which is only contended while a snapshot is being taken,
+ * so threads never wait for each other to record.
+ * A snapshot merges the histograms of all the threads which recorded anything, including those
+ * which have exited since.
+ */
+
+typedef struct TreeMetrics TreeMetrics;
+
+/**
+ * Creates empty latency histograms.
+ * @param metrics : set to the histograms on success
+ * @return : 0 on success, or EAGAIN if the process ran out of thread-specific keys
+ */
+int metrics_new(TreeMetrics** metrics);
+
+/**
+ * Frees the histograms. No thread may be recording meanwhile.
+ * @param metrics : histograms
+ */
+void metrics_free(TreeMetrics* metrics);
+
+/**
+ * Records the latency of an operation in the histograms of the calling thread.
+ * @param metrics : histograms
+ * @param op : type of the operation
+ * @param latency : latency of the operation in nanoseconds
+ */
+void metrics_record(TreeMetrics* metrics, TreeOp op, uint64_t latency);
+
+/**
+ * Merges the histograms of all threads. May be called concurrently with `metrics_record`.
+ * @param metrics : histograms
+ * @param snapshot : filled in with the merged histograms
+ */
+void metrics_snapshot(TreeMetrics* metrics, TreeMetricsSnapshot* snapshot);
@@ -0,0 +1,177 @@
+#include "TreeSnapshot.h"
+#include "path_utils.h"
+#include "safe_allocations.h"
+#include <errno.h>
+
+/** Generic success code **/
+#define SUCCESS 0
+
+SnapNode* snap_node_new(const char* const* names, SnapNode** children, size_t n_children) {
+    size_t names_size = 0;
+    for (size_t i = 0; i < n_children; i++)
+        names_size += strlen(names[i]) + 1;
+
+    // The node, its arrays and the names all live in a single allocation.
+    size_t arrays_size = n_children * (sizeof(SnapNode*) + sizeof(char*));
+    SnapNode* node = safe_malloc(sizeof(SnapNode) + arrays_size + names_size);
+    atomic_init(&node->refcount, 1);
+    node->n_children = n_children;
+    node->children = (SnapNode**)(node + 1);
+    node->names = (const char**)(node->children + n_children);
+
+    char* arena = (char*)(node->names + n_children);
+    for (size_t i = 0; i < n_children; i++) {
+        size_t len = strlen(names[i]);
+        memcpy(arena, names[i], len + 1);
+        node->names[i] = arena;
+        node->children[i] = children[i];
+        arena += len + 1;
+    }
+    return node;
+}
+
+SnapNode* snap_node_ref(SnapNode* node) {
+    atomic_fetch_add_explicit(&node->refcount, 1, memory_order_relaxed);
+    return node;
+}
+
+void snap_node_unref(SnapNode* node) {
+    if (atomic_fetch_sub_explicit(&node->refcount, 1, memory_order_acq_rel) != 1)
+        return;
+    for (size_t i = 0; i < node->n_children; i++)
+        snap_node_unref(node->children[i]);
+    free(node);
+}
+
+/**
+ * Finds the subdirectory of the `node` with the specified name.
+ * @param node : image of a directory
+ * @param name : subdirectory name
+ * @return : image of the subdirectory, or NULL if there is none
+ */
+static SnapNode* snap_node_child(SnapNode* node, const char* name) {
+    size_t lo = 0, hi = node->n_children;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(node->names[mid], name);
+        if (cmp == 0)
+            return node->children[mid];
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+SnapNode* snap_node_find(SnapNode* root, const char* path) {
+    char child_name[MAX_FOLDER_NAME_LENGTH + 1];
+    SnapNode* node = root;
+    while (node && (path = split_path(path, child_name)))
+        node = snap_node_child(node, child_name);
+    return node;
+}
+
+/** A read transaction is a private snapshot **/
+struct TreeReadTxn {
+    TreeSnapshot* snapshot;
+};
+
+TreeSnapshot* snapshot_new(SnapNode* root, uint64_t version) {
+    TreeSnapshot* snapshot = safe_malloc(sizeof(TreeSnapshot));
+    snapshot->root = root;
+    snapshot->version = version;
+    return snapshot;
+}
+
+uint64_t snapshot_version(TreeSnapshot* snapshot) {
+    return snapshot->version;
+}
+
+void snapshot_free(TreeSnapshot* snapshot) {
+    snap_node_unref(snapshot->root);
+    free(snapshot);
+}
+
+char* snapshot_list(TreeSnapshot* snapshot, const char* path) {
+    if (!is_valid_path(path))
+        return NULL;
+
+    SnapNode* dir = snap_node_find(snapshot->root, path);
+    if (!dir)
+        return NULL; // The directory doesn't exist
+
+    return make_keys_string(dir->names, dir->n_children);
+}
+
+/**
+ * Visits the `node` and its subtree in pre-order, with subdirectories in lexicographic order.
+ * @param node : image of the current directory
+ * @param path : pointer to a malloc'd buffer holding the path of the directory
+ * @param capacity : pointer to the size of the buffer
+ * @param len : length of the path
+ * @param depth : depth of the directory, relative to the start of the walk
+ * @param callback : function to call on every directory
+ * @param arg : argument passed to `callback`
+ * @return : 0, or the first non-zero result of the callback (which ends the walk)
+ */
+static int walk_snap_node(SnapNode* node, char** path, size_t* capacity, size_t len, size_t depth,
+                          tree_walk_fn callback, void* arg) {
+    int result = callback(*path, depth, arg);
+    for (size_t i = 0; i < node->n_children && result == SUCCESS; i++) {
+        size_t name_len = strlen(node->names[i]);
+        if (len + name_len + 2 > *capacity) {
+            *capacity = 2 * (len + name_len + 2);
+            *path = safe_realloc(*path, *capacity);
+        }
+        memcpy(*path + len, node->names[i], name_len);
+        (*path)[len + name_len] = '/';
+        (*path)[len + name_len + 1] = '\0';
+        result = walk_snap_node(node->children[i], path, capacity, len + name_len + 1, depth + 1, callback, arg);
+    }
+    return result;
+}
+
+int snapshot_walk(TreeSnapshot* snapshot, const char* path, tree_walk_fn callback, void* arg) {
+    if (!is_valid_path(path))
+        return EINVAL; // Invalid path
+
+    SnapNode* start = snap_node_find(snapshot->root, path);
+    if (!start)
+        return ENOENT; // The directory doesn't exist
+
+    size_t capacity = MAX_PATH_LENGTH + 1;
+    char* buffer = safe_malloc(capacity);
+    strcpy(buffer, path);
+    int result = walk_snap_node(start, &buffer, &capacity, strlen(path), 0, callback, arg);
+    free(buffer);
+    return result;
+}
+
+TreeReadTxn* read_txn_new(TreeSnapshot* snapshot) {
+    TreeReadTxn* txn = safe_malloc(sizeof(TreeReadTxn));
+    txn->snapshot = snapshot;
+    return txn;
+}
+
+uint64_t read_txn_version(TreeReadTxn* txn) {
+    return txn->snapshot->version;
+}
+
+char* read_txn_list(TreeReadTxn* txn, const char* path) {
+    return snapshot_list(txn->snapshot, path);
+}
+
+bool read_txn_exists(TreeReadTxn* txn, const char* path) {
+    return is_valid_path(path) && snap_node_find(txn->snapshot->root, path) != NULL;
+}
+
+ssize_t read_txn_child_count(TreeReadTxn* txn, const char* path) {
+    SnapNode* dir = is_valid_path(path) ? snap_node_find(txn->snapshot->root, path) : NULL;
+    return dir ? (ssize_t)dir->n_children : -1;
+}
+
+void tree_read_txn_end(TreeReadTxn* txn) {
+    snapshot_free(txn->snapshot);
+    free(txn);
+}
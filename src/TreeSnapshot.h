@@ -0,0 +1,82 @@
+#pragma once
+
+#include "Tree.h"
+#include <stdatomic.h>
+
+/*
+ * Internals of `TreeSnapshot`, shared with Tree.c, which builds the snapshots.
+ *
+ * A snapshot is a tree of immutable `SnapNode`s. Every live directory caches the image of its subtree
+ * it was last frozen into, and a modification discards the images along the path to the root only.
+ * The next snapshot thus rebuilds just that path and shares every untouched subtree, with the
+ * previous snapshots as well as with the cache (path copying). Nodes are reference counted, so an
+ * image lives as long as any snapshot or directory refers to it. A directory has no image until a
+ * snapshot first needs one, so trees which are never snapshotted don't pay for them.
+ */
+
+/** Immutable image of a directory and its subtree **/
+typedef struct SnapNode SnapNode;
+
+struct SnapNode {
+    atomic_size_t refcount; /** Number of snapshots, directories and parent images referring to the node **/
+    size_t n_children;      /** Number of subdirectories **/
+    const char** names;     /** Names of the subdirectories, lexicographically sorted **/
+    SnapNode** children;    /** children[i] is the image of the subdirectory names[i] **/
+};
+
+struct TreeSnapshot {
+    SnapNode* root;   /** Image of the root directory **/
+    uint64_t version; /** Version of the tree shown by the snapshot **/
+};
+
+/**
+ * Creates an image of a directory out of the images of its subdirectories.
+ * @param names : sorted names of the subdirectories (they are copied)
+ * @param children : images of the subdirectories; the new node takes over the caller's references
+ * @param n_children : number of subdirectories
+ * @return : the new image, with a single reference owned by the caller
+ */
+SnapNode* snap_node_new(const char* const* names, SnapNode** children, size_t n_children);
+
+/**
+ * Acquires a new reference to the `node`.
+ * @return : the node
+ */
+SnapNode* snap_node_ref(SnapNode* node);
+
+/**
+ * Releases a reference to the `node`, freeing it (and releasing its children) if it was the last one.
+ */
+void snap_node_unref(SnapNode* node);
+
+/**
+ * Finds the image of the directory at the path.
+ * @param root : image of the root directory
+ * @param path : valid path
+ * @return : the image (no new reference is taken), or NULL if the directory doesn't exist
+ */
+SnapNode* snap_node_find(SnapNode* root, const char* path);
+
+/**
+ * Freezes a single subtree of the tree. Only the directories of the subtree are locked, and only while
+ * the image is being taken; the path to it is merely traversed.
+ * @param tree : file tree
+ * @param path : valid path
+ * @return : image of the subtree, with a reference owned by the caller, or NULL if the directory doesn't exist
+ */
+SnapNode* tree_freeze(Tree* tree, const char* path);
+
+/**
+ * Wraps the image of a root directory into a snapshot, taking over the caller's reference.
+ * @param root : image of the root directory
+ * @param version : version of the tree shown by the image
+ * @return : the new snapshot
+ */
+TreeSnapshot* snapshot_new(SnapNode* root, uint64_t version);
+
+/**
+ * Starts a read transaction served from the snapshot, taking it over.
+ * @param snapshot : snapshot of the tree
+ * @return : the new transaction
+ */
+TreeReadTxn* read_txn_new(TreeSnapshot* snapshot);
@@ -0,0 +1,247 @@
+#include "TreeTrace.h"
+#include "fs_utils.h"
+#include "path_utils.h"
+#include "safe_allocations.h"
+#include "sync_utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Size of the buffer of every thread **/
+#define TRACE_BUFFER_SIZE (64 * 1024)
+
+/*
+ * A record is encoded as a fixed-size part, followed by the path and the target without terminating
+ * NULs. The fixed-size part holds, in order: the timestamp (uint64_t), the duration (uint64_t),
+ * the thread (uint32_t), the result (int32_t), the type (uint8_t), and the lengths of the path and
+ * of the target (uint16_t each).
+ */
+#define RECORD_FIXED_SIZE (8 + 8 + 4 + 4 + 1 + 2 + 2)
+
+/** Longest path kept in a record. Longer ones are cut, which keeps them invalid **/
+#define MAX_TRACED_PATH_LENGTH (MAX_PATH_LENGTH + 1)
+
+/** Records of a single thread, not yet written out **/
+typedef struct TraceBuffer {
+    struct TraceBuffer* next; /** Next buffer of the same writer **/
+    uint32_t thread;          /** Number of the owning thread **/
+    size_t size;              /** Bytes of `data` in use **/
+    char data[TRACE_BUFFER_SIZE];
+} TraceBuffer;
+
+struct TraceWriter {
+    int fd;
+    pthread_key_t key;        /** The buffer of each thread **/
+    uint64_t start;           /** Monotonic time when tracing started, in nanoseconds **/
+    pthread_mutex_t mutex;    /** Protects all the fields below **/
+    TraceBuffer* buffers;     /** Buffers of all the threads which recorded anything **/
+    uint32_t n_threads;       /** Number of buffers **/
+    uint64_t offset;          /** End of the data written to the file **/
+    int error;                /** First error of a write **/
+};
+
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int trace_open(const char* path, uint64_t tree_version, TraceWriter** writer) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return errno;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    TraceHeader header = {
+        .magic = TRACE_MAGIC,
+        .format_version = TRACE_FORMAT_VERSION,
+        .tree_version = tree_version,
+        .start_time = now.tv_sec * 1000000000ull + now.tv_nsec,
+    };
+    int result = write_all_at(fd, (const char*)&header, sizeof(header), 0);
+    if (result != SUCCESS) {
+        close(fd);
+        return result;
+    }
+
+    TraceWriter* trace = safe_calloc(1, sizeof(TraceWriter));
+    // A thread's buffer stays with the writer after the thread exits, so there is no destructor.
+    result = pthread_key_create(&trace->key, NULL);
+    if (result != SUCCESS) {
+        free(trace);
+        close(fd);
+        return result;
+    }
+    trace->fd = fd;
+    trace->start = monotonic_ns();
+    trace->offset = sizeof(header);
+    PTHREAD_CHECK(pthread_mutex_init(&trace->mutex, NULL));
+    *writer = trace;
+    return SUCCESS;
+}
+
+uint64_t trace_now(TraceWriter* writer) {
+    return monotonic_ns() - writer->start;
+}
+
+/** Writes out the buffer, which must not be written to meanwhile. Called with the writer's mutex held **/
+static void flush_buffer(TraceWriter* writer, TraceBuffer* buffer) {
+    if (buffer->size > 0 && writer->error == SUCCESS) {
+        writer->error = write_all_at(writer->fd, buffer->data, buffer->size, writer->offset);
+        writer->offset += buffer->size;
+    }
+    buffer->size = 0;
+}
+
+static TraceBuffer* get_thread_buffer(TraceWriter* writer) {
+    TraceBuffer* buffer = pthread_getspecific(writer->key);
+    if (buffer)
+        return buffer;
+    buffer = safe_malloc(sizeof(TraceBuffer));
+    buffer->size = 0;
+    UNDER_MUTEX(&writer->mutex,
+        buffer->thread = writer->n_threads++;
+        buffer->next = writer->buffers;
+        writer->buffers = buffer;
+    );
+    PTHREAD_CHECK(pthread_setspecific(writer->key, buffer));
+    return buffer;
+}
+
+static void put(TraceBuffer* buffer, const void* data, size_t size) {
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+}
+
+void trace_record(TraceWriter* writer, TraceOpType type, const char* path, const char* target, int result,
+                  uint64_t start) {
+    uint64_t end = trace_now(writer);
+    TraceBuffer* buffer = get_thread_buffer(writer);
+    uint16_t path_length = strnlen(path, MAX_TRACED_PATH_LENGTH);
+    uint16_t target_length = target ? strnlen(target, MAX_TRACED_PATH_LENGTH) : 0;
+    if (buffer->size + RECORD_FIXED_SIZE + path_length + target_length > TRACE_BUFFER_SIZE) {
+        UNDER_MUTEX(&writer->mutex, flush_buffer(writer, buffer));
+    }
+
+    uint64_t duration = end - start;
+    int32_t result32 = result;
+    uint8_t type8 = type;
+    put(buffer, &start, sizeof(start));
+    put(buffer, &duration, sizeof(duration));
+    put(buffer, &buffer->thread, sizeof(buffer->thread));
+    put(buffer, &result32, sizeof(result32));
+    put(buffer, &type8, sizeof(type8));
+    put(buffer, &path_length, sizeof(path_length));
+    put(buffer, &target_length, sizeof(target_length));
+    put(buffer, path, path_length);
+    if (target)
+        put(buffer, target, target_length);
+}
+
+int trace_close(TraceWriter* writer) {
+    for (TraceBuffer* buffer = writer->buffers; buffer;) {
+        TraceBuffer* next = buffer->next;
+        flush_buffer(writer, buffer);
+        free(buffer);
+        buffer = next;
+    }
+    int result = writer->error;
+    if (close(writer->fd) != 0 && result == SUCCESS)
+        result = errno;
+    PTHREAD_CHECK(pthread_key_delete(writer->key));
+    PTHREAD_CHECK(pthread_mutex_destroy(&writer->mutex));
+    free(writer);
+    return result;
+}
+
+/**
+ * Decodes a record.
+ * @param data : start of the encoded record
+ * @param available : number of bytes readable from `data`
+ * @param record : filled in with the record; its strings point into `strings`
+ * @param strings : buffer of at least 2 * (MAX_TRACED_PATH_LENGTH + 1) bytes
+ * @return : size of the record, 0 if it is truncated, or -1 if it is malformed
+ */
+static ssize_t decode_record(const char* data, size_t available, TraceRecord* record, char* strings) {
+    if (available < RECORD_FIXED_SIZE)
+        return 0;
+    uint8_t type;
+    uint16_t path_length, target_length;
+    memcpy(&record->timestamp, data, 8);
+    memcpy(&record->duration, data + 8, 8);
+    memcpy(&record->thread, data + 16, 4);
+    memcpy(&record->result, data + 20, 4);
+    memcpy(&type, data + 24, 1);
+    memcpy(&path_length, data + 25, 2);
+    memcpy(&target_length, data + 27, 2);
+    record->type = type;
+    if (type < TRACE_LIST || type > TRACE_MOVE || (type != TRACE_MOVE && target_length > 0)
+        || path_length > MAX_TRACED_PATH_LENGTH || target_length > MAX_TRACED_PATH_LENGTH)
+        return -1;
+    if (available - RECORD_FIXED_SIZE < (size_t)path_length + target_length)
+        return 0;
+
+    char* path = strings;
+    char* target = strings + MAX_TRACED_PATH_LENGTH + 1;
+    memcpy(path, data + RECORD_FIXED_SIZE, path_length);
+    path[path_length] = '\0';
+    memcpy(target, data + RECORD_FIXED_SIZE + path_length, target_length);
+    target[target_length] = '\0';
+    record->path = path;
+    record->target = type == TRACE_MOVE ? target : NULL;
+    return RECORD_FIXED_SIZE + path_length + target_length;
+}
+
+int trace_read(const char* path, TraceHeader* header, trace_record_fn callback, void* arg) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int error = errno;
+        close(fd);
+        return error;
+    }
+    size_t size = st.st_size;
+    if (size < sizeof(TraceHeader)) {
+        close(fd);
+        return EINVAL;
+    }
+    char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int result = data == MAP_FAILED ? errno : SUCCESS;
+    close(fd);
+    if (result != SUCCESS)
+        return result;
+
+    const TraceHeader* file_header = (const TraceHeader*)data;
+    if (memcmp(file_header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0
+        || file_header->format_version != TRACE_FORMAT_VERSION) {
+        munmap(data, size);
+        return EINVAL;
+    }
+    if (header)
+        *header = *file_header;
+
+    char* strings = safe_malloc(2 * (MAX_TRACED_PATH_LENGTH + 1));
+    size_t position = sizeof(TraceHeader);
+    while (result == SUCCESS) {
+        TraceRecord record;
+        ssize_t record_size = decode_record(data + position, size - position, &record, strings);
+        if (record_size == 0)
+            break; // The end of the trace, or a record cut short by a crash
+        if (record_size < 0) {
+            result = EINVAL;
+            break;
+        }
+        result = callback(arg, &record);
+        position += record_size;
+    }
+    free(strings);
+    munmap(data, size);
+    return result;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Trace of the operations issued on a tree, for replaying them offline (see tree_replay.c).
+ *
+ * The trace is a file starting with a `TraceHeader`, followed by records. A record describes one
+ * operation: its type, its paths, the thread which issued it, when it started, how long it took,
+ * and what it returned. Each thread encodes its records into a buffer of its own, which is written
+ * out as a whole once full, so tracing adds no contention between threads besides the rare writes.
+ * Records of different threads are therefore not in the order of their timestamps.
+ */
+
+/** Identifies trace files **/
+#define TRACE_MAGIC "DIRTTRC"
+
+/** Version of the trace format **/
+#define TRACE_FORMAT_VERSION 2
+
+typedef struct TraceHeader {
+    char magic[8];           /** TRACE_MAGIC, NUL-padded **/
+    uint32_t format_version; /** TRACE_FORMAT_VERSION **/
+    uint32_t reserved;
+    uint64_t tree_version;   /** Version of the tree when tracing started **/
+    uint64_t start_time;     /** Wall-clock time when tracing started, in nanoseconds since the Epoch **/
+} TraceHeader;
+
+/** Kinds of traced operations **/
+typedef enum TraceOpType {
+    TRACE_LIST = 1,
+    TRACE_CREATE = 2,
+    TRACE_REMOVE = 3,
+    TRACE_MOVE = 4
+} TraceOpType;
+
+/** A traced operation **/
+typedef struct TraceRecord {
+    TraceOpType type;
+    const char* path;   /** Directory listed, created, removed, or the source of a move **/
+    const char* target; /** Target of a move. NULL for the other operations **/
+    uint32_t thread;    /** Number of the issuing thread, in the order threads first issued an operation **/
+    int32_t result;     /** Error code returned by the operation, 0 on success **/
+    uint64_t timestamp; /** Start of the operation, in nanoseconds since tracing started **/
+    uint64_t duration;  /** Duration of the operation in nanoseconds **/
+} TraceRecord;
+
+typedef struct TraceWriter TraceWriter;
+
+/**
+ * Creates a trace file, replacing any existing one.
+ * @param path : path to the trace file
+ * @param tree_version : version of the traced tree
+ * @param writer : set to the writer on success
+ * @return : 0 on success, EAGAIN if the process ran out of thread-specific keys,
+ *           or the errno of a failed system call
+ */
+int trace_open(const char* path, uint64_t tree_version, TraceWriter** writer);
+
+/**
+ * Returns the time since tracing started, to be passed to `trace_record` as the start of an operation.
+ */
+uint64_t trace_now(TraceWriter* writer);
+
+/**
+ * Records an operation in the buffer of the calling thread.
+ * @param writer : trace writer
+ * @param type : type of the operation
+ * @param path : path of the operation
+ * @param target : target of a move, NULL for the other operations
+ * @param result : error code returned by the operation
+ * @param start : start of the operation, as returned by `trace_now`
+ */
+void trace_record(TraceWriter* writer, TraceOpType type, const char* path, const char* target, int result,
+                  uint64_t start);
+
+/**
+ * Writes out the buffers of all threads and closes the trace.
+ * No thread may be recording meanwhile.
+ * @param writer : trace writer
+ * @return : 0 on success, or the errno of the first failed write
+ */
+int trace_close(TraceWriter* writer);
+
+/**
+ * Called for every record of a trace being read.
+ * @param arg : argument passed to `trace_read`
+ * @param record : the record. The strings are only valid during the call
+ * @return : 0 to continue reading, anything else to stop and return it from `trace_read`
+ */
+typedef int (*trace_record_fn)(void* arg, const TraceRecord* record);
+
+/**
+ * Reads all the records of a trace, in the order in which they were written.
+ * A truncated record at the end of the file ends the trace.
+ * @param path : path to the trace file
+ * @param header : if not NULL, filled in with the header of the trace
+ * @param callback : function called for every record
+ * @param arg : argument passed to `callback`
+ * @return : 0 on success, EINVAL if the file is not a trace or holds a malformed record,
+ *           the errno of a failed system call, or the non-zero value returned by `callback`
+ */
+int trace_read(const char* path, TraceHeader* header, trace_record_fn callback, void* arg);
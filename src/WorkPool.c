@@ -0,0 +1,205 @@
+#include "WorkPool.h"
+#include "safe_allocations.h"
+#include "sync_utils.h"
+#include <stdatomic.h>
+#include <unistd.h>
+
+// Capacity of a freshly allocated deque.
+#define INITIAL_DEQUE_CAPACITY 64
+
+typedef struct Deque {
+    pthread_mutex_t mutex; // Protects all the fields below, except for reading `size`.
+    void** tasks;          // Circular buffer of tasks.
+    size_t head;           // Position of the front (oldest) task.
+    atomic_size_t size;    // Number of tasks. Read without the mutex to check for work cheaply.
+    size_t capacity;       // Allocated length of `tasks`.
+} Deque;
+
+struct WorkPool {
+    wpool_work_fn fn;
+    void* arg;
+    size_t n_workers;
+    Deque* deques;            // One deque per worker.
+    atomic_size_t pending;    // Tasks submitted, but not yet finished.
+    atomic_size_t sleeping;   // Workers waiting on `work_cond`.
+    pthread_mutex_t idle_mutex;
+    pthread_cond_t work_cond; // Signalled when a task is submitted or the last one finishes.
+};
+
+typedef struct Worker {
+    WorkPool* pool;
+    size_t id;
+} Worker;
+
+static void deque_push_back(Deque* deque, void* task) {
+    UNDER_MUTEX(&deque->mutex,
+        size_t size = atomic_load(&deque->size);
+        if (size == deque->capacity) {
+            size_t capacity = deque->capacity ? 2 * deque->capacity : INITIAL_DEQUE_CAPACITY;
+            void** tasks = safe_malloc(capacity * sizeof(void*));
+            for (size_t i = 0; i < size; i++)
+                tasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
+            free(deque->tasks);
+            deque->tasks = tasks;
+            deque->head = 0;
+            deque->capacity = capacity;
+        }
+        deque->tasks[(deque->head + size) % deque->capacity] = task;
+        atomic_store(&deque->size, size + 1);
+    );
+}
+
+static void* deque_pop(Deque* deque, bool back) {
+    void* task = NULL;
+    if (atomic_load(&deque->size) == 0)
+        return NULL;
+    UNDER_MUTEX(&deque->mutex,
+        size_t size = atomic_load(&deque->size);
+        if (size > 0) {
+            if (back) {
+                task = deque->tasks[(deque->head + size - 1) % deque->capacity];
+            } else {
+                task = deque->tasks[deque->head];
+                deque->head = (deque->head + 1) % deque->capacity;
+            }
+            atomic_store(&deque->size, size - 1);
+        }
+    );
+    return task;
+}
+
+/**
+ * Takes a task from the worker's own deque, or steals one from another worker.
+ * @return : the task, or NULL if no deque has any
+ */
+static void* find_task(WorkPool* pool, size_t worker) {
+    void* task = deque_pop(&pool->deques[worker], true);
+    for (size_t i = 1; !task && i < pool->n_workers; i++)
+        task = deque_pop(&pool->deques[(worker + i) % pool->n_workers], false);
+    return task;
+}
+
+static bool any_task_queued(WorkPool* pool) {
+    for (size_t i = 0; i < pool->n_workers; i++) {
+        if (atomic_load(&pool->deques[i].size) > 0)
+            return true;
+    }
+    return false;
+}
+
+static void* worker_main(void* data) {
+    Worker* self = data;
+    WorkPool* pool = self->pool;
+
+    while (true) {
+        void* task = find_task(pool, self->id);
+        if (task) {
+            pool->fn(pool, self->id, task);
+            if (atomic_fetch_sub(&pool->pending, 1) == 1) // The last task - wake everybody up to finish
+                UNDER_MUTEX(&pool->idle_mutex, PTHREAD_CHECK(pthread_cond_broadcast(&pool->work_cond)));
+            continue;
+        }
+
+        bool finished = false;
+        UNDER_MUTEX(&pool->idle_mutex,
+            // `sleeping` is raised before checking the deques, so that a concurrent `wpool_submit`
+            // either sees it and signals, or its task is seen here.
+            atomic_fetch_add(&pool->sleeping, 1);
+            while (atomic_load(&pool->pending) > 0 && !any_task_queued(pool))
+                PTHREAD_CHECK(pthread_cond_wait(&pool->work_cond, &pool->idle_mutex));
+            atomic_fetch_sub(&pool->sleeping, 1);
+            finished = atomic_load(&pool->pending) == 0;
+        );
+        if (finished)
+            return NULL;
+    }
+}
+
+void wpool_submit(WorkPool* pool, size_t worker, void* task) {
+    atomic_fetch_add(&pool->pending, 1);
+    deque_push_back(&pool->deques[worker], task);
+    if (atomic_load(&pool->sleeping) > 0)
+        UNDER_MUTEX(&pool->idle_mutex, PTHREAD_CHECK(pthread_cond_signal(&pool->work_cond)));
+}
+
+void wpool_run(size_t n_workers, wpool_work_fn fn, void* arg, void* root_task) {
+    if (n_workers == 0)
+        n_workers = 1;
+
+    WorkPool pool = { .fn = fn, .arg = arg, .n_workers = n_workers };
+    pool.deques = safe_calloc(n_workers, sizeof(Deque));
+    for (size_t i = 0; i < n_workers; i++)
+        PTHREAD_CHECK(pthread_mutex_init(&pool.deques[i].mutex, NULL));
+    PTHREAD_CHECK(pthread_mutex_init(&pool.idle_mutex, NULL));
+    PTHREAD_CHECK(pthread_cond_init(&pool.work_cond, NULL));
+
+    atomic_store(&pool.pending, 1);
+    deque_push_back(&pool.deques[0], root_task);
+
+    pthread_t* threads = safe_malloc(n_workers * sizeof(pthread_t));
+    Worker* workers = safe_malloc(n_workers * sizeof(Worker));
+    for (size_t i = 0; i < n_workers; i++) {
+        workers[i] = (Worker) { .pool = &pool, .id = i };
+        PTHREAD_CHECK(pthread_create(&threads[i], NULL, worker_main, &workers[i]));
+    }
+    for (size_t i = 0; i < n_workers; i++)
+        PTHREAD_CHECK(pthread_join(threads[i], NULL));
+
+    free(workers);
+    free(threads);
+    for (size_t i = 0; i < n_workers; i++) {
+        PTHREAD_CHECK(pthread_mutex_destroy(&pool.deques[i].mutex));
+        free(pool.deques[i].tasks);
+    }
+    free(pool.deques);
+    PTHREAD_CHECK(pthread_cond_destroy(&pool.work_cond));
+    PTHREAD_CHECK(pthread_mutex_destroy(&pool.idle_mutex));
+}
+
+void* wpool_arg(WorkPool* pool) {
+    return pool->arg;
+}
+
+size_t wpool_size(WorkPool* pool) {
+    return pool->n_workers;
+}
+
+size_t wpool_default_size() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (size_t)n : 1;
+}
+
+/** Shared state of a `wpool_parallel_for` **/
+typedef struct ParallelFor {
+    wpool_range_fn body;
+    void* arg;
+    size_t grain;
+} ParallelFor;
+
+/** A range of a `wpool_parallel_for` still to be processed **/
+typedef struct Range {
+    size_t begin, end;
+} Range;
+
+static void parallel_for_task(WorkPool* pool, size_t worker, void* task) {
+    ParallelFor* loop = wpool_arg(pool);
+    Range* range = task;
+    while (range->end - range->begin > loop->grain) {
+        Range* half = safe_malloc(sizeof(Range));
+        half->begin = range->begin + (range->end - range->begin) / 2;
+        half->end = range->end;
+        range->end = half->begin;
+        wpool_submit(pool, worker, half);
+    }
+    loop->body(loop->arg, range->begin, range->end);
+    free(range);
+}
+
+void wpool_parallel_for(size_t n_workers, size_t n, size_t grain, wpool_range_fn body, void* arg) {
+    if (n == 0)
+        return;
+    ParallelFor loop = { .body = body, .arg = arg, .grain = grain ? grain : 1 };
+    Range* range = safe_malloc(sizeof(Range));
+    *range = (Range) { .begin = 0, .end = n };
+    wpool_run(n_workers, parallel_for_task, &loop, range);
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+// A pool of worker threads executing a dynamically growing set of tasks.
+// Tasks are opaque pointers handed to a single work function, which may submit further tasks.
+// Each worker keeps its own deque of tasks: it pushes and pops at the back (depth-first, which keeps
+// the number of pending tasks small), while idle workers steal from the front of other deques
+// (which for tree-shaped work yields the largest remaining pieces).
+typedef struct WorkPool WorkPool;
+
+// The work function. `worker` identifies the calling worker (0 <= worker < number of workers)
+// and should be passed on to `wpool_submit`.
+typedef void (*wpool_work_fn)(WorkPool* pool, size_t worker, void* task);
+
+// Run `root_task` and every task transitively submitted by it on `n_workers` threads
+// (the calling thread is not one of them). Returns once all tasks have finished.
+// `arg` is available to the work function through `wpool_arg`.
+void wpool_run(size_t n_workers, wpool_work_fn fn, void* arg, void* root_task);
+
+// Submit a new task. Must be called from inside the work function, with its `worker` argument.
+void wpool_submit(WorkPool* pool, size_t worker, void* task);
+
+// Return the `arg` passed to `wpool_run`.
+void* wpool_arg(WorkPool* pool);
+
+// Return the number of workers of the pool.
+size_t wpool_size(WorkPool* pool);
+
+// Return the number of online processors, a sensible default for `n_workers`.
+size_t wpool_default_size();
+
+// The body of a parallel loop, called for disjoint ranges [begin, end) of the iteration space.
+typedef void (*wpool_range_fn)(void* arg, size_t begin, size_t end);
+
+// Call `body` on ranges covering [0, n) exactly once, on `n_workers` threads.
+// Ranges are split in halves until they are no longer than `grain`, so idle workers can steal large pieces.
+void wpool_parallel_for(size_t n_workers, size_t n, size_t grain, wpool_range_fn body, void* arg);
@@ -0,0 +1,166 @@
+#include "Workload.h"
+#include "safe_allocations.h"
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+
+/** Maximum number of leaves, keeping the population of the tree within reason **/
+#define MAX_LEAVES 1000000000
+
+const char* const workload_op_names[WORKLOAD_OP_TYPES] = { "list", "create", "remove", "move" };
+
+struct Workload {
+    WorkloadConfig config;
+    size_t n_leaves;
+    unsigned mix_total;
+    size_t top_divisor; /** fanout^(depth - 1): the weight of the first digit of a leaf **/
+    /** Constants of the Zipfian generator of Gray et al., "Quickly generating billion-record synthetic
+     *  databases", over the ranks [0, n_leaves) **/
+    double zipf_alpha, zipf_zeta_n, zipf_eta, zipf_half_pow;
+};
+
+Workload* workload_new(const WorkloadConfig* config) {
+    unsigned mix_total = 0;
+    for (size_t op = 0; op < WORKLOAD_OP_TYPES; op++)
+        mix_total += config->mix[op];
+    double n_names = pow(26, config->name_length < 14 ? config->name_length : 14);
+    if (mix_total == 0 || config->depth == 0 || config->fanout == 0 || config->fanout > n_names
+        || config->name_length == 0 || config->name_length > MAX_FOLDER_NAME_LENGTH
+        || config->depth * (config->name_length + 1) + 1 > MAX_PATH_LENGTH
+        || pow(config->fanout, config->depth) > MAX_LEAVES
+        || (config->zipf && (config->zipf_theta <= 0 || config->zipf_theta >= 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    Workload* workload = safe_calloc(1, sizeof(Workload));
+    workload->config = *config;
+    workload->mix_total = mix_total;
+    workload->top_divisor = 1;
+    for (size_t level = 1; level < config->depth; level++)
+        workload->top_divisor *= config->fanout;
+    workload->n_leaves = workload->top_divisor * config->fanout;
+
+    if (config->zipf) {
+        double theta = config->zipf_theta, n = workload->n_leaves;
+        workload->zipf_half_pow = pow(0.5, theta);
+        workload->zipf_alpha = 1 / (1 - theta);
+        for (size_t i = 1; i <= workload->n_leaves; i++)
+            workload->zipf_zeta_n += 1 / pow(i, theta);
+        workload->zipf_eta = (1 - pow(2 / n, 1 - theta)) / (1 - (1 + workload->zipf_half_pow) / workload->zipf_zeta_n);
+    }
+    return workload;
+}
+
+void workload_free(Workload* workload) {
+    free(workload);
+}
+
+const WorkloadConfig* workload_config(const Workload* workload) {
+    return &workload->config;
+}
+
+/**
+ * Writes the path of a directory of the tree.
+ * @param workload : workload
+ * @param leaf : index of a leaf
+ * @param depth : depth of the directory on the way to the leaf, 0 for the root
+ * @param path : buffer of at least MAX_PATH_LENGTH + 1 bytes
+ */
+static void leaf_path(const Workload* workload, size_t leaf, size_t depth, char* path) {
+    // The digits of `leaf` in base `fanout` choose the child at every level, the first digit at the top.
+    const WorkloadConfig* config = &workload->config;
+    size_t divisor = workload->top_divisor;
+    char* end = path;
+    *end++ = '/';
+    for (size_t level = 0; level < depth; level++) {
+        size_t child = leaf / divisor % config->fanout;
+        divisor /= config->fanout;
+        // The name spells `child` in base 26, padded with 'a's.
+        for (size_t i = config->name_length; i > 0; i--) {
+            end[i - 1] = 'a' + child % 26;
+            child /= 26;
+        }
+        end += config->name_length;
+        *end++ = '/';
+    }
+    *end = '\0';
+}
+
+Tree* workload_populate(const Workload* workload) {
+    const WorkloadConfig* config = &workload->config;
+    char path[MAX_PATH_LENGTH + 1];
+    Tree* tree = tree_new();
+    // Creating every leaf's ancestors on the way creates the inner directories in pre-order.
+    for (size_t leaf = 0; leaf < workload->n_leaves; leaf++) {
+        if (leaf % config->fanout == 0) {
+            for (size_t depth = 1; depth < config->depth; depth++) {
+                leaf_path(workload, leaf, depth, path);
+                tree_create(tree, path);
+            }
+        }
+        if (leaf % 2 == 0) {
+            leaf_path(workload, leaf, config->depth, path);
+            tree_create(tree, path);
+        }
+    }
+    return tree;
+}
+
+void workload_stream_init(WorkloadStream* stream, const Workload* workload, size_t index) {
+    // Mix the index into the seed (splitmix64), so that streams of neighbouring indices are unrelated.
+    uint64_t seed = workload->config.seed + (index + 1) * 0x9e3779b97f4a7c15ull;
+    seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ull;
+    seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebull;
+    seed ^= seed >> 31;
+    stream->workload = workload;
+    stream->rand = seedRand((uint32_t)seed);
+}
+
+static size_t next_leaf(WorkloadStream* stream) {
+    const Workload* workload = stream->workload;
+    double uniform = genRand(&stream->rand);
+    if (!workload->config.zipf)
+        return uniform * workload->n_leaves;
+
+    double uz = uniform * workload->zipf_zeta_n;
+    if (uz < 1)
+        return 0;
+    if (uz < 1 + workload->zipf_half_pow)
+        return 1;
+    size_t rank = workload->n_leaves * pow(workload->zipf_eta * uniform - workload->zipf_eta + 1, workload->zipf_alpha);
+    return rank < workload->n_leaves ? rank : workload->n_leaves - 1;
+}
+
+void workload_next(WorkloadStream* stream, WorkloadOp* op) {
+    const Workload* workload = stream->workload;
+    const WorkloadConfig* config = &workload->config;
+    unsigned draw = genRandLong(&stream->rand) % workload->mix_total;
+    op->type = WORKLOAD_LIST;
+    while (draw >= config->mix[op->type])
+        draw -= config->mix[op->type++];
+
+    size_t leaf = next_leaf(stream);
+    leaf_path(workload, leaf, op->type == WORKLOAD_LIST ? config->depth - 1 : config->depth, op->path);
+    if (op->type == WORKLOAD_MOVE)
+        leaf_path(workload, next_leaf(stream), config->depth, op->target);
+    else
+        op->target[0] = '\0';
+}
+
+int workload_run(Tree* tree, const WorkloadOp* op) {
+    switch (op->type) {
+        case WORKLOAD_LIST: {
+            char* list = tree_list(tree, op->path);
+            int result = list ? 0 : ENOENT;
+            free(list);
+            return result;
+        }
+        case WORKLOAD_CREATE:
+            return tree_create(tree, op->path);
+        case WORKLOAD_REMOVE:
+            return tree_remove(tree, op->path);
+        default:
+            return tree_move(tree, op->path, op->target);
+    }
+}
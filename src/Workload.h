@@ -0,0 +1,112 @@
+#pragma once
+
+#include "Tree.h"
+#include "mtwister.h"
+#include "path_utils.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Reproducible streams of tree operations, for benchmarks.
+ *
+ * The tree is a complete `fanout`-ary tree of the given depth. Its leaves form the key space: every
+ * operation draws a leaf (uniformly, or from a Zipfian distribution favouring the first leaves, which
+ * share their ancestors) and acts on it:
+ *   - list lists the parent of the leaf,
+ *   - create creates the leaf,
+ *   - remove removes the leaf,
+ *   - move moves the leaf onto a second drawn leaf.
+ * Every other leaf exists in the populated tree, so creates and removes succeed about half of the time,
+ * which is also where an even mix of them keeps the tree. Inner directories are never removed or moved.
+ *
+ * A workload hands out any number of independent streams. The operations of a stream depend only on
+ * the configuration and the index of the stream, so the same configuration run on the same number of
+ * threads issues the same operations from every thread, commit after commit. Only their interleaving,
+ * and thus their results, depend on scheduling.
+ */
+
+typedef enum WorkloadOpType {
+    WORKLOAD_LIST = 0,
+    WORKLOAD_CREATE,
+    WORKLOAD_REMOVE,
+    WORKLOAD_MOVE,
+
+    WORKLOAD_OP_TYPES
+} WorkloadOpType;
+
+/** Names of the operation types, for reports **/
+extern const char* const workload_op_names[WORKLOAD_OP_TYPES];
+
+typedef struct WorkloadConfig {
+    unsigned mix[WORKLOAD_OP_TYPES]; /** Relative frequencies of operations **/
+    size_t depth;                    /** Depth of the leaves, at least 1 **/
+    size_t fanout;                   /** Subdirectories of every inner directory **/
+    size_t name_length;              /** Length of every folder name **/
+    bool zipf;                       /** Whether leaves are drawn from a Zipfian distribution, not uniformly **/
+    double zipf_theta;               /** Skew of the Zipfian distribution, 0 < theta < 1 **/
+    uint32_t seed;                   /** Seed of all the streams **/
+} WorkloadConfig;
+
+typedef struct Workload Workload;
+
+/** A stream of operations, to be used by a single thread **/
+typedef struct WorkloadStream {
+    const Workload* workload;
+    MTRand rand;
+} WorkloadStream;
+
+/** An operation drawn from a stream **/
+typedef struct WorkloadOp {
+    WorkloadOpType type;
+    char path[MAX_PATH_LENGTH + 1];   /** Directory listed, created, removed, or the source of a move **/
+    char target[MAX_PATH_LENGTH + 1]; /** Target of a move, empty for the other operations **/
+} WorkloadOp;
+
+/**
+ * Creates a workload.
+ * @param config : configuration, copied
+ * @return : the workload, or NULL with errno set to EINVAL if the configuration is invalid
+ *           (no operations in the mix, a tree shape whose names or paths don't fit, more than 10^9 leaves,
+ *           or a skew out of range)
+ */
+Workload* workload_new(const WorkloadConfig* config);
+
+/**
+ * Frees a workload. Its streams must not be used anymore.
+ */
+void workload_free(Workload* workload);
+
+/**
+ * Returns the configuration of a workload.
+ */
+const WorkloadConfig* workload_config(const Workload* workload);
+
+/**
+ * Creates the initial tree of a workload: all the inner directories and every other leaf.
+ * @param workload : workload
+ * @return : the tree, to be freed with `tree_free`
+ */
+Tree* workload_populate(const Workload* workload);
+
+/**
+ * Initializes a stream of operations.
+ * @param stream : stream to initialize
+ * @param workload : workload to draw operations from
+ * @param index : index of the stream, usually of the thread using it
+ */
+void workload_stream_init(WorkloadStream* stream, const Workload* workload, size_t index);
+
+/**
+ * Draws the next operation of a stream.
+ * @param stream : stream
+ * @param op : filled in with the operation
+ */
+void workload_next(WorkloadStream* stream, WorkloadOp* op);
+
+/**
+ * Runs an operation on the tree.
+ * @param tree : tree
+ * @param op : operation
+ * @return : 0 if it succeeded, or the error code of the failed operation
+ */
+int workload_run(Tree* tree, const WorkloadOp* op);
@@ -0,0 +1,288 @@
+#include "WriteAheadLog.h"
+#include "fs_utils.h"
+#include "safe_allocations.h"
+#include "sync_utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** Capacity of a freshly allocated record buffer **/
+#define INITIAL_BUFFER_CAPACITY 4096
+
+/*
+ * A record is a `RecordHeader` followed by `payload_size` bytes of operations.
+ * An operation is its type (one byte), followed by the NUL-terminated path and, for moves,
+ * the NUL-terminated target.
+ */
+typedef struct RecordHeader {
+    uint32_t payload_size;
+    uint32_t checksum;  /** Checksum of the version and the payload **/
+    uint64_t version;
+} RecordHeader;
+
+/** A growable byte buffer **/
+typedef struct WalBuffer {
+    char* data;
+    size_t size, capacity;
+} WalBuffer;
+
+struct WriteAheadLog {
+    int fd;
+    pthread_mutex_t mutex;       /** Protects all the fields below **/
+    pthread_cond_t synced_cond;  /** Signalled whenever a sync finishes **/
+    WalBuffer appended;          /** Records appended, but not yet handed to a sync **/
+    WalBuffer spare;             /** Buffer to swap with `appended` when a sync takes its records **/
+    uint64_t appended_lsn;       /** Position in the log right after the last appended record **/
+    uint64_t durable_lsn;        /** Everything before this position is on stable storage **/
+    bool syncing;                /** Whether some writer is writing and syncing records right now **/
+    int error;                   /** First error of a write or sync. Once set, the log stays failed **/
+};
+
+/**
+ * Computes the checksum of a record (FNV-1a).
+ * @param version : version stored in the record
+ * @param payload : operations stored in the record
+ * @param size : size of the payload
+ * @return : the checksum
+ */
+static uint32_t record_checksum(uint64_t version, const char* payload, size_t size) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(version); i++)
+        hash = (hash ^ ((version >> (8 * i)) & 0xff)) * 16777619u;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ (unsigned char)payload[i]) * 16777619u;
+    return hash;
+}
+
+static void buffer_put(WalBuffer* buffer, const void* data, size_t size) {
+    if (buffer->size + size > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : INITIAL_BUFFER_CAPACITY;
+        while (buffer->size + size > capacity)
+            capacity *= 2;
+        buffer->data = safe_realloc(buffer->data, capacity);
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+}
+
+int wal_open(const char* path, WriteAheadLog** wal) {
+    uint64_t valid_length = 0;
+    int result = wal_read(path, NULL, NULL, &valid_length);
+    if (result != SUCCESS && result != ENOENT)
+        return result;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return errno;
+    if (valid_length == 0) {
+        // A new log, or one whose creation was interrupted before the header got to the disk
+        WalHeader header = { .magic = WAL_MAGIC, .format_version = WAL_FORMAT_VERSION };
+        valid_length = sizeof(header);
+        result = write_all_at(fd, (const char*)&header, sizeof(header), 0);
+        if (result == SUCCESS && ftruncate(fd, valid_length) != 0)
+            result = errno;
+        if (result == SUCCESS && fdatasync(fd) != 0)
+            result = errno;
+        if (result == SUCCESS)
+            result = sync_parent_directory(path);
+    }
+    else if (ftruncate(fd, valid_length) != 0 || fdatasync(fd) != 0) {
+        result = errno; // Cut off the torn record
+    }
+    if (result != SUCCESS) {
+        close(fd);
+        return result;
+    }
+
+    WriteAheadLog* log = safe_calloc(1, sizeof(WriteAheadLog));
+    log->fd = fd;
+    log->appended_lsn = log->durable_lsn = valid_length;
+    PTHREAD_CHECK(pthread_mutex_init(&log->mutex, NULL));
+    PTHREAD_CHECK(pthread_cond_init(&log->synced_cond, NULL));
+    *wal = log;
+    return SUCCESS;
+}
+
+uint64_t wal_append(WriteAheadLog* wal, uint64_t version, const WalOp* ops, size_t n_ops) {
+    uint64_t lsn = 0;
+    UNDER_MUTEX(&wal->mutex,
+        // The payload is encoded in place, right after a header filled in at the end.
+        size_t start = wal->appended.size;
+        RecordHeader header = { .version = version };
+        buffer_put(&wal->appended, &header, sizeof(header));
+        for (size_t i = 0; i < n_ops; i++) {
+            char type = (char)ops[i].type;
+            buffer_put(&wal->appended, &type, 1);
+            buffer_put(&wal->appended, ops[i].path, strlen(ops[i].path) + 1);
+            if (ops[i].type == WAL_MOVE)
+                buffer_put(&wal->appended, ops[i].target, strlen(ops[i].target) + 1);
+        }
+        size_t payload_size = wal->appended.size - start - sizeof(header);
+        if (payload_size > UINT32_MAX) {
+            // The size doesn't fit the header. The record is dropped, and with it the log's agreement
+            // with the tree, so the log fails; the returned position is never reached.
+            wal->appended.size = start;
+            if (wal->error == SUCCESS)
+                wal->error = EFBIG;
+            lsn = wal->appended_lsn + 1;
+        }
+        else {
+            const char* payload = wal->appended.data + start + sizeof(header);
+            header.payload_size = payload_size;
+            header.checksum = record_checksum(version, payload, payload_size);
+            memcpy(wal->appended.data + start, &header, sizeof(header));
+
+            wal->appended_lsn += wal->appended.size - start;
+            lsn = wal->appended_lsn;
+        }
+    );
+    return lsn;
+}
+
+int wal_sync(WriteAheadLog* wal, uint64_t lsn) {
+    PTHREAD_CHECK(pthread_mutex_lock(&wal->mutex));
+    while (wal->durable_lsn < lsn && wal->error == SUCCESS) {
+        if (wal->syncing) {
+            // Somebody else is syncing; our record is either in their batch or in the next one.
+            PTHREAD_CHECK(pthread_cond_wait(&wal->synced_cond, &wal->mutex));
+            continue;
+        }
+
+        // Become the leader: take every record appended so far and sync them all at once.
+        // Appends go on into the spare buffer meanwhile.
+        wal->syncing = true;
+        WalBuffer batch = wal->appended;
+        wal->appended = wal->spare;
+        wal->appended.size = 0;
+        uint64_t offset = wal->durable_lsn;
+        uint64_t end = wal->appended_lsn;
+
+        PTHREAD_CHECK(pthread_mutex_unlock(&wal->mutex));
+        int error = write_all_at(wal->fd, batch.data, batch.size, offset);
+        if (error == SUCCESS && fdatasync(wal->fd) != 0)
+            error = errno;
+        PTHREAD_CHECK(pthread_mutex_lock(&wal->mutex));
+
+        batch.size = 0;
+        wal->spare = batch;
+        wal->syncing = false;
+        if (error == SUCCESS)
+            wal->durable_lsn = end;
+        else
+            wal->error = error;
+        PTHREAD_CHECK(pthread_cond_broadcast(&wal->synced_cond));
+    }
+    int result = wal->durable_lsn >= lsn ? SUCCESS : wal->error;
+    PTHREAD_CHECK(pthread_mutex_unlock(&wal->mutex));
+    return result;
+}
+
+int wal_close(WriteAheadLog* wal) {
+    uint64_t lsn = 0;
+    UNDER_MUTEX(&wal->mutex, lsn = wal->appended_lsn);
+    int result = wal_sync(wal, lsn);
+    close(wal->fd);
+    free(wal->appended.data);
+    free(wal->spare.data);
+    PTHREAD_CHECK(pthread_cond_destroy(&wal->synced_cond));
+    PTHREAD_CHECK(pthread_mutex_destroy(&wal->mutex));
+    free(wal);
+    return result;
+}
+
+/**
+ * Decodes the operations of a record.
+ * @param payload : encoded operations
+ * @param size : size of the payload
+ * @param ops : pointer to a malloc'd array of operations, grown as needed
+ * @param capacity : pointer to the length of the array
+ * @return : number of operations, or 0 if the payload is malformed
+ */
+static size_t decode_ops(const char* payload, size_t size, WalOp** ops, size_t* capacity) {
+    size_t n_ops = 0;
+    const char* end = payload + size;
+    while (payload < end) {
+        if (n_ops == *capacity) {
+            *capacity = *capacity ? 2 * *capacity : 16;
+            *ops = safe_realloc(*ops, *capacity * sizeof(WalOp));
+        }
+        WalOp* op = &(*ops)[n_ops++];
+        op->type = (WalOpType)*payload++;
+        if (op->type != WAL_CREATE && op->type != WAL_REMOVE && op->type != WAL_MOVE)
+            return 0;
+
+        const char* nul = memchr(payload, '\0', end - payload);
+        if (!nul)
+            return 0;
+        op->path = payload;
+        payload = nul + 1;
+
+        op->target = NULL;
+        if (op->type == WAL_MOVE) {
+            if (!(nul = memchr(payload, '\0', end - payload)))
+                return 0;
+            op->target = payload;
+            payload = nul + 1;
+        }
+    }
+    return n_ops;
+}
+
+int wal_read(const char* path, wal_record_fn callback, void* arg, uint64_t* valid_length) {
+    if (valid_length)
+        *valid_length = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int error = errno;
+        close(fd);
+        return error;
+    }
+    size_t size = st.st_size;
+    if (size < sizeof(WalHeader)) {
+        close(fd);
+        return SUCCESS; // The log was never completely created, so it holds no records
+    }
+    char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int result = data == MAP_FAILED ? errno : SUCCESS;
+    close(fd);
+    if (result != SUCCESS)
+        return result;
+
+    const WalHeader* header = (const WalHeader*)data;
+    if (memcmp(header->magic, WAL_MAGIC, sizeof(WAL_MAGIC)) != 0 || header->format_version != WAL_FORMAT_VERSION) {
+        munmap(data, size);
+        return EINVAL;
+    }
+
+    WalOp* ops = NULL;
+    size_t capacity = 0, position = sizeof(WalHeader);
+    while (result == SUCCESS && size - position >= sizeof(RecordHeader)) {
+        RecordHeader record;
+        memcpy(&record, data + position, sizeof(record));
+        const char* payload = data + position + sizeof(record);
+        if (record.payload_size == 0 || record.payload_size > size - position - sizeof(record)
+            || record.checksum != record_checksum(record.version, payload, record.payload_size))
+            break; // A torn record ends the log
+
+        size_t n_ops = decode_ops(payload, record.payload_size, &ops, &capacity);
+        if (n_ops == 0)
+            break;
+        if (callback)
+            result = callback(arg, record.version, ops, n_ops);
+        position += sizeof(record) + record.payload_size;
+    }
+    if (valid_length)
+        *valid_length = position;
+
+    free(ops);
+    munmap(data, size);
+    return result;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Write-ahead log of tree modifications.
+ *
+ * The log is a file starting with a `WalHeader`, followed by records. A record describes one
+ * modification of the tree (a single operation, or all the operations of a write transaction)
+ * together with the version it stamped the tree with. Every record carries a checksum, so a record
+ * torn by a crash is recognized, and the log is considered to end right before it.
+ *
+ * Appending a record only copies it to a buffer, which is cheap enough to be done while the modified
+ * directories are locked, so the order of records agrees with the order of conflicting modifications.
+ * Making it durable is a separate step, taken after the locks are released: the first writer to ask
+ * writes out the records of everyone waiting and syncs them with a single fdatasync (group commit).
+ */
+
+/** Identifies log files **/
+#define WAL_MAGIC "DIRTWAL"
+
+/** Version of the log format **/
+#define WAL_FORMAT_VERSION 1
+
+typedef struct WalHeader {
+    char magic[8];           /** WAL_MAGIC, NUL-padded **/
+    uint32_t format_version; /** WAL_FORMAT_VERSION **/
+    uint32_t reserved;
+} WalHeader;
+
+/** Kinds of logged operations **/
+typedef enum WalOpType {
+    WAL_CREATE = 1,
+    WAL_REMOVE = 2,
+    WAL_MOVE = 3
+} WalOpType;
+
+/** A logged operation **/
+typedef struct WalOp {
+    WalOpType type;
+    const char* path;   /** Directory created / removed, or the source of a move **/
+    const char* target; /** Target of a move. NULL for the other operations **/
+} WalOp;
+
+typedef struct WriteAheadLog WriteAheadLog;
+
+/**
+ * Opens a log for appending, creating it if it doesn't exist.
+ * A torn record at the end of the log, if any, is cut off.
+ * @param path : path to the log file
+ * @param wal : set to the opened log on success
+ * @return : 0 on success, EINVAL if the file is not a log, or the errno of a failed system call
+ */
+int wal_open(const char* path, WriteAheadLog** wal);
+
+/**
+ * Appends a record to the log buffer.
+ * @param wal : log
+ * @param version : version the modification stamped the tree with
+ * @param ops : operations of the modification
+ * @param n_ops : number of operations
+ * @return : position in the log right after the record, to be passed to `wal_sync`.
+ *           A record whose operations take more than UINT32_MAX bytes is not appended; the log fails
+ *           with EFBIG instead, reported by `wal_sync`
+ */
+uint64_t wal_append(WriteAheadLog* wal, uint64_t version, const WalOp* ops, size_t n_ops);
+
+/**
+ * Waits until the log is durable up to the given position, writing and syncing it if nobody else is.
+ * @param wal : log
+ * @param lsn : position returned by `wal_append`
+ * @return : 0 on success, or the errno of a failed write or sync. Errors are sticky: once the log
+ *           fails, all following calls fail as well
+ */
+int wal_sync(WriteAheadLog* wal, uint64_t lsn);
+
+/**
+ * Makes everything appended so far durable and closes the log.
+ * @param wal : log
+ * @return : the result of the final `wal_sync`
+ */
+int wal_close(WriteAheadLog* wal);
+
+/**
+ * Called for every record of a log being read.
+ * @param arg : argument passed to `wal_read`
+ * @param version : version the modification stamped the tree with
+ * @param ops : operations of the modification. The strings are only valid during the call
+ * @param n_ops : number of operations
+ * @return : 0 to continue reading, anything else to stop and return it from `wal_read`
+ */
+typedef int (*wal_record_fn)(void* arg, uint64_t version, const WalOp* ops, size_t n_ops);
+
+/**
+ * Reads all the intact records of a log, in order.
+ * @param path : path to the log file
+ * @param callback : function called for every record, may be NULL
+ * @param arg : argument passed to `callback`
+ * @param valid_length : if not NULL, set to the length of the intact part of the log
+ * @return : 0 on success, EINVAL if the file is not a log, the errno of a failed system call,
+ *           or the non-zero value returned by `callback`
+ */
+int wal_read(const char* path, wal_record_fn callback, void* arg, uint64_t* valid_length);
@@ -0,0 +1,40 @@
+#include "front_coding.h"
+#include "path_utils.h"
+#include <string.h>
+
+/** Length of the prefix shared by the two names **/
+static size_t shared_prefix(const char* previous, const char* name) {
+    size_t shared = 0;
+    if (previous) {
+        while (previous[shared] != '\0' && previous[shared] == name[shared])
+            shared++;
+    }
+    return shared;
+}
+
+size_t front_encoded_size(const char* previous, const char* name) {
+    size_t shared = shared_prefix(previous, name);
+    return 2 + strlen(name + shared);
+}
+
+size_t front_encode(const char* previous, const char* name, char* out) {
+    size_t shared = shared_prefix(previous, name);
+    size_t suffix = strlen(name + shared);
+    out[0] = (char)shared;
+    out[1] = (char)suffix;
+    memcpy(out + 2, name + shared, suffix);
+    return 2 + suffix;
+}
+
+size_t front_decode(const char* entry, size_t available, char* name, size_t* length) {
+    if (available < 2)
+        return 0;
+    size_t shared = (unsigned char)entry[0];
+    size_t suffix = (unsigned char)entry[1];
+    if (shared > *length || suffix > available - 2 || shared + suffix > MAX_FOLDER_NAME_LENGTH)
+        return 0;
+    memcpy(name + shared, entry + 2, suffix);
+    name[shared + suffix] = '\0';
+    *length = shared + suffix;
+    return 2 + suffix;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * Front coding of sorted folder names.
+ *
+ * Consecutive names in lexicographic order tend to share long prefixes (`file000001`, `file000002`, ...),
+ * so each name is stored as the length of the prefix it shares with the name before it, followed by
+ * the rest of it. An entry is:
+ *   - the length of the shared prefix (one byte),
+ *   - the length of the remaining suffix (one byte),
+ *   - the suffix itself, without a terminating NUL.
+ * The first name of a sequence is stored whole, with an empty shared prefix.
+ * Folder names are at most MAX_FOLDER_NAME_LENGTH (255) characters long, so both lengths fit in a byte.
+ */
+
+/** Maximum size of an encoded entry **/
+#define FRONT_CODED_MAX_ENTRY (2 + 255)
+
+/**
+ * Computes the size of the entry of a name, without encoding it.
+ * @param previous : name preceding `name` in the sequence, or NULL if `name` is the first one
+ * @param name : name to encode
+ * @return : size of the entry `front_encode` would write
+ */
+size_t front_encoded_size(const char* previous, const char* name);
+
+/**
+ * Encodes a name relative to the name before it.
+ * @param previous : name preceding `name` in the sequence, or NULL if `name` is the first one
+ * @param name : name to encode, at most MAX_FOLDER_NAME_LENGTH characters long
+ * @param out : buffer of at least FRONT_CODED_MAX_ENTRY bytes
+ * @return : size of the entry written to `out`
+ */
+size_t front_encode(const char* previous, const char* name, char* out);
+
+/**
+ * Decodes an entry, turning the previous name into the encoded one in place.
+ * @param entry : start of the entry
+ * @param available : number of bytes readable from `entry`
+ * @param name : buffer of at least MAX_FOLDER_NAME_LENGTH + 1 bytes holding the previous name.
+ *               Overwritten with the decoded, NUL-terminated name
+ * @param length : pointer to the length of the previous name (0 for the first entry of a sequence),
+ *                 set to the length of the decoded name
+ * @return : size of the entry, or 0 if it is malformed (it runs past `available`,
+ *           or shares more than the previous name has)
+ */
+size_t front_decode(const char* entry, size_t available, char* name, size_t* length);
@@ -0,0 +1,34 @@
+#include "fs_utils.h"
+#include "safe_allocations.h"
+#include "sync_utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <unistd.h>
+
+int write_all_at(int fd, const char* data, size_t size, uint64_t offset) {
+    while (size > 0) {
+        ssize_t written = pwrite(fd, data, size, offset);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+    return SUCCESS;
+}
+
+int sync_parent_directory(const char* path) {
+    char* copy = strdup(path);
+    CHECK_POINTER(copy);
+    int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(copy);
+    if (fd < 0)
+        return errno;
+    int result = fsync(fd) == 0 ? SUCCESS : errno;
+    close(fd);
+    return result;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Writes all of the data at the given position in the file, retrying short and interrupted writes.
+ * @param fd : file descriptor open for writing
+ * @param data : data to write
+ * @param size : size of the data
+ * @param offset : position in the file
+ * @return : success, or the errno of the failed write
+ */
+int write_all_at(int fd, const char* data, size_t size, uint64_t offset);
+
+/**
+ * Syncs the directory containing the file, so that a newly created or renamed file survives a crash.
+ * @param path : path to the file
+ * @return : success, or the errno of the failed system call
+ */
+int sync_parent_directory(const char* path);
@@ -0,0 +1,443 @@
+#include "HashMap.h"
+#include "err.h"
+#include "mtwister.h"
+#include "safe_allocations.h"
+#include <errno.h>
+#include <getopt.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Single-threaded microbenchmarks of HashMap, for every combination of map size and key length:
+ *   - insert: building a map out of an empty one, growth included,
+ *   - get: lookups of present and absent keys, at each hit ratio,
+ *   - iterate: walking the whole map with `hmap_next`, per element,
+ *   - remove: emptying a map,
+ *   - churn: removing a random present key and inserting a random absent one, at a steady size.
+ * Keys are random lowercase names, like folder names, distinct in their last characters.
+ * All keys and access orders are generated before timing.
+ *
+ * Besides time per operation, hardware counters (cycles, instructions, L1 data cache read misses and
+ * last-level cache misses) are read through perf_event_open, if the system allows it. Counters which
+ * can't be opened are reported as null.
+ *
+ * The results are printed to the standard output as a single JSON object.
+ */
+
+/** Hardware counters, reported per operation **/
+typedef enum Counter {
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_L1D_MISSES,
+    COUNTER_CACHE_MISSES,
+
+    NUM_COUNTERS
+} Counter;
+
+static const char* counter_names[NUM_COUNTERS] = { "cycles", "instructions", "l1d_read_misses", "cache_misses" };
+
+/** Counters of the calling thread, -1 if unavailable **/
+static int counter_fds[NUM_COUNTERS];
+
+/** The result of timing a benchmark **/
+typedef struct Measurement {
+    uint64_t ns;
+    uint64_t ops;
+} Measurement;
+
+typedef struct BenchConfig {
+    size_t* sizes;
+    size_t n_sizes;
+    size_t* key_lengths;
+    size_t n_key_lengths;
+    double* hit_ratios;
+    size_t n_hit_ratios;
+    size_t min_ops;          /** Least number of operations timed per benchmark **/
+    size_t max_key_bytes;    /** Combinations whose keys would take more memory are skipped **/
+    uint32_t seed;
+} BenchConfig;
+
+/** Values stored in the maps. Their contents don't matter, they only need to be non-NULL **/
+static char value;
+
+/** Keeps the compiler from optimizing lookups away **/
+static volatile uintptr_t sink;
+
+static bool first_result = true;
+
+static void open_counters() {
+    static const struct { uint32_t type; uint64_t config; } events[NUM_COUNTERS] = {
+        [COUNTER_CYCLES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        [COUNTER_INSTRUCTIONS] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        [COUNTER_L1D_MISSES] = { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                                                     | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+        [COUNTER_CACHE_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    };
+    for (size_t c = 0; c < NUM_COUNTERS; c++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[c].type;
+        attr.config = events[c].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        counter_fds[c] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+}
+
+static void reset_counters() {
+    for (size_t c = 0; c < NUM_COUNTERS; c++) {
+        if (counter_fds[c] >= 0)
+            ioctl(counter_fds[c], PERF_EVENT_IOC_RESET, 0);
+    }
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/** Starts timing a part of a benchmark. Returns the start time, to be passed to `measure_end` **/
+static uint64_t measure_begin() {
+    for (size_t c = 0; c < NUM_COUNTERS; c++) {
+        if (counter_fds[c] >= 0)
+            ioctl(counter_fds[c], PERF_EVENT_IOC_ENABLE, 0);
+    }
+    return now_ns();
+}
+
+/** Stops timing a part of a benchmark, adding it to the measurement **/
+static void measure_end(Measurement* measurement, uint64_t start, size_t ops) {
+    uint64_t end = now_ns();
+    for (size_t c = 0; c < NUM_COUNTERS; c++) {
+        if (counter_fds[c] >= 0)
+            ioctl(counter_fds[c], PERF_EVENT_IOC_DISABLE, 0);
+    }
+    measurement->ns += end - start;
+    measurement->ops += ops;
+}
+
+static void print_result(const char* benchmark, size_t size, size_t key_length, double hit_ratio,
+                         const Measurement* measurement) {
+    printf("%s    {\"benchmark\": \"%s\", \"size\": %zu, \"key_length\": %zu", first_result ? "" : ",\n",
+           benchmark, size, key_length);
+    first_result = false;
+    if (hit_ratio >= 0)
+        printf(", \"hit_ratio\": %.3f", hit_ratio);
+    double ops = measurement->ops;
+    printf(", \"ops\": %llu, \"ns_per_op\": %.2f", (unsigned long long)measurement->ops, measurement->ns / ops);
+    for (size_t c = 0; c < NUM_COUNTERS; c++) {
+        uint64_t count;
+        if (counter_fds[c] >= 0 && read(counter_fds[c], &count, sizeof(count)) == sizeof(count))
+            printf(", \"%s_per_op\": %.3f", counter_names[c], count / ops);
+        else
+            printf(", \"%s_per_op\": null", counter_names[c]);
+    }
+    printf("}");
+    fflush(stdout);
+    reset_counters();
+}
+
+/** Shuffles an array of pointers (Fisher-Yates) **/
+static void shuffle(char** items, size_t count, MTRand* rand) {
+    for (size_t i = count; i > 1; i--) {
+        size_t j = genRandLong(rand) % i;
+        char* item = items[i - 1];
+        items[i - 1] = items[j];
+        items[j] = item;
+    }
+}
+
+/**
+ * Generates distinct keys. The last `width` characters of the i-th key spell i in base 26;
+ * the characters before them are random.
+ * @param count : number of keys, at least 1
+ * @return : malloc'd array of keys, all stored in one malloc'd block starting at `keys[0]`
+ */
+static char** make_keys(size_t count, size_t length, size_t width, MTRand* rand) {
+    char** keys = safe_malloc(count * sizeof(char*));
+    char* block = safe_malloc(count * (length + 1) + 1);
+    for (size_t i = 0; i < count; i++) {
+        char* key = block + i * (length + 1);
+        for (size_t c = 0; c < length - width; c++)
+            key[c] = 'a' + genRandLong(rand) % 26;
+        size_t n = i;
+        for (size_t c = length; c > length - width; c--) {
+            key[c - 1] = 'a' + n % 26;
+            n /= 26;
+        }
+        key[length] = '\0';
+        keys[i] = key;
+    }
+    return keys;
+}
+
+static void free_keys(char** keys) {
+    free(keys[0]);
+    free(keys);
+}
+
+static HashMap* build_map(char** keys, size_t count) {
+    HashMap* map = hmap_new();
+    CHECK_POINTER(map);
+    for (size_t i = 0; i < count; i++)
+        hmap_insert(map, keys[i], &value);
+    return map;
+}
+
+static void bench_insert(const BenchConfig* config, char** keys, size_t size, size_t key_length) {
+    Measurement measurement = { 0 };
+    while (measurement.ops < config->min_ops) {
+        HashMap* map = hmap_new();
+        CHECK_POINTER(map);
+        uint64_t start = measure_begin();
+        for (size_t i = 0; i < size; i++)
+            hmap_insert(map, keys[i], &value);
+        measure_end(&measurement, start, size);
+        hmap_free(map);
+    }
+    print_result("insert", size, key_length, -1, &measurement);
+}
+
+static void bench_get(const BenchConfig* config, HashMap* map, char** keys, char** absent, size_t size,
+                      size_t key_length, double hit_ratio, MTRand* rand) {
+    size_t n_queries = config->min_ops;
+    char** queries = safe_malloc(n_queries * sizeof(char*));
+    for (size_t i = 0; i < n_queries; i++) {
+        bool hit = genRand(rand) < hit_ratio;
+        queries[i] = hit ? keys[genRandLong(rand) % size] : absent[size ? genRandLong(rand) % size : 0];
+    }
+    Measurement measurement = { 0 };
+    uintptr_t found = 0;
+    uint64_t start = measure_begin();
+    for (size_t i = 0; i < n_queries; i++)
+        found += (uintptr_t)hmap_get(map, queries[i]);
+    measure_end(&measurement, start, n_queries);
+    sink = found;
+    free(queries);
+    print_result("get", size, key_length, hit_ratio, &measurement);
+}
+
+static void bench_iterate(const BenchConfig* config, HashMap* map, size_t size, size_t key_length) {
+    Measurement measurement = { 0 };
+    uintptr_t visited = 0;
+    do {
+        const char* key;
+        void* item;
+        size_t count = 0;
+        uint64_t start = measure_begin();
+        HashMapIterator it = hmap_iterator(map);
+        while (hmap_next(map, &it, &key, &item)) {
+            visited += (uintptr_t)key;
+            count++;
+        }
+        measure_end(&measurement, start, count);
+    } while (measurement.ops < config->min_ops);
+    sink = visited;
+    print_result("iterate", size, key_length, -1, &measurement);
+}
+
+static void bench_remove(const BenchConfig* config, char** keys, size_t size, size_t key_length, MTRand* rand) {
+    Measurement measurement = { 0 };
+    while (measurement.ops < config->min_ops) {
+        HashMap* map = build_map(keys, size);
+        shuffle(keys, size, rand);
+        uint64_t start = measure_begin();
+        for (size_t i = 0; i < size; i++)
+            hmap_remove(map, keys[i]);
+        measure_end(&measurement, start, size);
+        hmap_free(map);
+    }
+    print_result("remove", size, key_length, -1, &measurement);
+}
+
+static void bench_churn(const BenchConfig* config, char** keys, char** absent, size_t size, size_t key_length,
+                        MTRand* rand) {
+    // present[0, size) are in the map, present[size, 2 * size) are not. Each step swaps a random key
+    // of each half, so the draws can be made up front.
+    char** present = safe_malloc(2 * size * sizeof(char*));
+    memcpy(present, keys, size * sizeof(char*));
+    memcpy(present + size, absent, size * sizeof(char*));
+    HashMap* map = build_map(keys, size);
+
+    size_t n_steps = config->min_ops / 2;
+    uint32_t* draws = safe_malloc(2 * n_steps * sizeof(uint32_t));
+    for (size_t i = 0; i < 2 * n_steps; i++)
+        draws[i] = genRandLong(rand) % size;
+
+    Measurement measurement = { 0 };
+    uint64_t start = measure_begin();
+    for (size_t i = 0; i < n_steps; i++) {
+        char** out = &present[draws[2 * i]];
+        char** in = &present[size + draws[2 * i + 1]];
+        hmap_remove(map, *out);
+        hmap_insert(map, *in, &value);
+        char* swap = *out;
+        *out = *in;
+        *in = swap;
+    }
+    measure_end(&measurement, start, 2 * n_steps);
+    print_result("churn", size, key_length, -1, &measurement);
+
+    hmap_free(map);
+    free(draws);
+    free(present);
+}
+
+static void run_benchmarks(const BenchConfig* config, size_t size, size_t key_length) {
+    // Enough base-26 digits to tell apart the present keys and as many absent ones.
+    size_t width = 1;
+    for (size_t n = 26; n < 2 * size && width <= key_length; n *= 26)
+        width++;
+    if (width > key_length || 2 * size * (key_length + 1) > config->max_key_bytes) {
+        fprintf(stderr, "Skipping size %zu with keys of length %zu\n", size, key_length);
+        return;
+    }
+
+    // Halves of a shuffled array of all keys: the present keys and the absent ones.
+    // An empty map still gets one absent key to look up.
+    size_t n_keys = size ? 2 * size : 1;
+    MTRand rand = seedRand(config->seed);
+    char** all_keys = make_keys(n_keys, key_length, width, &rand);
+    char** order = safe_malloc(n_keys * sizeof(char*));
+    memcpy(order, all_keys, n_keys * sizeof(char*));
+    shuffle(order, n_keys, &rand);
+    char** keys = order;
+    char** absent = order + size;
+
+    if (size > 0)
+        bench_insert(config, keys, size, key_length);
+    HashMap* map = build_map(keys, size);
+    if (size == 0) {
+        bench_get(config, map, keys, absent, size, key_length, 0, &rand);
+    } else {
+        for (size_t r = 0; r < config->n_hit_ratios; r++)
+            bench_get(config, map, keys, absent, size, key_length, config->hit_ratios[r], &rand);
+        bench_iterate(config, map, size, key_length);
+    }
+    hmap_free(map);
+    if (size > 0) {
+        bench_remove(config, keys, size, key_length, &rand);
+        bench_churn(config, keys, absent, size, key_length, &rand);
+    }
+
+    free(order);
+    free_keys(all_keys);
+}
+
+/** Parses a comma-separated list of numbers into a malloc'd array **/
+static size_t parse_list(const char* text, double** values) {
+    size_t count = 0;
+    *values = NULL;
+    const char* position = text;
+    while (*position) {
+        char* end;
+        double number = strtod(position, &end);
+        if (end == position || (*end != ',' && *end != '\0'))
+            fatal("invalid list: %s", text);
+        *values = safe_realloc(*values, (count + 1) * sizeof(double));
+        (*values)[count++] = number;
+        position = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+static size_t parse_size_list(const char* text, size_t** values) {
+    double* numbers;
+    size_t count = parse_list(text, &numbers);
+    *values = safe_malloc((count ? count : 1) * sizeof(size_t));
+    for (size_t i = 0; i < count; i++) {
+        if (numbers[i] < 0)
+            fatal("invalid list: %s", text);
+        (*values)[i] = numbers[i];
+    }
+    free(numbers);
+    return count;
+}
+
+static void usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -s, --sizes LIST         map sizes (default: 0,1,10,100,1000,10000,100000,1000000)\n"
+            "  -k, --key-lengths LIST   key lengths, from 1 to 255 (default: 1,8,32,255)\n"
+            "  -r, --hit-ratios LIST    fractions of lookups of present keys (default: 1,0.5,0)\n"
+            "  -o, --min-ops N          least number of operations timed per benchmark (default: 1000000)\n"
+            "  -m, --max-key-mb N       skip combinations whose keys take more memory (default: 1024)\n"
+            "  -S, --seed N             seed of the generated keys and orders (default: 1)\n",
+            program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+    static const struct option options[] = {
+        { "sizes", required_argument, NULL, 's' },
+        { "key-lengths", required_argument, NULL, 'k' },
+        { "hit-ratios", required_argument, NULL, 'r' },
+        { "min-ops", required_argument, NULL, 'o' },
+        { "max-key-mb", required_argument, NULL, 'm' },
+        { "seed", required_argument, NULL, 'S' },
+        { NULL, 0, NULL, 0 },
+    };
+    BenchConfig config = { .min_ops = 1000000, .max_key_bytes = 1024ull << 20, .seed = 1 };
+    const char* sizes = "0,1,10,100,1000,10000,100000,1000000";
+    const char* key_lengths = "1,8,32,255";
+    const char* hit_ratios = "1,0.5,0";
+    int c;
+    while ((c = getopt_long(argc, argv, "s:k:r:o:m:S:", options, NULL)) != -1) {
+        switch (c) {
+            case 's': sizes = optarg; break;
+            case 'k': key_lengths = optarg; break;
+            case 'r': hit_ratios = optarg; break;
+            case 'o': config.min_ops = strtoul(optarg, NULL, 10); break;
+            case 'm': config.max_key_bytes = strtoull(optarg, NULL, 10) << 20; break;
+            case 'S': config.seed = strtoul(optarg, NULL, 10); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc)
+        usage(argv[0]);
+    config.n_sizes = parse_size_list(sizes, &config.sizes);
+    config.n_key_lengths = parse_size_list(key_lengths, &config.key_lengths);
+    config.n_hit_ratios = parse_list(hit_ratios, &config.hit_ratios);
+    for (size_t i = 0; i < config.n_key_lengths; i++) {
+        if (config.key_lengths[i] < 1 || config.key_lengths[i] > 255)
+            fatal("key lengths must be from 1 to 255");
+    }
+    for (size_t i = 0; i < config.n_hit_ratios; i++) {
+        if (config.hit_ratios[i] < 0 || config.hit_ratios[i] > 1)
+            fatal("hit ratios must be from 0 to 1");
+    }
+    if (config.min_ops < 2)
+        fatal("at least 2 operations per benchmark are needed");
+
+    open_counters();
+    bool counters = false;
+    for (size_t c = 0; c < NUM_COUNTERS; c++)
+        counters |= counter_fds[c] >= 0;
+    reset_counters();
+
+    printf("{\n  \"perf_counters\": %s,\n  \"results\": [\n", counters ? "true" : "false");
+    for (size_t s = 0; s < config.n_sizes; s++) {
+        for (size_t k = 0; k < config.n_key_lengths; k++)
+            run_benchmarks(&config, config.sizes[s], config.key_lengths[k]);
+    }
+    printf("\n  ]\n}\n");
+
+    for (size_t c = 0; c < NUM_COUNTERS; c++) {
+        if (counter_fds[c] >= 0)
+            close(counter_fds[c]);
+    }
+    free(config.sizes);
+    free(config.key_lengths);
+    free(config.hit_ratios);
+    return 0;
+}
@@ -1,10 +1,13 @@
 #include "Tree.h"
+#include "mtwister.h"
 #include <stdarg.h>
 #include <stdlib.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <assert.h>
+#include <stdatomic.h>
 #include <string.h>
+#include <time.h>
 
 #define TEST_DIR_COUNT 3
 #define COUNT_OF(arr) ((sizeof(arr)/sizeof(arr[0])) / ((size_t)(!(sizeof(arr) % sizeof(arr[0])))))
@@ -34,6 +37,8 @@ const char *dir_names[] = {"/a/", "/b/", "/c/", "/d/", "/e/", "/f/",
 const char *example_paths[] = {"/a/", "/b/", "/a/b/", "/b/a/", "/b/a/d/", "/a/b/c/", "/a/b/d/"};
 Tree *tree = NULL;
 pthread_mutex_t mutex;
+uint32_t seed;
+atomic_uint next_thread;
 
 /* ------------------------------ Helper functions ------------------------------ */
 static void init_mutex(pthread_mutex_t *mtx) {
@@ -62,6 +67,11 @@ static void log_with_thread_name(const char *fmt, ...) {
     assert(pthread_mutex_unlock(&mutex) == 0);
 }
 
+/* Every thread draws from its own generator, seeded from `seed` and the order in which threads asked for it. */
+static MTRand thread_rand() {
+    return seedRand(seed + atomic_fetch_add(&next_thread, 1));
+}
+
 static inline void init_example_tree() {
     tree = tree_new();
     for (size_t i = 0; i < COUNT_OF(example_paths); i++) {
@@ -71,7 +81,8 @@ static inline void init_example_tree() {
 
 /* ------------------------------ Runnables ------------------------------ */
 static void* runnable_list(void* ignored) {
-    size_t i = rand() % 2;
+    MTRand rand = thread_rand();
+    size_t i = genRandLong(&rand) % 2;
 
     char *str = tree_list(tree, dir_names[i]);
 
@@ -87,7 +98,8 @@ static void* runnable_list(void* ignored) {
 }
 
 static void* runnable_create(void* ignored) {
-    size_t i = rand() % TEST_DIR_COUNT;
+    MTRand rand = thread_rand();
+    size_t i = genRandLong(&rand) % TEST_DIR_COUNT;
 
     if (tree_create(tree, dir_names[i]) == 0) {
         log_with_thread_name("Successfully created directory: %s", dir_names[i]);
@@ -100,7 +112,8 @@ static void* runnable_create(void* ignored) {
 }
 
 static void* runnable_remove(void* ignored) {
-    size_t i = rand() % TEST_DIR_COUNT;
+    MTRand rand = thread_rand();
+    size_t i = genRandLong(&rand) % TEST_DIR_COUNT;
 
     if (tree_remove(tree, dir_names[i]) == 0) {
         log_with_thread_name("Successfully removed directory: %s", dir_names[i]);
@@ -225,7 +238,8 @@ void TEST_tree_move_example() {
 int main(void) {
     init_mutex(&mutex);
 
-    srand(time(NULL));
+    seed = time(NULL);
+    printf("Seed: %u\n", seed);
 
     /* Sequential tests */
     TEST_tree_move_example();
@@ -0,0 +1,76 @@
+#include "mem_stats.h"
+#include "safe_allocations.h"
+#include "sync_utils.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+/** Counters of a single thread. Only the owning thread writes them, so plain loads and stores suffice **/
+typedef struct MemCounters {
+    struct MemCounters* next;           /** Next counters in `all_counters` **/
+    atomic_bool in_use;                 /** Whether a running thread owns the counters **/
+    atomic_int_least64_t bytes[MEM_CATEGORIES];
+    atomic_int_least64_t allocations[MEM_CATEGORIES];
+} MemCounters;
+
+/** Counters of all threads which ever accounted for memory. Never freed **/
+static _Atomic(MemCounters*) all_counters;
+
+static _Thread_local MemCounters* thread_counters;
+
+/** Releases the counters of an exiting thread **/
+static pthread_key_t exit_key;
+static pthread_once_t exit_key_once = PTHREAD_ONCE_INIT;
+
+static void release_counters(void* counters) {
+    atomic_store_explicit(&((MemCounters*)counters)->in_use, false, memory_order_release);
+}
+
+static void create_exit_key() {
+    PTHREAD_CHECK(pthread_key_create(&exit_key, release_counters));
+}
+
+/** Takes over the counters of an exited thread, or registers new ones **/
+static MemCounters* attach_counters() {
+    MemCounters* counters = NULL;
+    for (MemCounters* c = atomic_load(&all_counters); c; c = c->next) {
+        bool expected = false;
+        if (!atomic_load_explicit(&c->in_use, memory_order_relaxed)
+            && atomic_compare_exchange_strong_explicit(&c->in_use, &expected, true, memory_order_acquire,
+                                                       memory_order_relaxed)) {
+            counters = c;
+            break;
+        }
+    }
+    if (!counters) {
+        counters = safe_calloc(1, sizeof(MemCounters));
+        atomic_init(&counters->in_use, true);
+        counters->next = atomic_load(&all_counters);
+        while (!atomic_compare_exchange_weak(&all_counters, &counters->next, counters))
+            ;
+    }
+    PTHREAD_CHECK(pthread_once(&exit_key_once, create_exit_key));
+    PTHREAD_CHECK(pthread_setspecific(exit_key, counters));
+    thread_counters = counters;
+    return counters;
+}
+
+static inline void add(atomic_int_least64_t* counter, int64_t delta) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + delta, memory_order_relaxed);
+}
+
+void mem_account(MemCategory category, int64_t bytes, int64_t allocations) {
+    MemCounters* counters = thread_counters ? thread_counters : attach_counters();
+    add(&counters->bytes[category], bytes);
+    add(&counters->allocations[category], allocations);
+}
+
+void mem_totals(MemTotals* totals) {
+    *totals = (MemTotals) { 0 };
+    for (MemCounters* c = atomic_load(&all_counters); c; c = c->next) {
+        for (size_t category = 0; category < MEM_CATEGORIES; category++) {
+            totals->bytes[category] += atomic_load_explicit(&c->bytes[category], memory_order_relaxed);
+            totals->allocations[category] += atomic_load_explicit(&c->allocations[category], memory_order_relaxed);
+        }
+    }
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Process-wide accounting of the memory held by trees and their maps (see `tree_memory_stats`).
+ * Every thread keeps counters of its own, updated without atomic read-modify-writes or shared
+ * cache lines; reading the totals sums the counters of all threads. The counters of a thread
+ * which exits are taken over by the next new thread, so they are never lost.
+ * Bytes are the sizes requested from the allocator, which adds its own overhead to every allocation.
+ */
+
+/** Kinds of accounted memory **/
+typedef enum MemCategory {
+    MEM_NODES,      /** `Tree` structs **/
+    MEM_HISTOGRAMS, /** Height histograms of nodes **/
+    MEM_MAPS,       /** `HashMap` structs **/
+    MEM_BUCKETS,    /** Bucket arrays of maps which have grown **/
+    MEM_PAIRS,      /** Key-value pairs of maps **/
+    MEM_KEYS,       /** Keys of maps and of sorted indexes. Those of maps share the allocations of their pairs **/
+    MEM_INDEXES,    /** `SortedIndex` structs and arrays **/
+
+    MEM_CATEGORIES
+} MemCategory;
+
+/** Totals of all threads **/
+typedef struct MemTotals {
+    int64_t bytes[MEM_CATEGORIES];       /** Bytes held, by category **/
+    int64_t allocations[MEM_CATEGORIES]; /** Live allocations, by category **/
+} MemTotals;
+
+/**
+ * Accounts for memory allocated or freed by the calling thread.
+ * @param category : kind of memory
+ * @param bytes : bytes allocated, negative if freed
+ * @param allocations : allocations made, negative if freed
+ */
+void mem_account(MemCategory category, int64_t bytes, int64_t allocations);
+
+/**
+ * Sums the counters of all threads. Allocations still in progress may or may not be included.
+ * @param totals : filled in with the totals
+ */
+void mem_totals(MemTotals* totals);
@@ -0,0 +1,48 @@
+#include "mtwister.h"
+
+#define UPPER_MASK 0x80000000u
+#define LOWER_MASK 0x7fffffffu
+#define TEMPERING_MASK_B 0x9d2c5680u
+#define TEMPERING_MASK_C 0xefc60000u
+
+MTRand seedRand(uint32_t seed) {
+    MTRand rand;
+    rand.mt[0] = seed;
+    for (int i = 1; i < STATE_VECTOR_LENGTH; i++)
+        rand.mt[i] = 1812433253u * (rand.mt[i - 1] ^ (rand.mt[i - 1] >> 30)) + i;
+    rand.index = STATE_VECTOR_LENGTH; // Generate the first block on the first call.
+    return rand;
+}
+
+// Generate the next STATE_VECTOR_LENGTH words of the sequence at once.
+static void twist(MTRand* rand) {
+    static const uint32_t mag[2] = { 0x0u, 0x9908b0dfu };
+    uint32_t* mt = rand->mt;
+    int k = 0;
+    for (; k < STATE_VECTOR_LENGTH - STATE_VECTOR_M; k++) {
+        uint32_t y = (mt[k] & UPPER_MASK) | (mt[k + 1] & LOWER_MASK);
+        mt[k] = mt[k + STATE_VECTOR_M] ^ (y >> 1) ^ mag[y & 0x1];
+    }
+    for (; k < STATE_VECTOR_LENGTH - 1; k++) {
+        uint32_t y = (mt[k] & UPPER_MASK) | (mt[k + 1] & LOWER_MASK);
+        mt[k] = mt[k + (STATE_VECTOR_M - STATE_VECTOR_LENGTH)] ^ (y >> 1) ^ mag[y & 0x1];
+    }
+    uint32_t y = (mt[STATE_VECTOR_LENGTH - 1] & UPPER_MASK) | (mt[0] & LOWER_MASK);
+    mt[STATE_VECTOR_LENGTH - 1] = mt[STATE_VECTOR_M - 1] ^ (y >> 1) ^ mag[y & 0x1];
+    rand->index = 0;
+}
+
+uint32_t genRandLong(MTRand* rand) {
+    if (rand->index >= STATE_VECTOR_LENGTH)
+        twist(rand);
+    uint32_t y = rand->mt[rand->index++];
+    y ^= y >> 11;
+    y ^= (y << 7) & TEMPERING_MASK_B;
+    y ^= (y << 15) & TEMPERING_MASK_C;
+    y ^= y >> 18;
+    return y;
+}
+
+double genRand(MTRand* rand) {
+    return genRandLong(rand) / 4294967296.0;
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <stdint.h>
+
+// Mersenne Twister (MT19937) pseudo-random number generator, after Matsumoto and Nishimura.
+// All the state lives in an `MTRand`, so every thread can keep its own generator: no locks are
+// taken (unlike `rand()`), and a generator seeded with the same value always yields the same sequence.
+#define STATE_VECTOR_LENGTH 624
+#define STATE_VECTOR_M 397 // Changes to STATE_VECTOR_LENGTH also require changes to this.
+
+typedef struct MTRand {
+    uint32_t mt[STATE_VECTOR_LENGTH];
+    int index;
+} MTRand;
+
+// Return a generator initialized with `seed`.
+MTRand seedRand(uint32_t seed);
+
+// Return the next pseudo-random number, uniformly distributed over [0, 2^32).
+uint32_t genRandLong(MTRand* rand);
+
+// Return the next pseudo-random number, uniformly distributed over [0, 1).
+double genRand(MTRand* rand);
@@ -4,8 +4,11 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <assert.h>
+#include <fnmatch.h>
 
 #define SEPARATOR '/'
+/** Characters with a special meaning in a glob pattern **/
+#define GLOB_SPECIAL_CHARS "*?[]!-"
 
 bool is_valid_path(const char* path) {
     size_t len = strlen(path);
@@ -24,7 +27,7 @@ bool is_valid_path(const char* path) {
             return false;
         }
         for (const char* p = name_start; p != name_end; p++) {
-            if (!islower(*p)) {
+            if (!islower((unsigned char)*p)) {
                 return false;
             }
         }
@@ -33,6 +36,19 @@ bool is_valid_path(const char* path) {
     return true;
 }
 
+bool is_valid_name(const char* name) {
+    size_t len = strlen(name);
+    if (len == 0 || len > MAX_FOLDER_NAME_LENGTH) {
+        return false;
+    }
+    for (const char* p = name; *p; p++) {
+        if (!islower((unsigned char)*p)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 const char* split_path(const char* path, char* component) {
     const char* subpath = strchr(path + 1, SEPARATOR); // Pointer to second '/' character.
     if (!subpath) {
@@ -92,38 +108,107 @@ const char** make_map_contents_array(HashMap* map) {
     return result;
 }
 
-char* make_map_contents_string(HashMap* map) {
-    const char** keys = make_map_contents_array(map);
-
-    unsigned int result_size = 0; // Including ending null character.
-    for (const char** key = keys; *key; ++key)
-        result_size += strlen(*key) + 1;
+char* make_keys_string(const char* const* keys, size_t n_keys) {
+    size_t result_size = 0; // Including ending null character.
+    for (size_t i = 0; i < n_keys; ++i)
+        result_size += strlen(keys[i]) + 1;
 
-    // Return empty string if map is empty.
+    // Return empty string if there are no keys.
     if (!result_size) {
         // Note we can't just return "", as it can't be free'd.
         char* result = safe_malloc(1);
         *result = '\0';
-        free(keys);
         return result;
     }
 
     char* result = safe_malloc(result_size);
     char* position = result;
-    for (const char** key = keys; *key; ++key) {
-        size_t keylen = strlen(*key);
+    for (size_t i = 0; i < n_keys; ++i) {
+        size_t keylen = strlen(keys[i]);
         assert(position + keylen <= result + result_size);
-        strcpy(position, *key); // NOLINT: array size already checked.
+        memcpy(position, keys[i], keylen);
         position += keylen;
         *position = ',';
         position++;
     }
     position--;
     *position = '\0';
+    return result;
+}
+
+char* make_map_contents_string(HashMap* map) {
+    const char** keys = make_map_contents_array(map);
+    char* result = make_keys_string(keys, hmap_size(map));
     free(keys);
     return result;
 }
 
+char* make_index_contents_string(SortedIndex* index, const char* from, const char* to) {
+    size_t begin = from ? sidx_lower_bound(index, from) : 0;
+    size_t end = to ? sidx_lower_bound(index, to) : sidx_size(index);
+    if (end < begin)
+        end = begin;
+    return make_keys_string(sidx_keys(index) + begin, end - begin);
+}
+
+bool is_valid_pattern(const char* pattern) {
+    size_t len = strlen(pattern);
+    if (len == 0 || len > MAX_PATH_LENGTH) {
+        return false;
+    }
+    for (const char* p = pattern; *p; p++) {
+        if (!islower((unsigned char)*p) && !strchr(GLOB_SPECIAL_CHARS, *p)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+char* make_index_matches_string(SortedIndex* index, const char* pattern) {
+    // Every name matching the pattern starts with its literal prefix, so only the range
+    // [prefix, successor of prefix) of the index has to be looked at.
+    size_t prefix_len = strcspn(pattern, "*?[");
+    char prefix[MAX_PATH_LENGTH + 1], prefix_end[MAX_PATH_LENGTH + 1];
+    memcpy(prefix, pattern, prefix_len);
+    prefix[prefix_len] = '\0';
+    memcpy(prefix_end, prefix, prefix_len + 1);
+    if (prefix_len > 0) {
+        prefix_end[prefix_len - 1]++; // Letters are followed by '{', so this can't overflow.
+    }
+
+    size_t begin = prefix_len ? sidx_lower_bound(index, prefix) : 0;
+    size_t end = prefix_len ? sidx_lower_bound(index, prefix_end) : sidx_size(index);
+    const char* const* keys = sidx_keys(index);
+
+    if (pattern[prefix_len] == '\0') {
+        // No wildcards at all - at most a single exact match.
+        bool found = begin < end && strcmp(keys[begin], pattern) == 0;
+        return make_keys_string(keys + begin, found ? 1 : 0);
+    }
+    if (strcmp(pattern + prefix_len, "*") == 0) {
+        // A pure prefix query - the whole range matches.
+        return make_keys_string(keys + begin, end - begin);
+    }
+
+    const char** matches = safe_malloc((end - begin + 1) * sizeof(char*));
+    size_t n_matches = 0;
+    for (size_t i = begin; i < end; i++) {
+        if (fnmatch(pattern, keys[i], 0) == 0) {
+            matches[n_matches++] = keys[i];
+        }
+    }
+    char* result = make_keys_string(matches, n_matches);
+    free(matches);
+    return result;
+}
+
+size_t path_depth(const char* path) {
+    size_t depth = 0;
+    for (const char* p = path + 1; *p; p++)
+        depth += (*p == SEPARATOR);
+    return depth;
+}
+
 bool is_ancestor(const char *path1, const char *path2) {
     return (strncmp(path1, path2, strlen(path1)) == 0) && (strcmp(path1, path2) != 0);
 }
@@ -138,9 +223,23 @@ void make_path_to_LCA(const char* path1, const char* path2, char lca_path[MAX_PA
     }
 
     if (path1[i] && path2[i]) {
+        // The paths may diverge in the middle of a component (e.g. "/a/bc/" and "/a/bd/") - cut it off.
+        *(strrchr(buff, SEPARATOR) + 1) = '\0';
         strcpy(lca_path, buff);
     }
     else {
         make_path_to_parent(buff, NULL, lca_path);
     }
 }
+
+void make_path_to_common_ancestor(const char* path1, const char* path2, char ancestor_path[MAX_PATH_LENGTH + 1]) {
+    size_t i = 0, last_separator = 0;
+    while (path1[i] && path1[i] == path2[i]) {
+        if (path1[i] == SEPARATOR) {
+            last_separator = i;
+        }
+        i++;
+    }
+    memcpy(ancestor_path, path1, last_separator + 1);
+    ancestor_path[last_separator + 1] = '\0';
+}
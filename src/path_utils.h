@@ -1,6 +1,7 @@
 #pragma once
 
 #include "HashMap.h"
+#include "SortedIndex.h"
 #include <stdbool.h>
 #include <string.h>
 
@@ -20,6 +21,13 @@
  */
 bool is_valid_path(const char *path_name);
 
+/**
+ * Checks whether `name` is a valid folder name (see `is_valid_path`).
+ * @param name : string to check
+ * @return : true if `name` is a valid folder name, false otherwise
+ */
+bool is_valid_name(const char* name);
+
 // Return the subpath obtained by removing the first component.
 // Args:
 // - `path`: should be a valid path (see `is_path_valid`).
@@ -55,6 +63,33 @@ const char** make_map_contents_array(HashMap* map);
 // The caller should free the result.
 char* make_map_contents_string(HashMap* map);
 
+// Return a string containing the `n_keys` strings of `keys`, in the given order, comma-separated.
+// The result has no trailing comma. No keys yield an empty string.
+// The caller should free the result.
+char* make_keys_string(const char* const* keys, size_t n_keys);
+
+// Return a string containing the keys of `index` in the range [`from`, `to`), comma-separated.
+// A NULL bound leaves that side of the range open, so (NULL, NULL) lists the whole index.
+// Since the index is already sorted, this is a linear copy.
+// The caller should free the result.
+char* make_index_contents_string(SortedIndex* index, const char* from, const char* to);
+
+/**
+ * Checks whether `pattern` is a valid glob pattern for folder names.
+ * Valid patterns are non-empty sequences of 'a'-'z' ASCII characters and the wildcards
+ * '*', '?' and bracket expressions ('[abc]', '[a-f]', '[!xyz]'), of length at most MAX_PATH_LENGTH.
+ * @param pattern : string to check
+ * @return : true if `pattern` is a valid pattern, false otherwise
+ */
+bool is_valid_pattern(const char* pattern);
+
+// Return a string containing the keys of `index` matching the glob `pattern`, sorted, comma-separated.
+// `pattern` should be valid (see `is_valid_pattern`).
+// Only the keys starting with the literal prefix of the pattern (the part before the first wildcard)
+// are examined, and pure prefix patterns such as "log*" are answered without matching any key.
+// The caller should free the result.
+char* make_index_matches_string(SortedIndex* index, const char* pattern);
+
 /**
  * Checks whether both directories lie on the same path in a tree,
  * and if path2 branches out from path1.
@@ -64,6 +99,13 @@ char* make_map_contents_string(HashMap* map);
  */
 bool is_ancestor(const char* path1, const char* path2);
 
+/**
+ * Counts the components of a valid path.
+ * @param path : file path
+ * @return : depth of the directory at the path, 0 for the root
+ */
+size_t path_depth(const char* path);
+
 /**
  * Stores the path to the last common ancestor (LCA) of the two paths in `lca_path`.
  * @param path1 : first path
@@ -71,3 +113,12 @@ bool is_ancestor(const char* path1, const char* path2);
  * @param lca_path : path to the LCA
  */
 void make_path_to_LCA(const char* path1, const char* path2, char lca_path[MAX_PATH_LENGTH + 1]);
+
+/**
+ * Stores the path to the deepest directory which is both `path1` or its ancestor and `path2` or its ancestor
+ * in `ancestor_path`. Unlike `make_path_to_LCA`, a path is considered its own ancestor here.
+ * @param path1 : first path
+ * @param path2 : second path
+ * @param ancestor_path : path to the common ancestor
+ */
+void make_path_to_common_ancestor(const char* path1, const char* path2, char ancestor_path[MAX_PATH_LENGTH + 1]);
@@ -0,0 +1,49 @@
+#pragma once
+
+/*
+ * Static tracepoints (USDT) of the library, for bpftrace, perf or SystemTap, e.g.
+ *     bpftrace -e 'usdt:./file_tree:file_tree:op__done { @[str(arg0)] = count(); }'
+ *
+ * With <sys/sdt.h> (systemtap-sdt-dev) available, every probe compiles to a single nop plus a note
+ * in the ELF file, and costs nothing until a tracer attaches to it. Without it, or with TREE_NO_PROBES
+ * defined, the probes compile to nothing and their arguments are never evaluated.
+ *
+ * Probes of the provider `file_tree`, with their arguments:
+ *   op__start(const char* op, const char* path, const char* target)
+ *   op__done(const char* op, const char* path, const char* target, int result)
+ *       Entry and exit of tree_list, tree_create, tree_remove and tree_move. `target` is NULL but for moves.
+ *   read__lock(Tree* node), read__unlock(Tree* node), write__lock(Tree* node), write__unlock(Tree* node)
+ *       A lock of a directory taken, or released.
+ *   lock__wait(Tree* node, int reader, size_t waiters)
+ *       A reader or a writer starts waiting for the lock of a directory, behind `waiters` others.
+ *   subtree__wait(Tree* node, size_t refcount), subtree__wait__done(Tree* node)
+ *       An operation starts, and stops, waiting for the operations in the subtree of a directory to finish.
+ *   node__hop(Tree* parent, const char* name, Tree* child)
+ *       A step of a path lookup. `child` is NULL if the directory doesn't exist.
+ *   hmap__probe(HashMap* map, size_t bucket, size_t steps, int found)
+ *       A lookup in a map, which compared `steps` keys of the bucket.
+ *   hmap__grow(HashMap* map, size_t old_buckets, size_t new_buckets)
+ *       A map doubling its number of buckets.
+ */
+
+#if !defined(TREE_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define TREE_HAVE_PROBES
+#endif
+#endif
+
+#ifdef TREE_HAVE_PROBES
+#include <sys/sdt.h>
+
+#define TREE_PROBE1(name, a1) DTRACE_PROBE1(file_tree, name, a1)
+#define TREE_PROBE2(name, a1, a2) DTRACE_PROBE2(file_tree, name, a1, a2)
+#define TREE_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(file_tree, name, a1, a2, a3)
+#define TREE_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(file_tree, name, a1, a2, a3, a4)
+#else
+// The arguments stay "used", so that variables kept only for probes don't cause warnings.
+#define TREE_PROBE1(name, a1) do { if (0) { (void)(a1); } } while (0)
+#define TREE_PROBE2(name, a1, a2) do { if (0) { (void)(a1); (void)(a2); } } while (0)
+#define TREE_PROBE3(name, a1, a2, a3) do { if (0) { (void)(a1); (void)(a2); (void)(a3); } } while (0)
+#define TREE_PROBE4(name, a1, a2, a3, a4) \
+    do { if (0) { (void)(a1); (void)(a2); (void)(a3); (void)(a4); } } while (0)
+#endif
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Generic success code **/
+#ifndef SUCCESS
+#define SUCCESS 0
+#endif
+
+/** Checks whether the result of a pthread_* function is 0 (SUCCESS) **/
+#define PTHREAD_CHECK(x)                                                          \
+    do {                                                                          \
+        int err = (x);                                                            \
+        if (err != SUCCESS) {                                                     \
+            fprintf(stderr, "Runtime error: %s returned %d in %s at %s:%d\n%s\n", \
+                #x, err, __func__, __FILE__, __LINE__, strerror(err));            \
+            exit(EXIT_FAILURE);                                                   \
+        }                                                                         \
+    } while (0)
+
+/** Performs a block of code under the node's mutex **/
+#define UNDER_MUTEX(mutex, code_block)           \
+do {                                             \
+    PTHREAD_CHECK(pthread_mutex_lock(mutex));    \
+    code_block;                                  \
+    PTHREAD_CHECK(pthread_mutex_unlock(mutex));  \
+} while(0);
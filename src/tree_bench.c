@@ -0,0 +1,470 @@
+#include "Histogram.h"
+#include "Tree.h"
+#include "Workload.h"
+#include "err.h"
+#include "safe_allocations.h"
+#include "sync_utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Multi-threaded benchmark of tree operations.
+ *
+ * Every thread runs its own stream of the workload (see Workload.h) for the given duration, timing
+ * every operation. The results are printed to the standard output as a single JSON object.
+ *
+ * In sweep mode (`--sweep`), each of the standard workloads below is run on 1, 2, 4, ... up to the given
+ * number of threads, each time on a freshly populated tree. Every point is warmed up first, then run
+ * several times; its throughput is the median of the runs, and the spread of the runs around it is
+ * recorded as well. A scaling table goes to the standard error and a JSON baseline to the standard output.
+ * In compare mode (`--compare BASELINE`), the sweep is compared with a baseline written by an earlier
+ * sweep, and the benchmark fails if the median throughput of any point dropped by more than the allowed
+ * percentage, or by more than the spread the baseline recorded for the point, whichever is larger.
+ */
+
+/** A standard workload of sweeps. The seed and the distribution come from the command line **/
+typedef struct SweepWorkload {
+    const char* name;
+    unsigned mix[WORKLOAD_OP_TYPES];
+    size_t depth;
+    size_t fanout;
+    size_t name_length;
+} SweepWorkload;
+
+static const SweepWorkload sweep_workloads[] = {
+    { "read-only", { 100, 0, 0, 0 }, 3, 16, 4 },
+    { "write-heavy", { 20, 40, 40, 0 }, 3, 16, 4 },
+    { "move-heavy", { 20, 10, 10, 60 }, 3, 16, 4 },
+    { "deep-path", { 70, 10, 10, 10 }, 12, 2, 4 },
+    { "wide-directory", { 70, 10, 10, 10 }, 2, 256, 4 },
+};
+
+#define NUM_SWEEP_WORKLOADS (sizeof(sweep_workloads) / sizeof(sweep_workloads[0]))
+
+/** Longest workload name, with the terminating NUL **/
+#define MAX_SWEEP_NAME 32
+
+/** Throughput of a workload on a number of threads **/
+typedef struct SweepPoint {
+    char workload[MAX_SWEEP_NAME];
+    size_t threads;
+    double ops_per_sec;  /** Median of the runs **/
+    double spread_pct;   /** Difference between the fastest and the slowest run, in percent of the median **/
+    uint64_t p99_ns;     /** Of all the runs together **/
+} SweepPoint;
+
+typedef struct BenchConfig {
+    size_t threads;
+    double duration;           /** In seconds **/
+    WorkloadConfig workload;
+    const char* image;         /** Where to save the initial tree, NULL not to save it **/
+    const char* trace;         /** Where to trace the operations to, NULL not to trace them **/
+    bool sweep;                /** Whether to sweep the standard workloads over 1 to `threads` threads **/
+    const char* baseline;      /** Baseline to compare the sweep with, NULL not to compare **/
+    double max_regression;     /** Largest allowed drop of throughput from the baseline, in percent **/
+    size_t repeat;             /** Measured runs of every point of a sweep **/
+    double warmup;             /** How long to run every point of a sweep before measuring it, in seconds **/
+} BenchConfig;
+
+typedef struct BenchThread {
+    pthread_t thread;
+    WorkloadStream stream;
+    Histogram latency[WORKLOAD_OP_TYPES];
+    uint64_t failed[WORKLOAD_OP_TYPES]; /** Operations which returned an error **/
+} BenchThread;
+
+static Tree* tree;
+static pthread_barrier_t start_barrier;
+static atomic_bool stopping;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void* bench_main(void* arg) {
+    BenchThread* self = arg;
+    WorkloadOp op;
+    pthread_barrier_wait(&start_barrier);
+    while (!atomic_load_explicit(&stopping, memory_order_relaxed)) {
+        workload_next(&self->stream, &op);
+        uint64_t start = now_ns();
+        int result = workload_run(tree, &op);
+        hist_record(&self->latency[op.type], now_ns() - start);
+        if (result != 0)
+            self->failed[op.type]++;
+    }
+    return NULL;
+}
+
+static void print_results(const BenchConfig* config, BenchThread* threads, double elapsed) {
+    printf("{\n");
+    const WorkloadConfig* workload = &config->workload;
+    printf("  \"config\": {\"threads\": %zu, \"duration_s\": %.3f, \"mix\": {", config->threads, config->duration);
+    for (size_t op = 0; op < WORKLOAD_OP_TYPES; op++)
+        printf("%s\"%s\": %u", op ? ", " : "", workload_op_names[op], workload->mix[op]);
+    printf("}, \"depth\": %zu, \"fanout\": %zu, \"name_length\": %zu, \"distribution\": \"%s\"",
+           workload->depth, workload->fanout, workload->name_length, workload->zipf ? "zipf" : "uniform");
+    if (workload->zipf)
+        printf(", \"zipf_theta\": %.3f", workload->zipf_theta);
+    printf(", \"seed\": %u},\n", workload->seed);
+    printf("  \"elapsed_s\": %.6f,\n", elapsed);
+
+    uint64_t total = 0;
+    printf("  \"operations\": {\n");
+    for (size_t op = 0; op < WORKLOAD_OP_TYPES; op++) {
+        Histogram merged;
+        hist_init(&merged);
+        uint64_t failed = 0;
+        for (size_t t = 0; t < config->threads; t++) {
+            hist_merge(&merged, &threads[t].latency[op]);
+            failed += threads[t].failed[op];
+        }
+        total += merged.total;
+        printf("    \"%s\": {\"ops\": %llu, \"failed\": %llu, \"ops_per_sec\": %.1f, \"latency_ns\": ",
+               workload_op_names[op], (unsigned long long)merged.total, (unsigned long long)failed,
+               merged.total / elapsed);
+        hist_print_json(stdout, &merged);
+        printf("}%s\n", op + 1 < WORKLOAD_OP_TYPES ? "," : "");
+    }
+    printf("  },\n");
+    printf("  \"total_ops_per_sec\": %.1f\n", total / elapsed);
+    printf("}\n");
+}
+
+static void usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -t, --threads N        number of threads (default: number of processors)\n"
+            "  -d, --duration SEC     how long to run (default: 5)\n"
+            "  -m, --mix L:C:R:M      relative frequencies of list, create, remove, move (default: 70:10:10:10)\n"
+            "  -D, --depth N          depth of the leaves (default: 3)\n"
+            "  -f, --fanout N         subdirectories of every inner directory (default: 16)\n"
+            "  -n, --name-length N    length of folder names (default: 4)\n"
+            "  -z, --zipf THETA       draw leaves from a Zipfian distribution of skew THETA (default: uniform)\n"
+            "  -s, --seed N           seed of the random streams (default: 1)\n"
+            "  -S, --save PATH        save the initial tree to an image, to replay a trace from\n"
+            "  -T, --trace PATH       trace the operations, to replay them with tree_replay\n"
+            "  -w, --sweep            run the standard workloads on 1, 2, 4, ... up to --threads threads\n"
+            "                         (their own mix, depth, fanout and name length replace the options above)\n"
+            "  -c, --compare PATH     sweep, and compare the throughput with a baseline printed by --sweep\n"
+            "  -r, --max-regression PCT\n"
+            "                         largest drop of throughput from the baseline that passes (default: 10),\n"
+            "                         unless the baseline's runs of the point spread wider\n"
+            "  -R, --repeat N         measured runs of every point of a sweep, compared by their median (default: 5)\n"
+            "  -W, --warmup SEC       how long to run every point of a sweep before measuring it (default: 1)\n",
+            program);
+    exit(EXIT_FAILURE);
+}
+
+static void parse_args(int argc, char* argv[], BenchConfig* config) {
+    static const struct option options[] = {
+        { "threads", required_argument, NULL, 't' },
+        { "duration", required_argument, NULL, 'd' },
+        { "mix", required_argument, NULL, 'm' },
+        { "depth", required_argument, NULL, 'D' },
+        { "fanout", required_argument, NULL, 'f' },
+        { "name-length", required_argument, NULL, 'n' },
+        { "zipf", required_argument, NULL, 'z' },
+        { "seed", required_argument, NULL, 's' },
+        { "save", required_argument, NULL, 'S' },
+        { "trace", required_argument, NULL, 'T' },
+        { "sweep", no_argument, NULL, 'w' },
+        { "compare", required_argument, NULL, 'c' },
+        { "max-regression", required_argument, NULL, 'r' },
+        { "repeat", required_argument, NULL, 'R' },
+        { "warmup", required_argument, NULL, 'W' },
+        { NULL, 0, NULL, 0 },
+    };
+    WorkloadConfig* workload = &config->workload;
+    int c;
+    while ((c = getopt_long(argc, argv, "t:d:m:D:f:n:z:s:S:T:wc:r:R:W:", options, NULL)) != -1) {
+        switch (c) {
+            case 't': config->threads = strtoul(optarg, NULL, 10); break;
+            case 'd': config->duration = strtod(optarg, NULL); break;
+            case 'm':
+                if (sscanf(optarg, "%u:%u:%u:%u", &workload->mix[WORKLOAD_LIST], &workload->mix[WORKLOAD_CREATE],
+                           &workload->mix[WORKLOAD_REMOVE], &workload->mix[WORKLOAD_MOVE]) != WORKLOAD_OP_TYPES)
+                    usage(argv[0]);
+                break;
+            case 'D': workload->depth = strtoul(optarg, NULL, 10); break;
+            case 'f': workload->fanout = strtoul(optarg, NULL, 10); break;
+            case 'n': workload->name_length = strtoul(optarg, NULL, 10); break;
+            case 'z': workload->zipf = true; workload->zipf_theta = strtod(optarg, NULL); break;
+            case 's': workload->seed = strtoul(optarg, NULL, 10); break;
+            case 'S': config->image = optarg; break;
+            case 'T': config->trace = optarg; break;
+            case 'w': config->sweep = true; break;
+            case 'c': config->sweep = true; config->baseline = optarg; break;
+            case 'r': config->max_regression = strtod(optarg, NULL); break;
+            case 'R': config->repeat = strtoul(optarg, NULL, 10); break;
+            case 'W': config->warmup = strtod(optarg, NULL); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc)
+        usage(argv[0]);
+
+    if (config->threads == 0 || config->duration <= 0 || config->max_regression < 0 || config->repeat == 0
+        || config->warmup < 0)
+        fatal("invalid benchmark configuration");
+    if (config->sweep && (config->image || config->trace))
+        fatal("--save and --trace can't be used with a sweep");
+}
+
+/**
+ * Runs the workload on fresh threads for the given duration, against `tree`.
+ * @param workload : workload
+ * @param threads : array of `n_threads` zeroed threads, filled in with their results
+ * @param n_threads : number of threads
+ * @param duration : how long to run, in seconds
+ * @return : the elapsed time in seconds
+ */
+static double run_threads(const Workload* workload, BenchThread* threads, size_t n_threads, double duration) {
+    atomic_store(&stopping, false);
+    PTHREAD_CHECK(pthread_barrier_init(&start_barrier, NULL, n_threads + 1));
+    for (size_t t = 0; t < n_threads; t++) {
+        workload_stream_init(&threads[t].stream, workload, t);
+        for (size_t op = 0; op < WORKLOAD_OP_TYPES; op++)
+            hist_init(&threads[t].latency[op]);
+        PTHREAD_CHECK(pthread_create(&threads[t].thread, NULL, bench_main, &threads[t]));
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    uint64_t start = now_ns();
+    struct timespec remaining = { .tv_sec = duration, .tv_nsec = fmod(duration, 1) * 1e9 };
+    while (nanosleep(&remaining, &remaining) != 0 && errno == EINTR)
+        ;
+    atomic_store(&stopping, true);
+    for (size_t t = 0; t < n_threads; t++)
+        PTHREAD_CHECK(pthread_join(threads[t].thread, NULL));
+    double elapsed = (now_ns() - start) / 1e9;
+    PTHREAD_CHECK(pthread_barrier_destroy(&start_barrier));
+    return elapsed;
+}
+
+/**
+ * Reads the points of a baseline printed by `print_sweep`, one per line.
+ * @return : malloc'd array of the points, NULL if the file can't be read
+ */
+static SweepPoint* read_baseline(const char* path, size_t* count) {
+    FILE* file = fopen(path, "r");
+    if (!file)
+        return NULL;
+    SweepPoint* points = NULL;
+    size_t capacity = 0;
+    *count = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        SweepPoint point = { 0 };
+        if (sscanf(line, " {\"workload\": \"%31[^\"]\", \"threads\": %zu, \"ops_per_sec\": %lf", point.workload,
+                   &point.threads, &point.ops_per_sec) != 3)
+            continue;
+        // Baselines of older sweeps have no spread, and are held to the allowed percentage alone.
+        const char* spread = strstr(line, "\"spread_pct\": ");
+        if (spread)
+            point.spread_pct = strtod(spread + strlen("\"spread_pct\": "), NULL);
+        if (*count == capacity) {
+            capacity = capacity ? 2 * capacity : 32;
+            points = safe_realloc(points, capacity * sizeof(SweepPoint));
+        }
+        points[(*count)++] = point;
+    }
+    fclose(file);
+    return points ? points : safe_malloc(1);
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static const SweepPoint* find_point(const SweepPoint* points, size_t count, const SweepPoint* point) {
+    for (size_t i = 0; i < count; i++) {
+        if (points[i].threads == point->threads && strcmp(points[i].workload, point->workload) == 0)
+            return &points[i];
+    }
+    return NULL;
+}
+
+/**
+ * Prints the scaling table to the standard error and the baseline to the standard output.
+ * @return : number of points whose throughput regressed beyond the allowed percentage
+ */
+static size_t print_sweep(const BenchConfig* config, const SweepPoint* points, size_t count,
+                          const SweepPoint* baseline, size_t baseline_count) {
+    size_t regressions = 0;
+    fprintf(stderr, "%-16s %7s %14s %8s %8s %10s", "workload", "threads", "ops/s", "spread", "speedup", "p99 (ns)");
+    if (config->baseline)
+        fprintf(stderr, " %14s %8s", "baseline ops/s", "change");
+    fprintf(stderr, "\n");
+    double single = 0;
+    for (size_t i = 0; i < count; i++) {
+        const SweepPoint* point = &points[i];
+        if (point->threads == 1)
+            single = point->ops_per_sec;
+        fprintf(stderr, "%-16s %7zu %14.1f %7.1f%% %7.2fx %10llu", point->workload, point->threads,
+                point->ops_per_sec, point->spread_pct, single > 0 ? point->ops_per_sec / single : 0,
+                (unsigned long long)point->p99_ns);
+        if (config->baseline) {
+            const SweepPoint* base = find_point(baseline, baseline_count, point);
+            if (base && base->ops_per_sec > 0) {
+                double change = 100 * (point->ops_per_sec - base->ops_per_sec) / base->ops_per_sec;
+                double allowed = base->spread_pct > config->max_regression ? base->spread_pct : config->max_regression;
+                bool regressed = change < -allowed;
+                regressions += regressed;
+                fprintf(stderr, " %14.1f %+7.1f%%%s", base->ops_per_sec, change, regressed ? "  REGRESSION" : "");
+            } else {
+                fprintf(stderr, " %14s %8s", "-", "new");
+            }
+        }
+        fprintf(stderr, "\n");
+    }
+
+    printf("{\n");
+    printf("  \"config\": {\"max_threads\": %zu, \"duration_s\": %.3f, \"repeat\": %zu, \"warmup_s\": %.3f, "
+           "\"distribution\": \"%s\"", config->threads, config->duration, config->repeat, config->warmup,
+           config->workload.zipf ? "zipf" : "uniform");
+    if (config->workload.zipf)
+        printf(", \"zipf_theta\": %.3f", config->workload.zipf_theta);
+    printf(", \"seed\": %u},\n", config->workload.seed);
+    // One point per line, as `read_baseline` expects.
+    printf("  \"points\": [\n");
+    for (size_t i = 0; i < count; i++) {
+        printf("    {\"workload\": \"%s\", \"threads\": %zu, \"ops_per_sec\": %.1f, \"spread_pct\": %.1f, "
+               "\"p99_ns\": %llu}%s\n", points[i].workload, points[i].threads, points[i].ops_per_sec,
+               points[i].spread_pct, (unsigned long long)points[i].p99_ns, i + 1 < count ? "," : "");
+    }
+    printf("  ]");
+    if (config->baseline)
+        printf(",\n  \"regressions\": %zu", regressions);
+    printf("\n}\n");
+    return regressions;
+}
+
+/** Runs the sweep mode. Returns the exit status **/
+static int sweep(const BenchConfig* config) {
+    SweepPoint* baseline = NULL;
+    size_t baseline_count = 0;
+    if (config->baseline && !(baseline = read_baseline(config->baseline, &baseline_count)))
+        fatal("cannot read the baseline %s: %s", config->baseline, strerror(errno));
+
+    size_t points_per_workload = 1;
+    for (size_t n_threads = 1; n_threads < config->threads; n_threads *= 2)
+        points_per_workload++;
+    SweepPoint* points = safe_malloc(NUM_SWEEP_WORKLOADS * points_per_workload * sizeof(SweepPoint));
+    size_t count = 0;
+    BenchThread* threads = safe_malloc(config->threads * sizeof(BenchThread));
+    double* runs = safe_malloc(config->repeat * sizeof(double)); // Throughput of every run of a point
+    for (size_t w = 0; w < NUM_SWEEP_WORKLOADS; w++) {
+        const SweepWorkload* standard = &sweep_workloads[w];
+        WorkloadConfig workload_config = config->workload;
+        memcpy(workload_config.mix, standard->mix, sizeof(workload_config.mix));
+        workload_config.depth = standard->depth;
+        workload_config.fanout = standard->fanout;
+        workload_config.name_length = standard->name_length;
+        Workload* workload = workload_new(&workload_config);
+        if (!workload)
+            fatal("invalid configuration of workload %s", standard->name);
+
+        // 1, 2, 4, ..., and the maximum.
+        for (size_t n_threads = 1;; n_threads = 2 * n_threads < config->threads ? 2 * n_threads : config->threads) {
+            tree = workload_populate(workload);
+            if (config->warmup > 0) {
+                memset(threads, 0, n_threads * sizeof(BenchThread));
+                run_threads(workload, threads, n_threads, config->warmup);
+            }
+            Histogram merged;
+            hist_init(&merged);
+            for (size_t run = 0; run < config->repeat; run++) {
+                memset(threads, 0, n_threads * sizeof(BenchThread));
+                double elapsed = run_threads(workload, threads, n_threads, config->duration);
+                uint64_t total = merged.total;
+                for (size_t t = 0; t < n_threads; t++) {
+                    for (size_t op = 0; op < WORKLOAD_OP_TYPES; op++)
+                        hist_merge(&merged, &threads[t].latency[op]);
+                }
+                runs[run] = (merged.total - total) / elapsed;
+            }
+            tree_free(tree);
+
+            SweepPoint* point = &points[count++];
+            snprintf(point->workload, sizeof(point->workload), "%s", standard->name);
+            point->threads = n_threads;
+            qsort(runs, config->repeat, sizeof(double), compare_doubles);
+            size_t middle = config->repeat / 2;
+            point->ops_per_sec = config->repeat % 2 ? runs[middle] : (runs[middle - 1] + runs[middle]) / 2;
+            point->spread_pct = point->ops_per_sec > 0
+                                ? 100 * (runs[config->repeat - 1] - runs[0]) / point->ops_per_sec : 0;
+            point->p99_ns = hist_percentile(&merged, 99);
+            if (n_threads == config->threads)
+                break;
+        }
+        workload_free(workload);
+    }
+
+    size_t regressions = print_sweep(config, points, count, baseline, baseline_count);
+    free(runs);
+    free(threads);
+    free(points);
+    free(baseline);
+    return regressions > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int main(int argc, char* argv[]) {
+    BenchConfig config = {
+        .threads = sysconf(_SC_NPROCESSORS_ONLN),
+        .duration = 5,
+        .max_regression = 10,
+        .repeat = 5,
+        .warmup = 1,
+        .workload = {
+            .mix = { 70, 10, 10, 10 },
+            .depth = 3,
+            .fanout = 16,
+            .name_length = 4,
+            .seed = 1,
+        },
+    };
+    parse_args(argc, argv, &config);
+    if (config.sweep)
+        return sweep(&config);
+
+    Workload* workload = workload_new(&config.workload);
+    if (!workload)
+        fatal("invalid workload configuration");
+    tree = workload_populate(workload);
+    int result = SUCCESS;
+    if (config.image) {
+        int fd = open(config.image, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        result = fd < 0 ? errno : tree_save(tree, fd);
+        if (fd >= 0 && close(fd) != 0 && result == SUCCESS)
+            result = errno;
+        if (result != SUCCESS)
+            fatal("cannot save the tree to %s: %s", config.image, strerror(result));
+    }
+    if (config.trace && (result = tree_trace_start(tree, config.trace)) != SUCCESS)
+        fatal("cannot trace to %s: %s", config.trace, strerror(result));
+
+    BenchThread* threads = safe_calloc(config.threads, sizeof(BenchThread));
+    double elapsed = run_threads(workload, threads, config.threads, config.duration);
+    result = tree_trace_stop(tree);
+    if (result != SUCCESS)
+        fatal("cannot write the trace: %s", strerror(result));
+
+    print_results(&config, threads, elapsed);
+    free(threads);
+    tree_free(tree);
+    workload_free(workload);
+    return 0;
+}
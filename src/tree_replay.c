@@ -0,0 +1,292 @@
+#include "Histogram.h"
+#include "Tree.h"
+#include "TreeTrace.h"
+#include "err.h"
+#include "path_utils.h"
+#include "safe_allocations.h"
+#include "sync_utils.h"
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Replays a trace recorded with `tree_trace_start` against a fresh tree.
+ *
+ * Operations are ordered by their timestamps and dealt out to the replaying threads by the number of
+ * the thread which issued them, so operations of one traced thread stay in order on one replaying thread.
+ * They are issued either at their original pace (relative to the start of the trace) or as fast as possible.
+ * Every result is compared with the traced one. Results of concurrent operations depend on their
+ * interleaving, so a few mismatches are expected unless the trace is replayed on a single thread from
+ * the tree it was recorded on (see `--image`).
+ *
+ * The results are printed to the standard output as a single JSON object.
+ */
+
+#define NUM_TYPES (TRACE_MOVE + 1)
+
+static const char* type_names[NUM_TYPES] = { NULL, "list", "create", "remove", "move" };
+
+/** A traced operation, with its strings owned **/
+typedef struct ReplayOp {
+    TraceOpType type;
+    char* path;
+    char* target;
+    uint32_t thread;
+    int32_t result;
+    uint64_t timestamp;
+    uint64_t duration;
+    size_t index;       /** Position in the trace file, to keep the order of simultaneous operations **/
+} ReplayOp;
+
+typedef struct Trace {
+    ReplayOp* ops;
+    size_t count, capacity;
+    uint32_t n_threads;
+} Trace;
+
+typedef struct ReplayConfig {
+    size_t threads;     /** 0 to replay on as many threads as were traced **/
+    bool max_speed;
+    bool strict;        /** Whether mismatched results fail the replay **/
+    const char* image;  /** Image of the tree to start with, NULL to start with an empty tree **/
+    const char* trace;
+} ReplayConfig;
+
+typedef struct ReplayThread {
+    pthread_t thread;
+    ReplayOp** ops;     /** Operations of this thread, in order **/
+    size_t count;
+    Histogram latency[NUM_TYPES];
+    Histogram traced_latency[NUM_TYPES];
+    uint64_t mismatched[NUM_TYPES];
+} ReplayThread;
+
+static Tree* tree;
+static const ReplayConfig* config;
+static pthread_barrier_t start_barrier;
+static uint64_t start_ns;           /** Monotonic time when the replay started **/
+
+static int collect_record(void* arg, const TraceRecord* record) {
+    Trace* trace = arg;
+    if (trace->count == trace->capacity) {
+        trace->capacity = trace->capacity ? 2 * trace->capacity : 1024;
+        trace->ops = safe_realloc(trace->ops, trace->capacity * sizeof(ReplayOp));
+    }
+    ReplayOp* op = &trace->ops[trace->count];
+    *op = (ReplayOp) {
+        .type = record->type,
+        .path = strdup(record->path),
+        .target = record->target ? strdup(record->target) : NULL,
+        .thread = record->thread,
+        .result = record->result,
+        .timestamp = record->timestamp,
+        .duration = record->duration,
+        .index = trace->count,
+    };
+    CHECK_POINTER(op->path);
+    if (record->target)
+        CHECK_POINTER(op->target);
+    trace->count++;
+    if (record->thread >= trace->n_threads)
+        trace->n_threads = record->thread + 1;
+    return SUCCESS;
+}
+
+static int compare_ops(const void* a, const void* b) {
+    const ReplayOp* x = a;
+    const ReplayOp* y = b;
+    if (x->timestamp != y->timestamp)
+        return x->timestamp < y->timestamp ? -1 : 1;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/** Sleeping for less than this overshoots (timer slack), so shorter waits spin instead **/
+#define MIN_SLEEP_NS 100000
+
+/** Waits until `offset` nanoseconds after the start of the replay **/
+static void wait_until(uint64_t offset) {
+    uint64_t deadline = start_ns + offset;
+    uint64_t now = now_ns();
+    if (deadline > now + MIN_SLEEP_NS) {
+        uint64_t sleep = deadline - now - MIN_SLEEP_NS;
+        struct timespec duration = { .tv_sec = sleep / 1000000000, .tv_nsec = sleep % 1000000000 };
+        while (nanosleep(&duration, &duration) != 0 && errno == EINTR)
+            ;
+    }
+    while (now_ns() < deadline)
+        ;
+}
+
+static int run_op(const ReplayOp* op) {
+    switch (op->type) {
+        case TRACE_LIST: {
+            char* list = tree_list(tree, op->path);
+            int result = list ? 0 : is_valid_path(op->path) ? ENOENT : EINVAL;
+            free(list);
+            return result;
+        }
+        case TRACE_CREATE:
+            return tree_create(tree, op->path);
+        case TRACE_REMOVE:
+            return tree_remove(tree, op->path);
+        default:
+            return tree_move(tree, op->path, op->target);
+    }
+}
+
+static void* replay_main(void* arg) {
+    ReplayThread* self = arg;
+    pthread_barrier_wait(&start_barrier);
+    for (size_t i = 0; i < self->count; i++) {
+        ReplayOp* op = self->ops[i];
+        if (!config->max_speed)
+            wait_until(op->timestamp);
+        uint64_t start = now_ns();
+        int result = run_op(op);
+        hist_record(&self->latency[op->type], now_ns() - start);
+        hist_record(&self->traced_latency[op->type], op->duration);
+        if (result != op->result)
+            self->mismatched[op->type]++;
+    }
+    return NULL;
+}
+
+static void print_results(const Trace* trace, size_t n_threads, ReplayThread* threads, double elapsed) {
+    printf("{\n");
+    printf("  \"config\": {\"trace\": \"%s\", \"image\": %s%s%s, \"threads\": %zu, \"speed\": \"%s\"},\n",
+           config->trace, config->image ? "\"" : "", config->image ? config->image : "null",
+           config->image ? "\"" : "", n_threads, config->max_speed ? "max" : "original");
+    printf("  \"traced_ops\": %zu,\n", trace->count);
+    printf("  \"elapsed_s\": %.6f,\n", elapsed);
+
+    uint64_t total = 0, total_mismatched = 0;
+    printf("  \"operations\": {\n");
+    for (size_t type = TRACE_LIST; type < NUM_TYPES; type++) {
+        Histogram latency, traced_latency;
+        hist_init(&latency);
+        hist_init(&traced_latency);
+        uint64_t mismatched = 0;
+        for (size_t t = 0; t < n_threads; t++) {
+            hist_merge(&latency, &threads[t].latency[type]);
+            hist_merge(&traced_latency, &threads[t].traced_latency[type]);
+            mismatched += threads[t].mismatched[type];
+        }
+        total += latency.total;
+        total_mismatched += mismatched;
+        printf("    \"%s\": {\"ops\": %llu, \"mismatched\": %llu, \"ops_per_sec\": %.1f, \"latency_ns\": ",
+               type_names[type], (unsigned long long)latency.total, (unsigned long long)mismatched,
+               latency.total / elapsed);
+        hist_print_json(stdout, &latency);
+        printf(", \"traced_latency_ns\": ");
+        hist_print_json(stdout, &traced_latency);
+        printf("}%s\n", type + 1 < NUM_TYPES ? "," : "");
+    }
+    printf("  },\n");
+    printf("  \"mismatched\": %llu,\n", (unsigned long long)total_mismatched);
+    printf("  \"total_ops_per_sec\": %.1f\n", total / elapsed);
+    printf("}\n");
+}
+
+static void usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [options] TRACE\n"
+            "  -t, --threads N     number of replaying threads (default: as many as were traced)\n"
+            "  -m, --max-speed     issue operations as fast as possible, rather than at their original pace\n"
+            "  -i, --image PATH    start from a tree saved with tree_save (default: an empty tree)\n"
+            "  -s, --strict        exit with failure if any result differs from the traced one\n",
+            program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+    static const struct option options[] = {
+        { "threads", required_argument, NULL, 't' },
+        { "max-speed", no_argument, NULL, 'm' },
+        { "image", required_argument, NULL, 'i' },
+        { "strict", no_argument, NULL, 's' },
+        { NULL, 0, NULL, 0 },
+    };
+    ReplayConfig replay = { 0 };
+    int c;
+    while ((c = getopt_long(argc, argv, "t:mi:s", options, NULL)) != -1) {
+        switch (c) {
+            case 't': replay.threads = strtoul(optarg, NULL, 10); break;
+            case 'm': replay.max_speed = true; break;
+            case 'i': replay.image = optarg; break;
+            case 's': replay.strict = true; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1)
+        usage(argv[0]);
+    replay.trace = argv[optind];
+    config = &replay;
+
+    Trace trace = { 0 };
+    TraceHeader header;
+    int result = trace_read(replay.trace, &header, collect_record, &trace);
+    if (result != SUCCESS)
+        fatal("cannot read trace %s: %s", replay.trace, strerror(result));
+    qsort(trace.ops, trace.count, sizeof(ReplayOp), compare_ops);
+
+    tree = replay.image ? tree_load_mmap(replay.image) : tree_new();
+    if (!tree)
+        fatal("cannot load image %s: %s", replay.image, strerror(errno));
+    if (tree_version(tree) != header.tree_version)
+        fprintf(stderr, "Warning: the trace starts at version %llu of the tree, the replay at version %llu\n",
+                (unsigned long long)header.tree_version, (unsigned long long)tree_version(tree));
+
+    size_t n_threads = replay.threads ? replay.threads : trace.n_threads ? trace.n_threads : 1;
+    ReplayThread* threads = safe_calloc(n_threads, sizeof(ReplayThread));
+    for (size_t i = 0; i < trace.count; i++)
+        threads[trace.ops[i].thread % n_threads].count++;
+    for (size_t t = 0; t < n_threads; t++) {
+        threads[t].ops = safe_malloc((threads[t].count + 1) * sizeof(ReplayOp*));
+        threads[t].count = 0;
+    }
+    for (size_t i = 0; i < trace.count; i++) {
+        ReplayThread* thread = &threads[trace.ops[i].thread % n_threads];
+        thread->ops[thread->count++] = &trace.ops[i];
+    }
+
+    PTHREAD_CHECK(pthread_barrier_init(&start_barrier, NULL, n_threads + 1));
+    for (size_t t = 0; t < n_threads; t++) {
+        for (size_t type = 0; type < NUM_TYPES; type++) {
+            hist_init(&threads[t].latency[type]);
+            hist_init(&threads[t].traced_latency[type]);
+        }
+        PTHREAD_CHECK(pthread_create(&threads[t].thread, NULL, replay_main, &threads[t]));
+    }
+    start_ns = now_ns();
+    pthread_barrier_wait(&start_barrier);
+    for (size_t t = 0; t < n_threads; t++)
+        PTHREAD_CHECK(pthread_join(threads[t].thread, NULL));
+    double elapsed = (now_ns() - start_ns) / 1e9;
+
+    print_results(&trace, n_threads, threads, elapsed);
+    uint64_t mismatched = 0;
+    for (size_t t = 0; t < n_threads; t++) {
+        for (size_t type = 0; type < NUM_TYPES; type++)
+            mismatched += threads[t].mismatched[type];
+        free(threads[t].ops);
+    }
+    PTHREAD_CHECK(pthread_barrier_destroy(&start_barrier));
+    free(threads);
+    for (size_t i = 0; i < trace.count; i++) {
+        free(trace.ops[i].path);
+        free(trace.ops[i].target);
+    }
+    free(trace.ops);
+    tree_free(tree);
+    return replay.strict && mismatched > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}